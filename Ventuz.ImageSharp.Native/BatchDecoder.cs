@@ -0,0 +1,143 @@
+﻿/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute 
+ * it and/or modify it under the terms of the GNU Lesser General 
+ * Public License as published by the Free Software Foundation, 
+ * either version 3 of the License, or (at your option) any later 
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will 
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied 
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System.Runtime.InteropServices;
+
+using SixLabors.ImageSharp;
+using SixLabors.ImageSharp.PixelFormats;
+
+using Ventuz.ImageSharp.Native.PixelFormats;
+
+namespace Ventuz.ImageSharp.Native;
+
+public static class BatchDecoder
+{
+    /// <summary>
+    /// Decodes many AVIF, HEIC and OpenEXR files in parallel on a native work-stealing pool, balancing
+    /// large and small images across all cores. <typeparamref name="TPixel"/> must be one of
+    /// <see cref="Rgba32"/>, <see cref="Bgra32"/>, <see cref="Rgba64"/>, <see cref="RgbaHalf"/> or <see cref="RgbaVector"/>.
+    /// </summary>
+    /// <param name="completed">called from the decoding threads with the index of each file and the error, if any</param>
+    /// <returns>the images in the order of <paramref name="paths"/>, null for the ones that failed</returns>
+    public static unsafe Image<TPixel>?[] DecodeFiles<TPixel>(IReadOnlyList<string> paths, Configuration? config = null, Action<int, string?>? completed = null)
+        where TPixel : unmanaged, IPixel<TPixel>
+    {
+        ArgumentNullException.ThrowIfNull(paths);
+
+        var pixelFormat = NativeDecoder.GetNativePixelFormat<TPixel>() ?? throw new NotSupportedException($"{typeof(TPixel).Name} can't be decoded natively");
+
+        config = config?.Clone() ?? Configuration.Default.Clone();
+        config.PreferContiguousImageBuffers = true;
+
+        NativeMethods.SetLogger(Logging.Log);
+
+        int count = paths.Count;
+        var images = new Image<TPixel>?[count];
+        var pins = new System.Buffers.MemoryHandle[count];
+        var requests = new NativeDecodeRequest[count];
+        var detector = new NativeFormatDetector();
+
+        BatchAllocateDelegate allocate = (void* user, uint index, in NativeImageInfo info, ref nuint stride) =>
+        {
+            var img = new Image<TPixel>(config, (int)info.sizeX, (int)info.sizeY);
+            if ( !img.DangerousTryGetSinglePixelMemory(out var mem) )
+            {
+                img.Dispose();
+                return null;
+            }
+
+            images[index] = img;
+            pins[index] = mem.Pin();
+            return pins[index].Pointer;
+        };
+
+        BatchCompleteDelegate complete = (void* user, uint index, ErrorCode result) =>
+            completed?.Invoke((int)index, result == ErrorCode.Ok ? null : result.ToString());
+
+        try
+        {
+            for ( int i = 0; i < count; i++ )
+            {
+                requests[i].path = (char*)Marshal.StringToHGlobalUni(paths[i]);
+                requests[i].format = DetectFormat(detector, paths[i]);
+                requests[i].options.chromaUpsampling = Formats.ChromaUpsampling;
+                requests[i].options.linearize = Formats.LinearizeHdr ? 1 : 0;
+                requests[i].convert = 1;
+                requests[i].outputFormat = pixelFormat;
+            }
+
+            NativeBatchOptions options = new()
+            {
+                threads = config.MaxDegreeOfParallelism > 0 ? config.MaxDegreeOfParallelism : 0,
+                allocate = Marshal.GetFunctionPointerForDelegate(allocate),
+                complete = Marshal.GetFunctionPointerForDelegate(complete),
+            };
+
+            fixed ( NativeDecodeRequest* reqs = requests )
+                NativeMethods.DecodeBatch(reqs, (uint)count, options);
+
+            GC.KeepAlive(allocate);
+            GC.KeepAlive(complete);
+        }
+        finally
+        {
+            for ( int i = 0; i < count; i++ )
+            {
+                pins[i].Dispose();
+                Marshal.FreeHGlobal((nint)requests[i].path);
+
+                if ( requests[i].result != ErrorCode.Ok )
+                {
+                    images[i]?.Dispose();
+                    images[i] = null;
+                }
+            }
+        }
+
+        return images;
+    }
+
+    // unknown files are left to the native side to reject
+    static NativeImageFormat DetectFormat(NativeFormatDetector detector, string path)
+    {
+        Span<byte> header = stackalloc byte[detector.HeaderSize];
+        int read = 0;
+        try
+        {
+            using var fs = new FileStream(path, FileMode.Open, FileAccess.Read, FileShare.ReadWrite | FileShare.Delete, 1);
+            read = fs.ReadAtLeast(header, header.Length, false);
+        }
+        catch ( IOException )
+        {
+        }
+        catch ( UnauthorizedAccessException )
+        {
+        }
+
+        detector.TryDetectFormat(header[..read], out var format);
+        return format switch
+        {
+            Formats.OpenEXR => NativeImageFormat.OpenEXR,
+            Formats.Heic => NativeImageFormat.Heic,
+            _ => NativeImageFormat.Avif,
+        };
+    }
+}
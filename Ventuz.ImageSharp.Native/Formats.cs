@@ -24,6 +24,13 @@ using SixLabors.ImageSharp.Formats;
 
 namespace Ventuz.ImageSharp.Native;
 
+public enum ChromaUpsampling : uint
+{
+    Automatic,
+    Fastest,
+    BestQuality,
+}
+
 public static class Formats
 {
     public static void Register(Configuration? config = null)
@@ -36,6 +43,57 @@ public static class Formats
         config.ImageFormatsManager.SetDecoder(Heic.Instance, new NativeDecoder(NativeImageFormat.Heic));
     }
 
+    /// <summary>
+    /// Maximum number of threads all native decoders may use together. Setting it to 0 resets it to the number of hardware threads.
+    /// The per-image thread count is taken from <see cref="Configuration.MaxDegreeOfParallelism"/>, capped by this limit.
+    /// </summary>
+    public static int ThreadLimit
+    {
+        get => NativeMethods.GetThreadLimit();
+        set => NativeMethods.SetThreadLimit(value);
+    }
+
+    /// <summary>
+    /// Keeps decoded AVIF, HEIC and EXR images in <paramref name="directory"/>, so memory and file sources with the same content
+    /// and decode options are delivered from there next time instead of being decoded again. Entries are dropped least recently
+    /// used first once they take more than <paramref name="maxBytes"/> (0 = no limit). A null directory turns the cache off.
+    /// </summary>
+    public static void SetDecodeCache(string? directory, long maxBytes = 0)
+    {
+        if ( NativeMethods.SetDecodeCache(directory, (ulong)Math.Max(maxBytes, 0)) != ErrorCode.Ok )
+            throw new IOException($"Can't use {directory} as decode cache");
+    }
+
+    /// <summary>
+    /// Filter used for subsampled chroma when AVIF and HEIC images get converted from YUV to RGB.
+    /// </summary>
+    public static ChromaUpsampling ChromaUpsampling { get; set; }
+
+    /// <summary>
+    /// If set, PQ and HLG encoded AVIFs decoded to <see cref="PixelFormats.RgbaHalf"/> are delivered as display linear light,
+    /// with 1.0 being the 203 cd/m² reference white.
+    /// </summary>
+    public static bool LinearizeHdr { get; set; }
+
+    /// <summary>
+    /// Size of the blocks read ahead from streams that can't be decoded in place (anything but memory and local files).
+    /// 0 uses the native default of 256 KiB.
+    /// </summary>
+    public static int ReadBufferSize { get; set; }
+
+    static readonly AsyncLocal<int> decodePriority = new();
+
+    /// <summary>
+    /// Priority of the decodes started from the current thread or async flow, 0 by default. While a decode of higher priority
+    /// reads pixels, the others pause between bands and tiles, so eg. the image needed on screen can preempt background loads
+    /// (use negative values for those).
+    /// </summary>
+    public static int DecodePriority
+    {
+        get => decodePriority.Value;
+        set => decodePriority.Value = value;
+    }
+
     public static IEnumerable<IImageFormat> SupportedFormats => [Avif.Instance, OpenEXR.Instance, Heic.Instance];
 
     public sealed class Avif : IImageFormat
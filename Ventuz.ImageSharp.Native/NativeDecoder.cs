@@ -19,6 +19,8 @@
  * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+using System.Collections.Concurrent;
+
 using SixLabors.ImageSharp;
 using SixLabors.ImageSharp.Formats;
 using SixLabors.ImageSharp.PixelFormats;
@@ -26,6 +28,7 @@ using SixLabors.ImageSharp.Metadata;
 using SixLabors.ImageSharp.Metadata.Profiles.Exif;
 using SixLabors.ImageSharp.Metadata.Profiles.Xmp;
 using SixLabors.ImageSharp.Metadata.Profiles.Icc;
+using SixLabors.ImageSharp.Processing;
 
 using Ventuz.ImageSharp.Native.PixelFormats;
 
@@ -51,16 +54,21 @@ internal sealed class NativeDecoder(NativeImageFormat fmt) : IImageDecoder
     public Task<ImageInfo> IdentifyAsync(DecoderOptions options, Stream stream, CancellationToken cancellationToken = default)
         => Task.Run(() => IdentifyInternal(options, stream, cancellationToken));
 
+    // closed decoders are kept for reuse, so steady state loading doesn't set up codec contexts over and over
+    readonly ConcurrentBag<DecoderHandle> handlePool = [];
+
+    static readonly int MaxPooledHandles = Environment.ProcessorCount;
+
     // we need a per-decode cache for the delegates so they don't get GCed while decoding
-    unsafe class Instance
+    unsafe class Instance(ConcurrentBag<DecoderHandle> handlePool)
     {
-#pragma warning disable IDE0060 // Remove unused parameter
         public ImageInfo Identify(DecoderOptions options, Stream stream, NativeImageFormat format, CancellationToken cancellationToken)
-#pragma warning restore IDE0060 // Remove unused parameter
         {
+            cancellationToken.ThrowIfCancellationRequested();
+
             try
             {
-                OpenAndGetInfo(stream, format);
+                OpenAndGetInfo(options, stream, format, false);
 
                 ImageMetadata meta = new();
                 if ( !options.SkipMetadata )
@@ -74,19 +82,39 @@ internal sealed class NativeDecoder(NativeImageFormat fmt) : IImageDecoder
             }
         }
 
-#pragma warning disable IDE0060 // Remove unused parameter
-        public Image Decode(DecoderOptions options, Stream stream, NativeImageFormat format, CancellationToken cancellationToken)
-#pragma warning restore IDE0060 // Remove unused parameter
+        public Image Decode(DecoderOptions options, Stream stream, NativeImageFormat format, NativePixelFormat? outputFormat, CancellationToken cancellationToken)
         {
+            cancellationToken.ThrowIfCancellationRequested();
+
             var config = options.Configuration.Clone();
             config.PreferContiguousImageBuffers = true;
 
             Image? image = null;
             System.Buffers.MemoryHandle pixels = new();
+            Func<ErrorCode>? decodeBanded = null;
 
             try
             {
-                OpenAndGetInfo(stream, format);
+                OpenAndGetInfo(options, stream, format, true);
+
+                // HDR images need half floats to come out linear
+                if ( outputFormat == null && Formats.LinearizeHdr && info.format == NativePixelFormat.RGBA_UN16 && info.transferCharacteristics is 16 or 18 )
+                    outputFormat = NativePixelFormat.RGBA_F16;
+
+                // let the native side write the requested pixel type directly if it can
+                NativePixelFormat pixelFormat = info.format;
+                if ( outputFormat is NativePixelFormat output && output != info.format &&
+                    NativeMethods.SetOutputFormat(decoder, output, AlphaMode.Unknown) == ErrorCode.Ok )
+                {
+                    pixelFormat = output;
+
+                    // only the pixel side changed, the metadata sizes are still valid
+                    var source = info;
+                    ThrowOnError(NativeMethods.GetImageInfo(decoder, MetadataKind.None, out info));
+                    info.exifSize = source.exifSize;
+                    info.xmpSize = source.xmpSize;
+                    info.iccSize = source.iccSize;
+                }
 
                 void CreateAndPin<TPixel>() where TPixel : unmanaged, IPixel<TPixel>
                 {
@@ -94,25 +122,56 @@ internal sealed class NativeDecoder(NativeImageFormat fmt) : IImageDecoder
                     image = img;
 
                     if ( !img.DangerousTryGetSinglePixelMemory(out var mem) )
-                        ThrowOnError(ErrorCode.ImageTooLarge);
+                    {
+                        // too large for a single buffer: decode in bands straight into the pixel rows
+                        decodeBanded = () => DecodeBanded(img);
+                        return;
+                    }
 
                     pixels = mem.Pin();
                 }
 
-                switch ( info.format )
+                switch ( pixelFormat )
                 {
                     case NativePixelFormat.RGBA_UN8: CreateAndPin<Rgba32>(); break;
+                    case NativePixelFormat.BGRA_UN8: CreateAndPin<Bgra32>(); break;
                     case NativePixelFormat.RGBA_UN16: CreateAndPin<Rgba64>(); break;
                     case NativePixelFormat.RGBA_F16: CreateAndPin<RgbaHalf>(); break;
                     case NativePixelFormat.R_F16: CreateAndPin<RHalf>(); break;
+                    case NativePixelFormat.R_F32: CreateAndPin<RFloat>(); break;
+                    case NativePixelFormat.RGBA_F32: CreateAndPin<RgbaVector>(); break;
+                    case NativePixelFormat.RGB_F16: CreateAndPin<RgbHalf>(); break;
+                    case NativePixelFormat.RGB_F32: CreateAndPin<RgbFloat>(); break;
                     default: throw new NotImplementedException();
                 }
 
                 if ( !options.SkipMetadata )
                     FillMetadata(image!.Metadata);
 
-                var err = NativeMethods.GetImageData(decoder, pixels.Pointer);
+                // the native side checks for cancellation and higher priority decodes between bands and tiles
+                ThrowOnError(NativeMethods.CreateDecodeControl(Formats.DecodePriority, out control));
+                ThrowOnError(NativeMethods.SetDecodeControl(decoder, control));
+                using var registration = cancellationToken.Register(static c => NativeMethods.CancelDecode((DecodeControlHandle)c!), control);
+
+                var err = decodeBanded != null ? decodeBanded() : NativeMethods.GetImageData(decoder, pixels.Pointer);
+                if ( err == ErrorCode.Cancelled )
+                    cancellationToken.ThrowIfCancellationRequested();
                 ThrowOnError(err);
+
+                // the native side only gets us close to the target size
+                if ( options.TargetSize is Size target )
+                {
+                    float scale = 1;
+                    if ( target.Width > 0 ) scale = Math.Min(scale, (float)target.Width / image!.Width);
+                    if ( target.Height > 0 ) scale = Math.Min(scale, (float)target.Height / image!.Height);
+
+                    if ( scale < 1 )
+                    {
+                        int width = Math.Max((int)MathF.Round(image!.Width * scale), 1);
+                        int height = Math.Max((int)MathF.Round(image.Height * scale), 1);
+                        image.Mutate(x => x.Resize(width, height, options.Sampler));
+                    }
+                }
             }
             catch
             {
@@ -128,39 +187,149 @@ internal sealed class NativeDecoder(NativeImageFormat fmt) : IImageDecoder
             return image!;
         }
 
+        const uint BandRows = 64;
+
+        unsafe ErrorCode DecodeBanded<TPixel>(Image<TPixel> img) where TPixel : unmanaged, IPixel<TPixel>
+        {
+            BandDelegate callback = (y, rows, data, stride) =>
+            {
+                for ( uint i = 0; i < rows; i++ )
+                {
+                    var src = new ReadOnlySpan<TPixel>((byte*)data + i * stride, img.Width);
+                    src.CopyTo(img.DangerousGetPixelRowMemory((int)(y + i)).Span);
+                }
+                return 1;
+            };
+
+            var err = NativeMethods.GetImageDataBanded(decoder, BandRows, null, 0, 0, callback);
+            GC.KeepAlive(callback);
+            return err;
+        }
+
         SeekDelegate? seekDelegate;
         ReadDelegate? readDelegate;
+        System.Buffers.MemoryHandle sourceMemory;
         DecoderHandle decoder;
+        DecodeControlHandle control;
         NativeImageInfo info;
+        NativeImageFormat format;
 
-        void OpenAndGetInfo(Stream stream, NativeImageFormat format)
+        void OpenAndGetInfo(DecoderOptions options, Stream stream, NativeImageFormat format, bool useTargetSize)
         {
-            readDelegate = (ptr, size) => stream.Read(new Span<byte>(ptr, size));
-            seekDelegate = stream.Seek;
-            var err = NativeMethods.OpenDecoder(format, readDelegate, seekDelegate, out decoder);
+            this.format = format;
+            int parallelism = options.Configuration.MaxDegreeOfParallelism;
+            NativeDecodeOptions nativeOptions = new()
+            {
+                threads = parallelism > 0 ? parallelism : 0,
+                chromaUpsampling = Formats.ChromaUpsampling,
+                linearize = Formats.LinearizeHdr ? 1 : 0,
+                readBufferSize = (uint)Math.Max(Formats.ReadBufferSize, 0),
+            };
+
+            if ( useTargetSize && options.TargetSize is Size target )
+            {
+                nativeOptions.targetSizeX = (uint)Math.Max(target.Width, 0);
+                nativeOptions.targetSizeY = (uint)Math.Max(target.Height, 0);
+            }
+
+            bool pooled = handlePool.TryTake(out decoder);
+
+            ErrorCode err = ErrorCode.IOError;
+            if ( TryGetSourceMemory(stream, out var memData, out var memSize) )
+            {
+                // in-memory streams get decoded in place without going through the delegates
+                err = pooled
+                    ? NativeMethods.ResetDecoderFromMemory(decoder, memData, memSize, nativeOptions)
+                    : NativeMethods.OpenDecoderFromMemory(format, memData, memSize, nativeOptions, out decoder);
+            }
+            else if ( stream is FileStream fs && !fs.CanWrite )
+            {
+                // local files get mapped natively; if that fails (eg. sharing mode) we go through the stream after all
+                err = pooled
+                    ? NativeMethods.ResetDecoderFromFile(decoder, fs.Name, nativeOptions)
+                    : NativeMethods.OpenDecoderFromFile(format, fs.Name, nativeOptions, out decoder);
+            }
+
+            if ( err == ErrorCode.IOError )
+            {
+                readDelegate = (ptr, size) => stream.Read(new Span<byte>(ptr, size));
+                seekDelegate = stream.Seek;
+                err = pooled
+                    ? NativeMethods.ResetDecoder(decoder, readDelegate, seekDelegate, nativeOptions)
+                    : NativeMethods.OpenDecoder(format, readDelegate, seekDelegate, nativeOptions, out decoder);
+            }
             ThrowOnError(err);
 
-            err = NativeMethods.GetImageInfo(decoder, out info);
+            // metadata is only extracted if it's going to be used
+            var metadata = options.SkipMetadata ? MetadataKind.None : MetadataKind.Exif | MetadataKind.Xmp | MetadataKind.Icc;
+            err = NativeMethods.GetImageInfo(decoder, metadata, out info);
             ThrowOnError(err);
         }
 
         void Close()
         {
-            NativeMethods.CloseDecoder(ref decoder);
+            if ( decoder.IsValid )
+            {
+                NativeMetrics.Record(decoder, format);
+
+                // pooled handles must not hold on to the source or what was decoded from it
+                if ( handlePool.Count < MaxPooledHandles && NativeMethods.ResetDecoder(decoder, null, null, default(NativeDecodeOptions)) == ErrorCode.Ok )
+                {
+                    handlePool.Add(decoder);
+                    decoder = default;
+                }
+                else
+                    NativeMethods.CloseDecoder(ref decoder);
+            }
+
+            // the decoder doesn't refer to it anymore after being reset or closed
+            if ( control.IsValid )
+                NativeMethods.DestroyDecodeControl(ref control);
+
             readDelegate = null;
             seekDelegate = null;
+            sourceMemory.Dispose();
+            sourceMemory = default;
+        }
+
+        bool TryGetSourceMemory(Stream stream, out void* data, out nuint size)
+        {
+            data = null;
+            size = 0;
+
+            if ( stream is MemoryStream ms && ms.TryGetBuffer(out var segment) && segment.Count > 0 )
+            {
+                sourceMemory = segment.AsMemory().Pin();
+                data = sourceMemory.Pointer;
+                size = (nuint)segment.Count;
+            }
+            else if ( stream is UnmanagedMemoryStream ums && ums.Length > 0 )
+            {
+                // streams over a SafeBuffer don't expose a pointer
+                try
+                {
+                    data = ums.PositionPointer - ums.Position;
+                    size = (nuint)ums.Length;
+                }
+                catch ( NotSupportedException )
+                {
+                    return false;
+                }
+            }
+
+            return data != null;
         }
 
         void FillMetadata(ImageMetadata meta)
         {
-            if ( info.exifSize > 0 )
-                meta.ExifProfile = new ExifProfile(new Span<byte>(info.exifData, info.exifSize).ToArray());
+            if ( ReadMetadata(MetadataKind.Exif, info.exifSize) is byte[] exif )
+                meta.ExifProfile = new ExifProfile(exif);
 
-            if ( info.xmpSize > 0 )
-                meta.XmpProfile = new XmpProfile(new Span<byte>(info.xmpData, info.xmpSize).ToArray());
+            if ( ReadMetadata(MetadataKind.Xmp, info.xmpSize) is byte[] xmp )
+                meta.XmpProfile = new XmpProfile(xmp);
 
-            if ( info.iccSize > 0 )
-                meta.IccProfile = new IccProfile(new Span<byte>(info.iccData, info.iccSize).ToArray());
+            if ( ReadMetadata(MetadataKind.Icc, info.iccSize) is byte[] icc )
+                meta.IccProfile = new IccProfile(icc);
 
             if ( info.colorPrimaries != 2 || info.transferCharacteristics != 2 )
                 meta.CicpProfile = new SixLabors.ImageSharp.Metadata.Profiles.Cicp.CicpProfile((byte)info.colorPrimaries, (byte)info.transferCharacteristics, 0, true);
@@ -173,6 +342,21 @@ internal sealed class NativeDecoder(NativeImageFormat fmt) : IImageDecoder
             }
         }
 
+        // copied straight into the array the profile keeps
+        byte[]? ReadMetadata(MetadataKind kind, uint size)
+        {
+            if ( size == 0 )
+                return null;
+
+            var data = new byte[size];
+            fixed ( byte* ptr = data )
+            {
+                if ( NativeMethods.GetMetadata(decoder, kind, ptr, ref size) != ErrorCode.Ok || size != data.Length )
+                    return null;
+            }
+            return data;
+        }
+
         static PixelTypeInfo GetPixelTypeInfo(in NativeImageInfo info)
         {
             PixelAlphaRepresentation alpha = info.alpha switch
@@ -188,6 +372,11 @@ internal sealed class NativeDecoder(NativeImageFormat fmt) : IImageDecoder
                 NativePixelFormat.RGBA_UN16 => new(64, alpha),
                 NativePixelFormat.RGBA_F16 => new(64, alpha),
                 NativePixelFormat.R_F16 => new(16, alpha),
+                NativePixelFormat.R_F32 => new(32, alpha),
+                NativePixelFormat.RGBA_F32 => new(128, alpha),
+                NativePixelFormat.RGB_F16 => new(48, alpha),
+                NativePixelFormat.RGB_F32 => new(96, alpha),
+                NativePixelFormat.BGRA_UN8 => new(32, alpha),
                 _ => throw new NotImplementedException(),
             };
         }
@@ -207,22 +396,33 @@ internal sealed class NativeDecoder(NativeImageFormat fmt) : IImageDecoder
 
         NativeMethods.SetLogger(Logging.Log);
 
-        return new Instance().Identify(options, stream, format, cancellationToken);
+        return new Instance(handlePool).Identify(options, stream, format, cancellationToken);
     }
 
-    Image DecodeInternal(DecoderOptions options, Stream stream, CancellationToken cancellationToken)
+    Image DecodeInternal(DecoderOptions options, Stream stream, CancellationToken cancellationToken, NativePixelFormat? outputFormat = null)
     {
         ArgumentNullException.ThrowIfNull(options);
         ArgumentNullException.ThrowIfNull(stream);
 
         NativeMethods.SetLogger(Logging.Log);
 
-        return new Instance().Decode(options, stream, format, cancellationToken);
+        return new Instance(handlePool).Decode(options, stream, format, outputFormat, cancellationToken);
+    }
+
+    // pixel types the native side can convert to while decoding
+    internal static NativePixelFormat? GetNativePixelFormat<TPixel>() where TPixel : unmanaged, IPixel<TPixel>
+    {
+        if ( typeof(TPixel) == typeof(Rgba32) ) return NativePixelFormat.RGBA_UN8;
+        if ( typeof(TPixel) == typeof(Bgra32) ) return NativePixelFormat.BGRA_UN8;
+        if ( typeof(TPixel) == typeof(Rgba64) ) return NativePixelFormat.RGBA_UN16;
+        if ( typeof(TPixel) == typeof(RgbaHalf) ) return NativePixelFormat.RGBA_F16;
+        if ( typeof(TPixel) == typeof(RgbaVector) ) return NativePixelFormat.RGBA_F32;
+        return null;
     }
 
     Image<TPixel> DecodeInternal<TPixel>(DecoderOptions options, Stream stream, CancellationToken cancellationToken) where TPixel : unmanaged, IPixel<TPixel>
     {
-        Image image = DecodeInternal(options, stream, cancellationToken);
+        Image image = DecodeInternal(options, stream, cancellationToken, GetNativePixelFormat<TPixel>());
 
         if ( image is not Image<TPixel> outImage )
         {
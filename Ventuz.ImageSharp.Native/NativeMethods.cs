@@ -31,6 +31,11 @@ internal enum ErrorCode : uint
     InternalError,
     ImageTooLarge,
     Unknown,
+    IOError,
+    Cancelled,
+    EndOfStream,
+    BufferTooSmall,
+    Incomplete,
 }
 
 internal enum NativeImageFormat : uint
@@ -46,6 +51,68 @@ internal enum NativePixelFormat : uint
     RGBA_UN16,
     RGBA_F16,
     R_F16,
+    R_F32,
+    RGBA_F32,
+    RGB_F16,
+    RGB_F32,
+    BGRA_UN8,
+
+    // planar YCbCr, only through GetImageDataPlanar
+    YUV420_P8,
+    YUV422_P8,
+    YUV444_P8,
+    YUV420_P16,
+    YUV422_P16,
+    YUV444_P16,
+    YUV420_SP8,
+    YUV422_SP8,
+    YUV444_SP8,
+    YUV420_SP16,
+    YUV422_SP16,
+    YUV444_SP16,
+}
+
+internal enum ChromaSubsampling : uint
+{
+    None,
+    Yuv420,
+    Yuv422,
+    Yuv444,
+    Yuv400,
+}
+
+internal enum ColorPrimaries : uint
+{
+    Source,
+    Rec709,
+    Rec2020,
+    DisplayP3,
+    ACEScg,
+}
+
+internal enum TransferFunction : uint
+{
+    Source,
+    Linear,
+    Srgb,
+    Bt1886,
+    PQ,
+    HLG,
+}
+
+internal enum NativeBlockFormat : uint
+{
+    BC1,
+    BC3,
+    BC7,
+    BC6H,
+}
+
+internal enum BlockQuality : uint
+{
+    Fast,
+    Normal,
+    Best,
 }
 
 internal enum AlphaMode : uint
@@ -56,7 +123,7 @@ internal enum AlphaMode : uint
 }
 
 [StructLayout(LayoutKind.Sequential)]
-internal unsafe struct NativeImageInfo
+internal struct NativeImageInfo
 {
     // general
     public uint sizeX;
@@ -67,25 +134,160 @@ internal unsafe struct NativeImageInfo
     // CICP
     public int colorPrimaries;
     public int transferCharacteristics;
+    public int matrixCoefficients;
+    public int fullRange;
 
     // chromaticities
     public float cRx, cRy, cGx, cGy, cBx, cBy, cWx, cWy;
 
-    // metadata (valid as long as the decoder is alive)
-    public void* exifData;
-    public int exifSize;
-    public void* xmpData;
-    public int xmpSize;
-    public void* iccData;
-    public int iccSize;
+    // YCbCr storage, for the planar formats
+    public ChromaSubsampling subsampling;
+    public uint bitDepth;
+
+    // metadata sizes, if requested (see GetMetadata)
+    public uint exifSize;
+    public uint xmpSize;
+    public uint iccSize;
+}
+
+[Flags]
+internal enum MetadataKind : uint
+{
+    None = 0,
+    Exif = 1,
+    Xmp = 2,
+    Icc = 4,
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal struct NativeDecodeOptions
+{
+    // 0 = up to the process wide limit
+    public int threads;
+
+    // 0 = no constraint
+    public uint targetSizeX;
+    public uint targetSizeY;
+
+    public ChromaUpsampling chromaUpsampling;
+    public int linearize;
+
+    // read-ahead block size for stream sources, 0 = default
+    public uint readBufferSize;
+
+    // incremental decode: bytes of the source there so far, 0 = all of it
+    public ulong available;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal struct NativeDecodeProgress
+{
+    public uint rowsComplete;
+    public uint layers;
+    public uint layerCount;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal struct DecoderStats
+{
+    // nanoseconds, summed over threads
+    public ulong parseTime;
+    public ulong decodeTime;
+    public ulong convertTime;
+    public ulong copyTime;
+    public ulong readTime;
+
+    public ulong readCalls;
+    public ulong seekCalls;
+    public ulong bytesRead;
+    public ulong seekDistance;
+
+    // tracked buffers only, not codec internals
+    public ulong peakMemory;
+    public int threads;
+}
+
+// 0 = Y, 1 = Cb (CbCr for the SP formats), 2 = Cr, 3 = alpha
+[StructLayout(LayoutKind.Sequential)]
+internal unsafe struct NativePlane
+{
+    public void* memory;
+    public nuint stride;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal unsafe struct NativePlaneLayout
+{
+    public fixed uint width[4];
+    public fixed uint height[4];
+
+    // size_t, the library is x64 only
+    public fixed ulong rowBytes[4];
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal struct NativeFrameTiming
+{
+    public ulong timescale;
+    public double pts;
+    public ulong ptsInTimescales;
+    public double duration;
+    public ulong durationInTimescales;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal unsafe struct NativeDecodeRequest
+{
+    public NativeImageFormat format;
+
+    // source: data/size if set, the file at path otherwise
+    public void* data;
+    public nuint size;
+    public char* path;
+
+    public NativeDecodeOptions options;
+
+    public int convert;
+    public NativePixelFormat outputFormat;
+    public AlphaMode outputAlpha;
+
+    // null = use the batch's allocate callback
+    public void* memory;
+    public nuint stride;
+    public nuint capacity;
+
+    // results
+    public ErrorCode result;
+    public uint sizeX;
+    public uint sizeY;
+    public NativePixelFormat pixelFormat;
+}
+
+[StructLayout(LayoutKind.Sequential)]
+internal unsafe struct NativeBatchOptions
+{
+    public int threads;
+
+    // function pointers for BatchAllocateDelegate and BatchCompleteDelegate
+    public nint allocate;
+    public nint complete;
+    public void* user;
 }
 
 internal readonly struct DecoderHandle
 {
     public DecoderHandle() { }
-#pragma warning disable IDE0052 // Remove unread private members
     readonly nint handle = nint.Zero;
-#pragma warning restore IDE0052 // Remove unread private members
+
+    public bool IsValid => handle != nint.Zero;
+}
+
+internal readonly struct DecodeControlHandle
+{
+    public DecodeControlHandle() { }
+    readonly nint handle = nint.Zero;
+
+    public bool IsValid => handle != nint.Zero;
 }
 
 internal delegate void LogDelegate(Logging.Level level, [MarshalAs(UnmanagedType.LPUTF8Str)] string log);
@@ -94,6 +296,14 @@ internal unsafe delegate int ReadDelegate(void* ptr, int size);
 
 internal delegate long SeekDelegate(long pos, SeekOrigin origin);
 
+internal unsafe delegate void* BatchAllocateDelegate(void* user, uint index, in NativeImageInfo info, ref nuint stride);
+
+internal unsafe delegate void BatchCompleteDelegate(void* user, uint index, ErrorCode result);
+
+internal unsafe delegate int BandDelegate(uint y, uint rows, void* data, nuint stride);
+
+internal unsafe delegate void DecodeCompleteDelegate(void* user, ErrorCode result);
+
 internal static partial class NativeMethods
 {
     const string DLLNAME = "Ventuz.Native.ImageFormats.dll";
@@ -102,14 +312,104 @@ internal static partial class NativeMethods
     public static partial void SetLogger(LogDelegate log);
 
     [LibraryImport(DLLNAME)]
-    public static partial ErrorCode OpenDecoder(NativeImageFormat fmt, ReadDelegate read, SeekDelegate seek, out DecoderHandle decoder);
+    public static partial void SetThreadLimit(int threads);
+
+    [LibraryImport(DLLNAME)]
+    public static partial int GetThreadLimit();
+
+    [LibraryImport(DLLNAME, StringMarshalling = StringMarshalling.Utf16)]
+    public static partial ErrorCode SetDecodeCache(string? directory, ulong maxBytes);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode OpenDecoder(NativeImageFormat fmt, ReadDelegate read, SeekDelegate seek, in NativeDecodeOptions options, out DecoderHandle decoder);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode OpenDecoderFromMemory(NativeImageFormat fmt, void* data, nuint size, in NativeDecodeOptions options, out DecoderHandle decoder);
+
+    [LibraryImport(DLLNAME, StringMarshalling = StringMarshalling.Utf16)]
+    public static partial ErrorCode OpenDecoderFromFile(NativeImageFormat fmt, string path, in NativeDecodeOptions options, out DecoderHandle decoder);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode ResetDecoder(DecoderHandle decoder, ReadDelegate? read, SeekDelegate? seek, in NativeDecodeOptions options);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode ResetDecoderFromMemory(DecoderHandle decoder, void* data, nuint size, in NativeDecodeOptions options);
+
+    [LibraryImport(DLLNAME, StringMarshalling = StringMarshalling.Utf16)]
+    public static partial ErrorCode ResetDecoderFromFile(DecoderHandle decoder, string path, in NativeDecodeOptions options);
 
     [LibraryImport(DLLNAME)]
     public static partial void CloseDecoder(ref DecoderHandle decoder);
 
     [LibraryImport(DLLNAME)]
-    public static partial ErrorCode GetImageInfo(DecoderHandle decoder, out NativeImageInfo info);
+    public static partial ErrorCode GetImageInfo(DecoderHandle decoder, MetadataKind metadata, out NativeImageInfo info);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode GetMetadata(DecoderHandle decoder, MetadataKind kind, void* buffer, ref uint size);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode GetDecoderStats(DecoderHandle decoder, out DecoderStats stats);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode SetOutputFormat(DecoderHandle decoder, NativePixelFormat format, AlphaMode alpha);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode SetOutputColorSpace(DecoderHandle decoder, ColorPrimaries primaries, TransferFunction transfer);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode GetPlaneLayout(DecoderHandle decoder, out NativePlaneLayout layout);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode GetImageDataPlanar(DecoderHandle decoder, NativePlane* planes);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode GetImageDataCompressed(DecoderHandle decoder, NativeBlockFormat format, BlockQuality quality, void* memory, nuint stride);
 
     [LibraryImport(DLLNAME)]
     public static unsafe partial ErrorCode GetImageData(DecoderHandle decoder, void* memory);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode GetImageDataRegion(DecoderHandle decoder, uint x, uint y, uint width, uint height, void* memory, nuint stride);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode NotifyDataAvailable(DecoderHandle decoder, ulong available);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode GetDecodeProgress(DecoderHandle decoder, out NativeDecodeProgress progress);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode GetFrameCount(DecoderHandle decoder, out uint count);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode GetFrameTiming(DecoderHandle decoder, uint index, out NativeFrameTiming timing);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode DecodeNextFrame(DecoderHandle decoder, void* memory);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode SeekToFrame(DecoderHandle decoder, uint index);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode DecodeBatch(NativeDecodeRequest* requests, uint count, in NativeBatchOptions options);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode GetImageDataBanded(DecoderHandle decoder, uint bandRows, void** buffers, uint numBuffers, nuint stride, BandDelegate callback);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode CreateDecodeControl(int priority, out DecodeControlHandle control);
+
+    [LibraryImport(DLLNAME)]
+    public static partial void DestroyDecodeControl(ref DecodeControlHandle control);
+
+    [LibraryImport(DLLNAME)]
+    public static partial void CancelDecode(DecodeControlHandle control);
+
+    [LibraryImport(DLLNAME)]
+    public static partial void SetDecodePriority(DecodeControlHandle control, int priority);
+
+    [LibraryImport(DLLNAME)]
+    public static partial ErrorCode SetDecodeControl(DecoderHandle decoder, DecodeControlHandle control);
+
+    [LibraryImport(DLLNAME)]
+    public static unsafe partial ErrorCode DecodeAsync(DecoderHandle decoder, void* memory, nuint stride, DecodeControlHandle control, DecodeCompleteDelegate complete, void* user);
 }
\ No newline at end of file
@@ -0,0 +1,67 @@
+﻿/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute 
+ * it and/or modify it under the terms of the GNU Lesser General 
+ * Public License as published by the Free Software Foundation, 
+ * either version 3 of the License, or (at your option) any later 
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will 
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied 
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System.Diagnostics.Metrics;
+
+namespace Ventuz.ImageSharp.Native;
+
+// publishes the native decoders' counters (see GetDecoderStats) through System.Diagnostics.Metrics,
+// once per decode, tagged with the image format
+internal static class NativeMetrics
+{
+    static readonly Meter meter = new("Ventuz.ImageSharp.Native");
+
+    static readonly Histogram<double> phaseTime = meter.CreateHistogram<double>("native.decode.phase_time", "ms", "time spent per decode phase, summed over threads");
+    static readonly Histogram<long> peakMemory = meter.CreateHistogram<long>("native.decode.peak_memory", "By", "peak of the buffers a decode held");
+    static readonly Histogram<int> threads = meter.CreateHistogram<int>("native.decode.threads", "{thread}", "threads a decode could use");
+    static readonly Counter<long> readCalls = meter.CreateCounter<long>("native.source.reads", "{call}", "Read callbacks into streams");
+    static readonly Counter<long> seekCalls = meter.CreateCounter<long>("native.source.seeks", "{call}", "Seek callbacks into streams");
+    static readonly Counter<long> bytesRead = meter.CreateCounter<long>("native.source.bytes_read", "By", "bytes read from streams");
+    static readonly Counter<long> seekDistance = meter.CreateCounter<long>("native.source.seek_distance", "By", "bytes skipped by seeks in streams");
+
+    public static bool Enabled => phaseTime.Enabled || peakMemory.Enabled || threads.Enabled || readCalls.Enabled ||
+        seekCalls.Enabled || bytesRead.Enabled || seekDistance.Enabled;
+
+    public static void Record(DecoderHandle decoder, NativeImageFormat format)
+    {
+        if ( !Enabled || NativeMethods.GetDecoderStats(decoder, out var stats) != ErrorCode.Ok )
+            return;
+
+        var tag = new KeyValuePair<string, object?>("format", format.ToString());
+        RecordPhase(stats.parseTime, "parse", tag);
+        RecordPhase(stats.decodeTime, "decode", tag);
+        RecordPhase(stats.convertTime, "convert", tag);
+        RecordPhase(stats.copyTime, "copy", tag);
+        RecordPhase(stats.readTime, "read", tag);
+
+        peakMemory.Record((long)stats.peakMemory, tag);
+        threads.Record(stats.threads, tag);
+        readCalls.Add((long)stats.readCalls, tag);
+        seekCalls.Add((long)stats.seekCalls, tag);
+        bytesRead.Add((long)stats.bytesRead, tag);
+        seekDistance.Add((long)stats.seekDistance, tag);
+    }
+
+    static void RecordPhase(ulong nanoseconds, string phase, KeyValuePair<string, object?> format)
+    {
+        phaseTime.Record(nanoseconds / 1e6, format, new KeyValuePair<string, object?>("phase", phase));
+    }
+}
@@ -0,0 +1,160 @@
+﻿/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute 
+ * it and/or modify it under the terms of the GNU Lesser General 
+ * Public License as published by the Free Software Foundation, 
+ * either version 3 of the License, or (at your option) any later 
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will 
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied 
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System.Numerics;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+
+using SixLabors.ImageSharp.PixelFormats;
+
+namespace Ventuz.ImageSharp.Native.PixelFormats;
+
+/// <summary>
+/// Pixel type containing a single 32 bit floating point value.
+/// <para>
+/// Ranges from [0, 0, 0, 0] to [1, 0, 0, 1] in vector form.
+/// </para>
+/// </summary>
+[StructLayout(LayoutKind.Sequential)]
+public partial struct RFloat : IPixel<RFloat>
+{
+    /// <summary>
+    /// Gets or sets the red component.
+    /// </summary>
+    public float R;
+
+    /// <summary>
+    /// Initializes a new instance of the <see cref="RFloat"/> struct.
+    /// </summary>
+    /// <param name="value">The single component value.</param>
+    public RFloat(float value) => this.R = value;
+
+    /// <summary>
+    /// Compares two <see cref="RFloat"/> objects for equality.
+    /// </summary>
+    /// <param name="left">The <see cref="RFloat"/> on the left side of the operand.</param>
+    /// <param name="right">The <see cref="RFloat"/> on the right side of the operand.</param>
+    /// <returns>
+    /// True if the <paramref name="left"/> parameter is equal to the <paramref name="right"/> parameter; otherwise, false.
+    /// </returns>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public static bool operator ==(RFloat left, RFloat right) => left.Equals(right);
+
+    /// <summary>
+    /// Compares two <see cref="RFloat"/> objects for equality.
+    /// </summary>
+    /// <param name="left">The <see cref="RFloat"/> on the left side of the operand.</param>
+    /// <param name="right">The <see cref="RFloat"/> on the right side of the operand.</param>
+    /// <returns>
+    /// True if the <paramref name="left"/> parameter is not equal to the <paramref name="right"/> parameter; otherwise, false.
+    /// </returns>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public static bool operator !=(RFloat left, RFloat right) => !left.Equals(right);
+
+    /// <inheritdoc />
+    public readonly PixelOperations<RFloat> CreatePixelOperations() => new();
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromScaledVector4(Vector4 vector) => this.R = vector.X;
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public readonly Vector4 ToScaledVector4() => new(this.R, 0, 0, 1F);
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromVector4(Vector4 vector) => this.R = vector.X;
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public readonly Vector4 ToVector4() => new(this.R, 0, 0, 1F);
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromArgb32(Argb32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromBgr24(Bgr24 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromBgra32(Bgra32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromAbgr32(Abgr32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromBgra5551(Bgra5551 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromL8(L8 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromL16(L16 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromLa16(La16 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromLa32(La32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromRgb24(Rgb24 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromRgba32(Rgba32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public readonly void ToRgba32(ref Rgba32 dest) => dest.FromScaledVector4(this.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromRgb48(Rgb48 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromRgba64(Rgba64 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    public override readonly bool Equals(object? obj) => obj is RFloat other && this.Equals(other);
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public readonly bool Equals(RFloat other) => this.R.Equals(other.R);
+
+    /// <inheritdoc />
+    public override readonly string ToString() => FormattableString.Invariant($"RFloat({this.R:#0.##})");
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public override readonly int GetHashCode() => this.R.GetHashCode();
+}
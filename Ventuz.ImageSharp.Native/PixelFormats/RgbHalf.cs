@@ -0,0 +1,186 @@
+﻿/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute 
+ * it and/or modify it under the terms of the GNU Lesser General 
+ * Public License as published by the Free Software Foundation, 
+ * either version 3 of the License, or (at your option) any later 
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will 
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied 
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+using System.Numerics;
+using System.Runtime.CompilerServices;
+using System.Runtime.InteropServices;
+
+using SixLabors.ImageSharp.PixelFormats;
+
+namespace Ventuz.ImageSharp.Native.PixelFormats;
+
+/// <summary>
+/// Pixel type containing three 16-bit floating-point values, without alpha.
+/// <para>
+/// Ranges from [0, 0, 0, 1] to [1, 1, 1, 1] in vector form.
+/// </para>
+/// </summary>
+[StructLayout(LayoutKind.Sequential)]
+public partial struct RgbHalf : IPixel<RgbHalf>
+{
+    /// <summary>
+    /// Gets or sets the red component.
+    /// </summary>
+    public Half R;
+
+    /// <summary>
+    /// Gets or sets the green component.
+    /// </summary>
+    public Half G;
+
+    /// <summary>
+    /// Gets or sets the blue component.
+    /// </summary>
+    public Half B;
+
+    /// <summary>
+    /// Initializes a new instance of the <see cref="RgbHalf"/> struct.
+    /// </summary>
+    /// <param name="r">The red component.</param>
+    /// <param name="g">The green component.</param>
+    /// <param name="b">The blue component.</param>
+    public RgbHalf(float r, float g, float b)
+    {
+        this.R = (Half)r;
+        this.G = (Half)g;
+        this.B = (Half)b;
+    }
+
+    /// <summary>
+    /// Compares two <see cref="RgbHalf"/> objects for equality.
+    /// </summary>
+    /// <param name="left">The <see cref="RgbHalf"/> on the left side of the operand.</param>
+    /// <param name="right">The <see cref="RgbHalf"/> on the right side of the operand.</param>
+    /// <returns>
+    /// True if the <paramref name="left"/> parameter is equal to the <paramref name="right"/> parameter; otherwise, false.
+    /// </returns>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public static bool operator ==(RgbHalf left, RgbHalf right) => left.Equals(right);
+
+    /// <summary>
+    /// Compares two <see cref="RgbHalf"/> objects for equality.
+    /// </summary>
+    /// <param name="left">The <see cref="RgbHalf"/> on the left side of the operand.</param>
+    /// <param name="right">The <see cref="RgbHalf"/> on the right side of the operand.</param>
+    /// <returns>
+    /// True if the <paramref name="left"/> parameter is not equal to the <paramref name="right"/> parameter; otherwise, false.
+    /// </returns>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public static bool operator !=(RgbHalf left, RgbHalf right) => !left.Equals(right);
+
+    /// <inheritdoc />
+    public readonly PixelOperations<RgbHalf> CreatePixelOperations() => new();
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromScaledVector4(Vector4 vector) => this.FromVector4(vector);
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public readonly Vector4 ToScaledVector4() => this.ToVector4();
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromVector4(Vector4 vector)
+    {
+        this.R = (Half)vector.X;
+        this.G = (Half)vector.Y;
+        this.B = (Half)vector.Z;
+    }
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public readonly Vector4 ToVector4() => new((float)this.R, (float)this.G, (float)this.B, 1F);
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromArgb32(Argb32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromBgr24(Bgr24 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromBgra32(Bgra32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromAbgr32(Abgr32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromBgra5551(Bgra5551 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromL8(L8 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromL16(L16 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromLa16(La16 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromLa32(La32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromRgb24(Rgb24 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromRgba32(Rgba32 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public readonly void ToRgba32(ref Rgba32 dest) => dest.FromScaledVector4(this.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromRgb48(Rgb48 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc/>
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public void FromRgba64(Rgba64 source) => this.FromScaledVector4(source.ToScaledVector4());
+
+    /// <inheritdoc />
+    public override readonly bool Equals(object? obj) => obj is RgbHalf other && this.Equals(other);
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public readonly bool Equals(RgbHalf other) => this.R.Equals(other.R) && this.G.Equals(other.G) && this.B.Equals(other.B);
+
+    /// <inheritdoc />
+    public override readonly string ToString()
+    {
+        var vector = this.ToVector4();
+        return FormattableString.Invariant($"RgbHalf({vector.X:#0.##}, {vector.Y:#0.##}, {vector.Z:#0.##})");
+    }
+
+    /// <inheritdoc />
+    [MethodImpl(MethodImplOptions.AggressiveInlining)]
+    public override readonly int GetHashCode() => HashCode.Combine(this.R, this.G, this.B);
+}
@@ -0,0 +1,46 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "api.h"
+
+// an encoded image of the benchmark corpus
+struct CorpusImage
+{
+    std::string name;
+    NativeFormat format;
+    uint32_t width;
+    uint32_t height;
+    std::vector<uint8_t> data;
+};
+
+// encodes the synthetic corpus: AVIF in 8, 10 and 12 bit, HEIC single and grid images, EXR in several
+// compressions and channel layouts. The pixels only depend on the size and the encoders are pinned by
+// the vcpkg baseline, so different builds of the decoders get the same bytes. Images whose name doesn't
+// contain filter (if set) are skipped, as are the ones the available encoders can't produce, with a note on stderr
+std::vector<CorpusImage> GenerateCorpus(uint32_t width, uint32_t height, const std::string &filter);
@@ -0,0 +1,364 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <functional>
+#include <thread>
+
+#include <avif/avif.h>
+#include <libheif/heif.h>
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfHeader.h>
+#include <ImfIO.h>
+#include <ImfOutputFile.h>
+#include <ImfRgbaFile.h>
+#include <ImfTiledRgbaFile.h>
+
+#include "corpus.h"
+
+using namespace Imf;
+
+static float Saturate(float v)
+{
+    return v < 0 ? 0 : v > 1 ? 1 : v;
+}
+
+// gradients and rings with a little noise, so the codecs see both smooth areas and detail.
+// Noise comes from a hash of the position, so every pixel can be computed on its own
+static void Pattern(uint32_t x, uint32_t y, uint32_t width, uint32_t height, float rgba[4])
+{
+    float u = (float)x / width;
+    float v = (float)y / height;
+    float du = u - 0.5f, dv = v - 0.5f;
+    float ring = 0.5f + 0.5f * sinf(sqrtf(du * du + dv * dv) * 80.0f);
+
+    uint32_t h = x * 0x9E3779B1u ^ y * 0x85EBCA77u;
+    h ^= h >> 15;
+    h *= 0x2C1B3C6Du;
+    h ^= h >> 12;
+    float noise = ((float)(h & 0xffff) / 65535.0f - 0.5f) * 0.04f;
+
+    rgba[0] = Saturate(0.7f * u + 0.3f * ring + noise);
+    rgba[1] = Saturate(0.6f * v + 0.2f * ring + 0.1f + noise);
+    rgba[2] = Saturate(0.5f * (1 - u) + 0.3f * (1 - v) + noise);
+    rgba[3] = Saturate(0.3f + 0.7f * ring);
+}
+
+static bool EncodeAvif(uint32_t width, uint32_t height, uint32_t depth, avifPixelFormat yuvFormat, bool alpha, std::vector<uint8_t> &out)
+{
+    // 16 bit RGB gets reduced to whatever depth the image has
+    std::vector<uint16_t> pixels((size_t)width * height * 4);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            float rgba[4];
+            Pattern(x, y, width, height, rgba);
+            uint16_t *p = &pixels[((size_t)y * width + x) * 4];
+            for (int c = 0; c < 4; c++)
+                p[c] = (uint16_t)(rgba[c] * 65535.0f + 0.5f);
+        }
+    }
+
+    avifImage *image = avifImageCreate(width, height, depth, yuvFormat);
+    avifRGBImage rgb;
+    avifRGBImageSetDefaults(&rgb, image);
+    rgb.format = AVIF_RGB_FORMAT_RGBA;
+    rgb.depth = 16;
+    rgb.ignoreAlpha = !alpha;
+    rgb.pixels = (uint8_t *)pixels.data();
+    rgb.rowBytes = width * 8;
+
+    avifEncoder *encoder = avifEncoderCreate();
+    encoder->speed = AVIF_SPEED_FASTEST;
+    encoder->quality = 70;
+    encoder->qualityAlpha = 90;
+    encoder->maxThreads = (int)std::thread::hardware_concurrency();
+
+    avifRWData output = AVIF_DATA_EMPTY;
+    avifResult res = avifImageRGBToYUV(image, &rgb);
+    if (res == AVIF_RESULT_OK)
+        res = avifEncoderWrite(encoder, image, &output);
+    if (res == AVIF_RESULT_OK)
+        out.assign(output.data, output.data + output.size);
+    else
+        fprintf(stderr, "libavif: %s\n", encoder->diag.error[0] ? encoder->diag.error : avifResultToString(res));
+
+    avifRWDataFree(&output);
+    avifEncoderDestroy(encoder);
+    avifImageDestroy(image);
+    return res == AVIF_RESULT_OK;
+}
+
+static bool IsError(const heif_error &err)
+{
+    if (err.code == heif_error_Ok)
+        return false;
+    fprintf(stderr, "libheif: %s\n", err.message);
+    return true;
+}
+
+// an interleaved RGB image of the pattern at (x0, y0), which may reach beyond the image's size
+static heif_image *CreateHeifImage(uint32_t x0, uint32_t y0, uint32_t width, uint32_t height, uint32_t imageWidth, uint32_t imageHeight, int depth)
+{
+    heif_image *img = nullptr;
+    heif_chroma chroma = depth > 8 ? heif_chroma_interleaved_RRGGBB_LE : heif_chroma_interleaved_RGB;
+    if (IsError(heif_image_create((int)width, (int)height, heif_colorspace_RGB, chroma, &img)))
+        return nullptr;
+    if (IsError(heif_image_add_plane(img, heif_channel_interleaved, (int)width, (int)height, depth)))
+    {
+        heif_image_release(img);
+        return nullptr;
+    }
+
+    int stride = 0;
+    uint8_t *plane = heif_image_get_plane(img, heif_channel_interleaved, &stride);
+    float max = (float)((1 << depth) - 1);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        uint8_t *row = plane + (size_t)y * stride;
+        for (uint32_t x = 0; x < width; x++)
+        {
+            float rgba[4];
+            Pattern(x0 + x, y0 + y, imageWidth, imageHeight, rgba);
+            for (int c = 0; c < 3; c++)
+            {
+                if (depth > 8)
+                    ((uint16_t *)row)[x * 3 + c] = (uint16_t)(rgba[c] * max + 0.5f);
+                else
+                    row[x * 3 + c] = (uint8_t)(rgba[c] * max + 0.5f);
+            }
+        }
+    }
+    return img;
+}
+
+static heif_error WriteHeif(heif_context *, const void *data, size_t size, void *user)
+{
+    auto out = (std::vector<uint8_t> *)user;
+    out->insert(out->end(), (const uint8_t *)data, (const uint8_t *)data + size);
+    return { heif_error_Ok, heif_suberror_Unspecified, "" };
+}
+
+// a single HEVC image, or a grid of tileSize tiles
+static bool EncodeHeic(uint32_t width, uint32_t height, int depth, uint32_t tileSize, std::vector<uint8_t> &out)
+{
+    heif_context *context = heif_context_alloc();
+    heif_encoder *encoder = nullptr;
+    heif_image_handle *handle = nullptr;
+    bool ok = !IsError(heif_context_get_encoder_for_format(context, heif_compression_HEVC, &encoder)) &&
+        !IsError(heif_encoder_set_lossy_quality(encoder, 70));
+
+    if (ok && tileSize)
+    {
+        uint32_t columns = (width + tileSize - 1) / tileSize;
+        uint32_t rows = (height + tileSize - 1) / tileSize;
+        ok = !IsError(heif_context_add_grid_image(context, width, height, columns, rows, nullptr, &handle));
+        for (uint32_t ty = 0; ok && ty < rows; ty++)
+        {
+            for (uint32_t tx = 0; ok && tx < columns; tx++)
+            {
+                // edge tiles have the full size too, the grid crops them
+                heif_image *tile = CreateHeifImage(tx * tileSize, ty * tileSize, tileSize, tileSize, width, height, depth);
+                ok = tile && !IsError(heif_context_add_image_tile(context, handle, tx, ty, tile, encoder));
+                if (tile)
+                    heif_image_release(tile);
+            }
+        }
+    }
+    else if (ok)
+    {
+        heif_image *img = CreateHeifImage(0, 0, width, height, width, height, depth);
+        ok = img && !IsError(heif_context_encode_image(context, img, encoder, nullptr, &handle));
+        if (img)
+            heif_image_release(img);
+    }
+
+    if (ok)
+    {
+        heif_context_set_primary_image(context, handle);
+        heif_writer writer = { 1, WriteHeif };
+        ok = !IsError(heif_context_write(context, &writer, &out));
+    }
+
+    if (handle)
+        heif_image_handle_release(handle);
+    if (encoder)
+        heif_encoder_release(encoder);
+    heif_context_free(context);
+    return ok;
+}
+
+// OpenEXR output into memory
+class MemoryStream: public OStream
+{
+public:
+    explicit MemoryStream(std::vector<uint8_t> &out): OStream("corpus"), data(out) { }
+
+    void write(const char c[], int n) override
+    {
+        if (pos + n > data.size())
+            data.resize((size_t)pos + n);
+        memcpy(data.data() + pos, c, n);
+        pos += n;
+    }
+
+    uint64_t tellp() override { return pos; }
+    void seekp(uint64_t p) override { pos = p; }
+
+private:
+    std::vector<uint8_t> &data;
+    uint64_t pos = 0;
+};
+
+// the pattern with values up to 2, so there's something above 1 like in real HDR images
+static std::vector<Rgba> HdrPixels(uint32_t width, uint32_t height)
+{
+    std::vector<Rgba> pixels((size_t)width * height);
+    for (uint32_t y = 0; y < height; y++)
+    {
+        for (uint32_t x = 0; x < width; x++)
+        {
+            float rgba[4];
+            Pattern(x, y, width, height, rgba);
+            pixels[(size_t)y * width + x] = Rgba(rgba[0] * 2, rgba[1] * 2, rgba[2] * 2, rgba[3]);
+        }
+    }
+    return pixels;
+}
+
+// RGBA half, in scanlines or in tiles of tileSize
+static bool EncodeExrRgba(uint32_t width, uint32_t height, Compression compression, uint32_t tileSize, std::vector<uint8_t> &out)
+{
+    std::vector<Rgba> pixels = HdrPixels(width, height);
+    Header header((int)width, (int)height);
+    header.compression() = compression;
+
+    // the files finish writing when they're destroyed
+    MemoryStream stream(out);
+    if (tileSize)
+    {
+        header.setTileDescription(TileDescription(tileSize, tileSize, ONE_LEVEL));
+        TiledRgbaOutputFile file(stream, header, WRITE_RGBA);
+        file.setFrameBuffer(pixels.data(), 1, width);
+        file.writeTiles(0, file.numXTiles() - 1, 0, file.numYTiles() - 1);
+    }
+    else
+    {
+        RgbaOutputFile file(stream, header, WRITE_RGBA);
+        file.setFrameBuffer(pixels.data(), 1, width);
+        file.writePixels((int)height);
+    }
+    return true;
+}
+
+// planar channels of one type, eg. RGB float or luminance only
+static bool EncodeExrChannels(uint32_t width, uint32_t height, const char *channels, PixelType type, Compression compression, std::vector<uint8_t> &out)
+{
+    std::vector<Rgba> hdr = HdrPixels(width, height);
+    size_t count = strlen(channels);
+    size_t compSize = type == HALF ? 2 : 4;
+    std::vector<uint8_t> pixels(hdr.size() * count * compSize);
+
+    for (size_t i = 0; i < hdr.size(); i++)
+    {
+        for (size_t c = 0; c < count; c++)
+        {
+            float v = channels[c] == 'R' ? (float)hdr[i].r : channels[c] == 'G' ? (float)hdr[i].g : channels[c] == 'B' ? (float)hdr[i].b :
+                channels[c] == 'A' ? (float)hdr[i].a : 0.2126f * hdr[i].r + 0.7152f * hdr[i].g + 0.0722f * hdr[i].b;
+            uint8_t *dest = &pixels[(i * count + c) * compSize];
+            if (type == HALF)
+                *(half *)dest = half(v);
+            else
+                *(float *)dest = v;
+        }
+    }
+
+    Header header((int)width, (int)height);
+    header.compression() = compression;
+    FrameBuffer fb;
+    for (size_t c = 0; c < count; c++)
+    {
+        char name[2] = { channels[c], 0 };
+        header.channels().insert(name, Channel(type));
+        fb.insert(name, Slice(type, (char *)pixels.data() + c * compSize, count * compSize, width * count * compSize));
+    }
+
+    MemoryStream stream(out);
+    OutputFile file(stream, header);
+    file.setFrameBuffer(fb);
+    file.writePixels((int)height);
+    return true;
+}
+
+std::vector<CorpusImage> GenerateCorpus(uint32_t width, uint32_t height, const std::string &filter)
+{
+    std::vector<CorpusImage> corpus;
+    auto add = [&](const char *name, NativeFormat format, const std::function<bool(std::vector<uint8_t> &)> &encode)
+    {
+        if (!filter.empty() && !strstr(name, filter.c_str()))
+            return;
+
+        CorpusImage image = { name, format, width, height, {} };
+        bool ok;
+        try
+        {
+            ok = encode(image.data);
+        }
+        catch (const std::exception &e)
+        {
+            fprintf(stderr, "%s\n", e.what());
+            ok = false;
+        }
+
+        if (!ok || image.data.empty())
+        {
+            fprintf(stderr, "skipping %s, it couldn't be encoded\n", name);
+            return;
+        }
+        corpus.push_back(std::move(image));
+    };
+
+    add("avif-8bit-420", NativeFormat::Avif, [&](std::vector<uint8_t> &out) { return EncodeAvif(width, height, 8, AVIF_PIXEL_FORMAT_YUV420, false, out); });
+    add("avif-8bit-420-alpha", NativeFormat::Avif, [&](std::vector<uint8_t> &out) { return EncodeAvif(width, height, 8, AVIF_PIXEL_FORMAT_YUV420, true, out); });
+    add("avif-10bit-420", NativeFormat::Avif, [&](std::vector<uint8_t> &out) { return EncodeAvif(width, height, 10, AVIF_PIXEL_FORMAT_YUV420, false, out); });
+    add("avif-10bit-444", NativeFormat::Avif, [&](std::vector<uint8_t> &out) { return EncodeAvif(width, height, 10, AVIF_PIXEL_FORMAT_YUV444, false, out); });
+    add("avif-12bit-444", NativeFormat::Avif, [&](std::vector<uint8_t> &out) { return EncodeAvif(width, height, 12, AVIF_PIXEL_FORMAT_YUV444, false, out); });
+
+    add("heic-8bit", NativeFormat::Heic, [&](std::vector<uint8_t> &out) { return EncodeHeic(width, height, 8, 0, out); });
+    add("heic-8bit-grid512", NativeFormat::Heic, [&](std::vector<uint8_t> &out) { return EncodeHeic(width, height, 8, 512, out); });
+    add("heic-10bit-grid512", NativeFormat::Heic, [&](std::vector<uint8_t> &out) { return EncodeHeic(width, height, 10, 512, out); });
+
+    add("exr-rgba-half-none", NativeFormat::OpenEXR, [&](std::vector<uint8_t> &out) { return EncodeExrRgba(width, height, NO_COMPRESSION, 0, out); });
+    add("exr-rgba-half-zip", NativeFormat::OpenEXR, [&](std::vector<uint8_t> &out) { return EncodeExrRgba(width, height, ZIP_COMPRESSION, 0, out); });
+    add("exr-rgba-half-piz", NativeFormat::OpenEXR, [&](std::vector<uint8_t> &out) { return EncodeExrRgba(width, height, PIZ_COMPRESSION, 0, out); });
+    add("exr-rgba-half-dwaa", NativeFormat::OpenEXR, [&](std::vector<uint8_t> &out) { return EncodeExrRgba(width, height, DWAA_COMPRESSION, 0, out); });
+    add("exr-rgba-half-zip-tiled256", NativeFormat::OpenEXR, [&](std::vector<uint8_t> &out) { return EncodeExrRgba(width, height, ZIP_COMPRESSION, 256, out); });
+    add("exr-rgb-float-zip", NativeFormat::OpenEXR, [&](std::vector<uint8_t> &out) { return EncodeExrChannels(width, height, "RGB", FLOAT, ZIP_COMPRESSION, out); });
+    add("exr-y-half-piz", NativeFormat::OpenEXR, [&](std::vector<uint8_t> &out) { return EncodeExrChannels(width, height, "Y", HALF, PIZ_COMPRESSION, out); });
+
+    return corpus;
+}
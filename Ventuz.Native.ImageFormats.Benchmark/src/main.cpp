@@ -0,0 +1,359 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+// Decode benchmark: encodes a synthetic corpus, decodes every image repeatedly through OpenDecoder and
+// GetImageData for a range of thread counts and writes the results as JSON, for comparing builds.
+// A summary goes to stderr.
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "api.h"
+#include "decoder.h"
+#include "corpus.h"
+
+enum Phase
+{
+    Total,  // wall clock time from OpenDecoder to CloseDecoder
+    Parse,
+    Decode,
+    Convert,
+    Copy,
+    Read,
+    PhaseCount,
+};
+
+static const char *PhaseNames[PhaseCount] = { "total", "parse", "decode", "convert", "copy", "read" };
+
+struct Options
+{
+    uint32_t width = 1920;
+    uint32_t height = 1080;
+    int iterations = 10;
+    int warmup = 1;
+    std::vector<int> threads;
+    std::string filter;
+    std::string output;
+    bool memory = false;
+};
+
+// one run of an image with a thread count
+struct Result
+{
+    const CorpusImage *image;
+    int threads;
+    ErrorCode error;
+
+    // per iteration, in milliseconds
+    std::vector<double> times[PhaseCount];
+
+    uint64_t peakMemory = 0;
+    uint64_t outputBytes = 0;
+    uint64_t readCalls = 0;
+    uint64_t seekCalls = 0;
+    uint64_t bytesRead = 0;
+};
+
+// the Read/Seek delegates have no user pointer; images are decoded one at a time
+static const CorpusImage *source;
+static uint64_t sourcePos;
+
+static int ReadSource(void *ptr, int size)
+{
+    uint64_t left = sourcePos < source->data.size() ? source->data.size() - sourcePos : 0;
+    int n = (uint64_t)size < left ? size : (int)left;
+    memcpy(ptr, source->data.data() + sourcePos, n);
+    sourcePos += n;
+    return n;
+}
+
+static int64_t SeekSource(int64_t pos, SeekOrigin origin)
+{
+    int64_t base = origin == SeekOrigin::Begin ? 0 : origin == SeekOrigin::Current ? (int64_t)sourcePos : (int64_t)source->data.size();
+    if (base + pos < 0)
+        return -1;
+    sourcePos = (uint64_t)(base + pos);
+    return (int64_t)sourcePos;
+}
+
+static double Milliseconds(uint64_t nanoseconds)
+{
+    return (double)nanoseconds / 1e6;
+}
+
+// opens, decodes and closes an image once; pixels is kept between calls so allocating it isn't measured
+static ErrorCode DecodeOnce(const CorpusImage &image, int threads, bool memory, std::vector<uint8_t> &pixels, Result &result)
+{
+    NativeDecodeOptions options = {};
+    options.threads = threads;
+
+    auto start = std::chrono::steady_clock::now();
+    DecoderHandle handle = nullptr;
+    ErrorCode err;
+    if (memory)
+        err = OpenDecoderFromMemory(image.format, image.data.data(), image.data.size(), &options, handle);
+    else
+    {
+        source = &image;
+        sourcePos = 0;
+        err = OpenDecoder(image.format, ReadSource, SeekSource, &options, handle);
+    }
+    if (err != ErrorCode::Ok)
+        return err;
+
+    NativeImageInfo info;
+    err = GetImageInfo(handle, 0, info);
+    if (err == ErrorCode::Ok)
+    {
+        size_t size = (size_t)info.sizeX * info.sizeY * GetPixelSize(info.format);
+        if (pixels.size() < size)
+            pixels.resize(size);
+        result.outputBytes = size;
+        err = GetImageData(handle, pixels.data());
+    }
+
+    DecoderStats stats = {};
+    if (err == ErrorCode::Ok)
+        err = GetDecoderStats(handle, stats);
+    CloseDecoder(handle);
+    auto end = std::chrono::steady_clock::now();
+    if (err != ErrorCode::Ok)
+        return err;
+
+    result.times[Total].push_back(std::chrono::duration<double, std::milli>(end - start).count());
+    result.times[Parse].push_back(Milliseconds(stats.parseTime));
+    result.times[Decode].push_back(Milliseconds(stats.decodeTime));
+    result.times[Convert].push_back(Milliseconds(stats.convertTime));
+    result.times[Copy].push_back(Milliseconds(stats.copyTime));
+    result.times[Read].push_back(Milliseconds(stats.readTime));
+
+    // the same for every iteration, but the peak may vary with the scheduling of tiles
+    result.peakMemory = std::max(result.peakMemory, stats.peakMemory);
+    result.readCalls = stats.readCalls;
+    result.seekCalls = stats.seekCalls;
+    result.bytesRead = stats.bytesRead;
+    return ErrorCode::Ok;
+}
+
+static Result Run(const CorpusImage &image, int threads, const Options &options)
+{
+    Result result = {};
+    result.image = &image;
+    result.threads = threads;
+
+    std::vector<uint8_t> pixels;
+    for (int i = 0; i < options.warmup + options.iterations; i++)
+    {
+        Result sample = {};
+        result.error = DecodeOnce(image, threads, options.memory, pixels, i < options.warmup ? sample : result);
+        if (result.error != ErrorCode::Ok)
+            break;
+    }
+    return result;
+}
+
+// nearest rank on sorted values
+static double Percentile(const std::vector<double> &sorted, double p)
+{
+    if (sorted.empty())
+        return 0;
+    size_t rank = (size_t)ceil(p / 100.0 * sorted.size());
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void WriteJson(FILE *f, const Options &options, const std::vector<CorpusImage> &corpus, const std::vector<Result> &results)
+{
+    fprintf(f, "{\n");
+    fprintf(f, "  \"width\": %u,\n  \"height\": %u,\n  \"iterations\": %d,\n  \"warmup\": %d,\n", options.width, options.height, options.iterations, options.warmup);
+    fprintf(f, "  \"source\": \"%s\",\n  \"hardwareThreads\": %u,\n", options.memory ? "memory" : "delegates", std::thread::hardware_concurrency());
+
+    fprintf(f, "  \"corpus\": [\n");
+    for (size_t i = 0; i < corpus.size(); i++)
+        fprintf(f, "    { \"name\": \"%s\", \"bytes\": %zu }%s\n", corpus[i].name.c_str(), corpus[i].data.size(), i + 1 < corpus.size() ? "," : "");
+    fprintf(f, "  ],\n");
+
+    fprintf(f, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const Result &r = results[i];
+        fprintf(f, "    {\n      \"name\": \"%s\",\n      \"threads\": %d,\n", r.image->name.c_str(), r.threads);
+        if (r.error != ErrorCode::Ok)
+            fprintf(f, "      \"error\": %u,\n", (uint32_t)r.error);
+
+        std::vector<double> total = r.times[Total];
+        std::sort(total.begin(), total.end());
+        double megapixels = (double)r.image->width * r.image->height / 1e6;
+        double median = Percentile(total, 50);
+        fprintf(f, "      \"megapixelsPerSecond\": %.3f,\n", median > 0 ? megapixels / (median / 1000.0) : 0.0);
+
+        // milliseconds; the phases other than total are summed over the decoder's threads
+        fprintf(f, "      \"phases\": {\n");
+        for (int p = 0; p < PhaseCount; p++)
+        {
+            std::vector<double> t = r.times[p];
+            std::sort(t.begin(), t.end());
+            double mean = 0;
+            for (double v : t)
+                mean += v;
+            mean = t.empty() ? 0 : mean / t.size();
+            fprintf(f, "        \"%s\": { \"min\": %.4f, \"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f }%s\n",
+                PhaseNames[p], t.empty() ? 0 : t.front(), mean, Percentile(t, 50), Percentile(t, 90), Percentile(t, 99), t.empty() ? 0 : t.back(),
+                p + 1 < PhaseCount ? "," : "");
+        }
+        fprintf(f, "      },\n");
+
+        fprintf(f, "      \"peakMemory\": %llu,\n      \"outputBytes\": %llu,\n", (unsigned long long)r.peakMemory, (unsigned long long)r.outputBytes);
+        fprintf(f, "      \"readCalls\": %llu,\n      \"seekCalls\": %llu,\n      \"bytesRead\": %llu\n",
+            (unsigned long long)r.readCalls, (unsigned long long)r.seekCalls, (unsigned long long)r.bytesRead);
+        fprintf(f, "    }%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+static void PrintUsage()
+{
+    fprintf(stderr,
+        "usage: Ventuz.Native.ImageFormats.Benchmark [options]\n"
+        "  --size WxH        image size of the corpus (1920x1080)\n"
+        "  --iterations N    measured decodes per image and thread count (10)\n"
+        "  --warmup N        unmeasured decodes before those (1)\n"
+        "  --threads A,B,..  decoder thread counts (1, 2, 4, ... up to the hardware threads)\n"
+        "  --filter TEXT     only images whose name contains TEXT\n"
+        "  --memory          decode from memory instead of through Read/Seek delegates\n"
+        "  --out FILE        write the JSON results to FILE instead of stdout\n");
+}
+
+static bool ParseArgs(int argc, char **argv, Options &options)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+        if (arg == "--memory")
+        {
+            options.memory = true;
+            continue;
+        }
+        if (!value)
+            return false;
+        i++;
+
+        if (arg == "--size")
+        {
+            if (sscanf(value, "%ux%u", &options.width, &options.height) != 2 || !options.width || !options.height)
+                return false;
+        }
+        else if (arg == "--iterations")
+            options.iterations = std::max(atoi(value), 1);
+        else if (arg == "--warmup")
+            options.warmup = std::max(atoi(value), 0);
+        else if (arg == "--threads")
+        {
+            for (const char *p = value; *p; p = strchr(p, ',') ? strchr(p, ',') + 1 : p + strlen(p))
+            {
+                int t = atoi(p);
+                if (t < 1)
+                    return false;
+                options.threads.push_back(t);
+            }
+        }
+        else if (arg == "--filter")
+            options.filter = value;
+        else if (arg == "--out")
+            options.output = value;
+        else
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Options options;
+    if (!ParseArgs(argc, argv, options))
+    {
+        PrintUsage();
+        return 2;
+    }
+
+    int hardware = std::max((int)std::thread::hardware_concurrency(), 1);
+    if (options.threads.empty())
+    {
+        for (int t = 1; t < hardware; t *= 2)
+            options.threads.push_back(t);
+        options.threads.push_back(hardware);
+    }
+    SetThreadLimit(*std::max_element(options.threads.begin(), options.threads.end()));
+
+    fprintf(stderr, "encoding %ux%u corpus...\n", options.width, options.height);
+    std::vector<CorpusImage> corpus = GenerateCorpus(options.width, options.height, options.filter);
+    if (corpus.empty())
+    {
+        fprintf(stderr, "nothing to decode\n");
+        return 1;
+    }
+
+    fprintf(stderr, "%-28s %7s %9s %9s %9s %9s\n", "image", "threads", "MP/s", "p50 ms", "p90 ms", "peak MiB");
+    std::vector<Result> results;
+    bool failed = false;
+    for (const CorpusImage &image : corpus)
+    {
+        for (int threads : options.threads)
+        {
+            Result r = Run(image, threads, options);
+            if (r.error != ErrorCode::Ok)
+            {
+                fprintf(stderr, "%-28s %7d failed with error %u\n", image.name.c_str(), threads, (uint32_t)r.error);
+                failed = true;
+            }
+            else
+            {
+                std::vector<double> total = r.times[Total];
+                std::sort(total.begin(), total.end());
+                double median = Percentile(total, 50);
+                fprintf(stderr, "%-28s %7d %9.1f %9.2f %9.2f %9.1f\n", image.name.c_str(), threads,
+                    median > 0 ? (double)image.width * image.height / 1e6 / (median / 1000.0) : 0.0, median, Percentile(total, 90), (double)r.peakMemory / (1 << 20));
+            }
+            results.push_back(std::move(r));
+        }
+    }
+
+    FILE *f = stdout;
+    if (!options.output.empty() && !(f = fopen(options.output.c_str(), "w")))
+    {
+        fprintf(stderr, "can't write %s\n", options.output.c_str());
+        return 1;
+    }
+    WriteJson(f, options, corpus, results);
+    if (f != stdout)
+        fclose(f);
+
+    return failed ? 1 : 0;
+}
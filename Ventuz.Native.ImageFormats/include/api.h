@@ -23,6 +23,7 @@
 #define EXPORT __declspec(dllexport)
 
 #include <stdint.h>
+#include <stddef.h>
 
 enum class ErrorCode: uint32_t
 {
@@ -32,6 +33,11 @@ enum class ErrorCode: uint32_t
     InternalError,
     ImageTooLarge,
     Unknown,
+    IOError,
+    Cancelled,
+    EndOfStream,
+    BufferTooSmall,
+    Incomplete,
 };
 
 enum class NativeFormat: uint32_t
@@ -41,6 +47,9 @@ enum class NativeFormat: uint32_t
     Heic,
 };
 
+// number of formats above, which have to stay consecutive from 0
+const uint32_t NativeFormatCount = (uint32_t)NativeFormat::Heic + 1;
+
 enum class SeekOrigin
 {
     Begin,
@@ -54,6 +63,73 @@ enum class NativePixelFormat: uint32_t
     RGBA_UN16,
     RGBA_F16,
     R_F16,
+    R_F32,
+    RGBA_F32,
+    RGB_F16,
+    RGB_F32,
+    BGRA_UN8,
+
+    // YCbCr as stored by AVIF and HEIC, for converting on the GPU (see GetImageDataPlanar): separate Y, Cb
+    // and Cr planes (P) or Y and one plane of interleaved CbCr pairs (SP), plus an alpha plane. Samples of the
+    // 16 bit formats are in the upper bits, like in P010/P016
+    YUV420_P8,
+    YUV422_P8,
+    YUV444_P8,
+    YUV420_P16,
+    YUV422_P16,
+    YUV444_P16,
+    YUV420_SP8,
+    YUV422_SP8,
+    YUV444_SP8,
+    YUV420_SP16,
+    YUV422_SP16,
+    YUV444_SP16,
+};
+
+enum class ChromaSubsampling: uint32_t
+{
+    None,   // not stored as YCbCr
+    Yuv420,
+    Yuv422,
+    Yuv444,
+    Yuv400,
+};
+
+// GPU block compression GetImageDataCompressed writes, in rows of 4x4 pixel blocks. BC1 (8 bytes a block),
+// BC3 and BC7 (16 bytes) are encoded from RGBA_UN8, BC6H (unsigned half float, 16 bytes) from RGBA_F16
+enum class NativeBlockFormat: uint32_t
+{
+    BC1,
+    BC3,
+    BC7,
+    BC6H,
+};
+
+enum class BlockQuality: uint32_t
+{
+    Fast,
+    Normal,
+    Best,
+};
+
+// output color space, see SetOutputColorSpace
+enum class ColorPrimaries: uint32_t
+{
+    Source,     // keep the image's
+    Rec709,     // also sRGB
+    Rec2020,
+    DisplayP3,
+    ACEScg,     // ACES AP1, D60 white point
+};
+
+enum class TransferFunction: uint32_t
+{
+    Source,     // keep the image's
+    Linear,
+    Srgb,
+    Bt1886,     // gamma 2.4
+    PQ,
+    HLG,
 };
 
 enum AlphaMode: uint32_t
@@ -81,34 +157,331 @@ struct NativeImageInfo
     // CICP
     int colorPrimaries = 2;
     int transferCharacteristics = 2;
+    int matrixCoefficients = 2;
+    int fullRange;  // YCbCr in full instead of limited (video) range
 
     // chromaticities
     float cRx, cRy, cGx, cGy, cBx, cBy, cWx, cWy;
 
-    // metadata
-    void* exifData;
-    int exifSize;
-    void *xmpData;
-    int xmpSize;
-    void *iccData;
-    int iccSize;
+    // how YCbCr images are stored; a planar output format has to match the subsampling
+    ChromaSubsampling subsampling;
+    uint32_t bitDepth;
+
+    // sizes of the metadata GetImageInfo was asked for, 0 if the image has none (see GetMetadata)
+    uint32_t exifSize;
+    uint32_t xmpSize;
+    uint32_t iccSize;
+};
+
+// metadata blocks, also used as flags for GetImageInfo
+enum class MetadataKind: uint32_t
+{
+    None = 0,
+    Exif = 1,   // TIFF structure, without the offset or "Exif" header some containers put in front
+    Xmp = 2,
+    Icc = 4,
+};
+
+enum class ChromaUpsampling: uint32_t
+{
+    Automatic,
+    Fastest,
+    BestQuality,
+};
+
+struct NativeDecodeOptions
+{
+    // number of threads a single decode may use (OpenEXR line buffers, dav1d, libheif grid tiles);
+    // 0 means up to the process wide limit (see SetThreadLimit)
+    int threads;
+
+    // if set (0 = no constraint), the decoder may deliver a cheaper, reduced representation that's at
+    // least as large as the image scaled down to fit into this size: EXR preview or mip/rip levels,
+    // HEIC thumbnails, or AVIF scaled before the RGB conversion. GetImageInfo reports the actual size.
+    uint32_t targetSizeX;
+    uint32_t targetSizeY;
+
+    // filter for subsampled chroma in the YUV to RGB conversion of AVIF and HEIC
+    ChromaUpsampling chromaUpsampling;
+
+    // if set, PQ and HLG images of more than 8 bits come out as display linear light, 1.0 being
+    // 203 cd/m2 (BT.2408 reference white). GetImageInfo reports linear transfer characteristics and RGBA_F16
+    // then; other output formats are converted from that, planar ones can't be selected
+    int linearize;
+
+    // block size of the read-ahead over Read/Seek delegate sources, rounded up to a power of two (0 = 256 KiB).
+    // Bigger blocks mean fewer callbacks, smaller ones less data read past what the decoder needs
+    uint32_t readBufferSize;
+
+    // incremental decode of a source that's still arriving (0 = the whole source is there): only its first
+    // available bytes may be read until NotifyDataAvailable says there are more. The source's size has to be
+    // the final one already. Opening needs the headers, it returns Incomplete while they're missing
+    uint64_t available;
+};
+
+// presentation time and duration of a frame, in seconds and in units of 1 / timescale
+struct NativeFrameTiming
+{
+    uint64_t timescale;
+    double pts;
+    uint64_t ptsInTimescales;
+    double duration;
+    uint64_t durationInTimescales;
+};
+
+// counters of the decoder's work since it was opened or last reset. Times are in nanoseconds and summed
+// over all threads, so they can exceed the wall clock time; Read is also counted in the phase it happened in
+struct DecoderStats
+{
+    uint64_t parseTime;     // container and header parsing
+    uint64_t decodeTime;    // codec work (AV1, HEVC, EXR line buffers or tiles)
+    uint64_t convertTime;   // YUV to RGB, pixel format and transfer function conversion
+    uint64_t copyTime;      // copying rows out of decoded images and scratch buffers
+    uint64_t readTime;      // in Read/Seek delegates
+
+    uint64_t readCalls;
+    uint64_t seekCalls;
+    uint64_t bytesRead;
+    uint64_t seekDistance;  // absolute bytes between where the source was and where it got seeked to
+
+    // the most memory held at once in the buffers the decoders account for: decoded frames and tiles,
+    // scratch and read-ahead buffers. Codec internal allocations aren't included
+    uint64_t peakMemory;
+
+    // threads the decoder may use (see NativeDecodeOptions.threads)
+    int threads;
+};
+
+// how far an incremental decode got with the data available at its last read, see GetDecodeProgress()
+struct NativeDecodeProgress
+{
+    // rows from the top that were delivered final, the full height once the image is complete
+    uint32_t rowsComplete;
+
+    // refinement layers of progressive AVIF delivered so far out of layerCount; other images have a single layer
+    uint32_t layers;
+    uint32_t layerCount;
+};
+
+// planes of the planar YUV formats: 0 = Y, 1 = Cb (CbCr for the SP formats), 2 = Cr, 3 = alpha
+struct NativePlane
+{
+    void *memory;
+    size_t stride;
+};
+
+struct NativePlaneLayout
+{
+    // in samples, CbCr pairs counting as one; 0 for planes the format or the image doesn't have
+    uint32_t width[4];
+    uint32_t height[4];
+
+    // bytes of a packed row, the smallest stride GetImageDataPlanar accepts
+    size_t rowBytes[4];
 };
 
 typedef void (*LogDelegate)(LogLevel level, const char *str);
 typedef int (*ReadDelegate)(void *ptr, int size);
 typedef int64_t(*SeekDelegate)(int64_t pos, SeekOrigin origin);
 
+// receives rows [y, y + rows) of the image; return 0 to stop decoding
+typedef int (*BandDelegate)(uint32_t y, uint32_t rows, const void *data, size_t stride);
+
+// one image of a DecodeBatch
+struct NativeDecodeRequest
+{
+    NativeFormat format;
+
+    // source: data/size if data is set, the file at path otherwise
+    const void *data;
+    size_t size;
+    const wchar_t *path;
+
+    // options.threads is ignored, the batch hands out threads itself
+    NativeDecodeOptions options;
+
+    // if convert is set the image is delivered in outputFormat/outputAlpha (see SetOutputFormat),
+    // else in the decoder's own format
+    int convert;
+    NativePixelFormat outputFormat;
+    AlphaMode outputAlpha;
+
+    // destination of capacity bytes, rows stride bytes apart (0 = packed). If memory is null
+    // the batch's allocate callback provides it once the image size is known
+    void *memory;
+    size_t stride;
+    size_t capacity;
+
+    // results, valid after the complete callback
+    ErrorCode result;
+    uint32_t sizeX;
+    uint32_t sizeY;
+    NativePixelFormat pixelFormat;
+};
+
+// called from the batch's threads. info describes the image as it will be written (size, output format
+// and alpha); set stride if the rows shouldn't be packed. Returning null skips the image with Cancelled
+typedef void *(*BatchAllocateDelegate)(void *user, uint32_t index, const NativeImageInfo &info, size_t &stride);
+typedef void (*BatchCompleteDelegate)(void *user, uint32_t index, ErrorCode result);
+
+struct NativeBatchOptions
+{
+    // 0 means up to the process wide limit
+    int threads;
+
+    BatchAllocateDelegate allocate;
+    BatchCompleteDelegate complete;
+    void *user;
+};
+
 typedef void *DecoderHandle;
 
+// cancellation flag and priority for decodes, see CreateDecodeControl()
+typedef void *DecodeControlHandle;
+
+// called from the decoding thread once DecodeAsync is done
+typedef void (*DecodeCompleteDelegate)(void *user, ErrorCode result);
+
 extern "C"
 {
     EXPORT void SetLogger(LogDelegate log);
 
-    EXPORT ErrorCode OpenDecoder(NativeFormat format, ReadDelegate read, SeekDelegate seek, DecoderHandle &outHandle);
+    // caps the threads used by all decoders together, and sizes the shared OpenEXR thread pool accordingly.
+    // 0 resets to the number of hardware threads
+    EXPORT void SetThreadLimit(int threads);
+
+    EXPORT int GetThreadLimit();
+
+    // keeps decoded images in files under directory (created if needed), at most maxBytes of them (0 = no limit),
+    // dropping the least recently used ones. Memory and file sources whose content and pixel affecting options
+    // (target size, chroma upsampling, linearize) match an entry are then delivered from it without decoding;
+    // others get added the first time their whole image is read in the format GetImageInfo reports. Only
+    // single frame images are kept, and delegate sources never. Selecting a planar output format decodes a source
+    // found in the cache after all. A null directory turns the cache off
+    EXPORT ErrorCode SetDecodeCache(const wchar_t *directory, uint64_t maxBytes);
+
+    // options may be null for defaults
+    EXPORT ErrorCode OpenDecoder(NativeFormat format, ReadDelegate read, SeekDelegate seek, const NativeDecodeOptions *options, DecoderHandle &outHandle);
+
+    // data must stay valid and unchanged until the decoder is closed
+    EXPORT ErrorCode OpenDecoderFromMemory(NativeFormat format, const void *data, size_t size, const NativeDecodeOptions *options, DecoderHandle &outHandle);
+
+    // maps the file into memory; returns IOError if it can't be opened for shared reading or is on a remote
+    // volume, where a failing read of the mapping would crash instead of returning an error
+    EXPORT ErrorCode OpenDecoderFromFile(NativeFormat format, const wchar_t *path, const NativeDecodeOptions *options, DecoderHandle &outHandle);
+
+    // rebind an open decoder to a new source of the same format, keeping its codec contexts and buffers.
+    // If that fails the handle stays valid but has no image until the next successful reset.
+    // ResetDecoder with null read and seek only drops the current source, eg. before keeping the handle in a pool
+    EXPORT ErrorCode ResetDecoder(DecoderHandle handle, ReadDelegate read, SeekDelegate seek, const NativeDecodeOptions *options);
+    EXPORT ErrorCode ResetDecoderFromMemory(DecoderHandle handle, const void *data, size_t size, const NativeDecodeOptions *options);
+    EXPORT ErrorCode ResetDecoderFromFile(DecoderHandle handle, const wchar_t *path, const NativeDecodeOptions *options);
 
     EXPORT void CloseDecoder(DecoderHandle &handle);
 
-    EXPORT ErrorCode GetImageInfo(DecoderHandle handle, NativeImageInfo &info);
+    // metadata is a combination of MetadataKind flags for which info should report the sizes; nothing is extracted
+    // for the other ones
+    EXPORT ErrorCode GetImageInfo(DecoderHandle handle, uint32_t metadata, NativeImageInfo &info);
+
+    // copies a metadata block into buffer. size is buffer's capacity on input and the block's size on output
+    // (0 if there's none). A null buffer only queries the size; with too small a one nothing is copied and
+    // BufferTooSmall returned
+    EXPORT ErrorCode GetMetadata(DecoderHandle handle, MetadataKind kind, void *buffer, uint32_t &size);
+
+    // reports the decoder's counters; also works on a decoder that was reset without a source
+    EXPORT ErrorCode GetDecoderStats(DecoderHandle handle, DecoderStats &stats);
+
+    // selects the pixel format and alpha representation GetImageData* deliver from now on. RGBA_UN8, BGRA_UN8,
+    // RGBA_UN16, RGBA_F16 and RGBA_F32 are always possible; the decoder writes them directly where it can and
+    // converts band by band otherwise. Alpha Unknown keeps the source's representation.
+    // The planar YUV formats work for YCbCr images of the same subsampling, with GetImageDataPlanar only.
+    // GetImageInfo keeps reporting the decoder's own format
+    EXPORT ErrorCode SetOutputFormat(DecoderHandle handle, NativePixelFormat format, AlphaMode alpha);
+
+    // converts what GetImageData* deliver to other primaries and/or another transfer function, in the same pass that
+    // writes the output format (which has to be one of the RGBA ones). The image's color space is taken from
+    // GetImageInfo: the EXR chromaticities (Rec.709 without), else the CICP primaries and transfer characteristics,
+    // unspecified ones meaning sRGB. Linear light has 1.0 at 203 cd/m2 for PQ and HLG (see linearize) and at SDR white
+    // otherwise; HLG uses the OOTF of a 1000 cd/m2 display. Other white points are adapted with Bradford.
+    // GetImageInfo keeps reporting the image's color space; planar output is never converted
+    EXPORT ErrorCode SetOutputColorSpace(DecoderHandle handle, ColorPrimaries primaries, TransferFunction transfer);
+
+    // sizes of the planes GetImageDataPlanar writes in the selected planar format; alpha only if the image has it
+    EXPORT ErrorCode GetPlaneLayout(DecoderHandle handle, NativePlaneLayout &layout);
+
+    // writes the current frame in the selected planar format, with no color conversion: samples, range and
+    // alpha (see NativeImageInfo.alpha) are delivered as stored, linearize is ignored. The alpha plane is
+    // optional, the others are required
+    EXPORT ErrorCode GetImageDataPlanar(DecoderHandle handle, const NativePlane planes[4]);
+
+    // decodes the current frame straight into GPU block compression. The image is read in bands of whole block
+    // rows that get encoded in parallel while the next band decodes, so it never exists uncompressed as a whole.
+    // Reads RGBA_UN8 (RGBA_F16 for BC6H) with the selected alpha, as SetOutputFormat would, and puts the selected
+    // output format back afterwards; the blocks hold those values unchanged. memory receives (height + 3) / 4 rows of (width + 3) / 4 blocks,
+    // stride bytes apart. Quality mostly matters for BC7: Fast only tries its single subset modes, Best adds the
+    // three subset ones
+    EXPORT ErrorCode GetImageDataCompressed(DecoderHandle handle, NativeBlockFormat format, BlockQuality quality, void *memory, size_t stride);
 
     EXPORT ErrorCode GetImageData(DecoderHandle handle, void* memory);
+
+    // decodes only what's needed for the given rectangle; rows are written stride bytes apart
+    EXPORT ErrorCode GetImageDataRegion(DecoderHandle handle, uint32_t x, uint32_t y, uint32_t width, uint32_t height, void *memory, size_t stride);
+
+    // raises what an incremental decode (see NativeDecodeOptions.available) may read of its source; never lowers it.
+    // May be called from any thread, also while the decoder reads pixels
+    EXPORT ErrorCode NotifyDataAvailable(DecoderHandle handle, uint64_t available);
+
+    // while data is missing, the GetImageData* functions deliver what can be decoded and return Incomplete: the
+    // most refined progressive AVIF layer there is, the top rows of AVIF grids and EXR files, and the HEIC grid tiles
+    // that are complete. Everything else is written as zero (left alone by GetImageDataPlanar). Reading again after
+    // NotifyDataAvailable refines the image. Decodes that aren't incremental always report the whole image
+    EXPORT ErrorCode GetDecodeProgress(DecoderHandle handle, NativeDecodeProgress &progress);
+
+    // image sequences (AVIF, HEIF with several top-level images of the same size); everything else has a single frame.
+    // The GetImageData* functions read the current frame, which DecodeNextFrame and SeekToFrame change
+    EXPORT ErrorCode GetFrameCount(DecoderHandle handle, uint32_t &count);
+
+    // timing is zero where the format doesn't have any
+    EXPORT ErrorCode GetFrameTiming(DecoderHandle handle, uint32_t index, NativeFrameTiming &timing);
+
+    // makes the next frame (the first one after opening or the one sought to) current and writes it like GetImageData.
+    // While the caller consumes it the following frame gets decoded in the background. Past the last frame it returns EndOfStream
+    EXPORT ErrorCode DecodeNextFrame(DecoderHandle handle, void *memory);
+
+    // sets the frame DecodeNextFrame delivers next
+    EXPORT ErrorCode SeekToFrame(DecoderHandle handle, uint32_t index);
+
+    // decodes many images on a work-stealing pool, biggest sources first. Threads are split between the images
+    // and each codec's own threading so they don't oversubscribe the cores. Returns when all are done;
+    // the per-image results are in the requests
+    EXPORT ErrorCode DecodeBatch(NativeDecodeRequest *requests, uint32_t count, const NativeBatchOptions *options);
+
+    // decodes the image in horizontal bands of bandRows and passes each to the callback. The bands are written to
+    // buffers[i % numBuffers] (each of stride * bandRows bytes), so the caller may keep using a band until its
+    // buffer comes around again. Without buffers a single internal band is used.
+    // Stopping from the callback returns Cancelled
+    EXPORT ErrorCode GetImageDataBanded(DecoderHandle handle, uint32_t bandRows, void **buffers, uint32_t numBuffers, size_t stride, BandDelegate callback);
+
+    // a control lets decodes be cancelled and prioritized while they run. Decoders check it between EXR scanline
+    // blocks and tiles, HEIC grid tiles and AVIF conversion bands (as well as between bands of a converting decode):
+    // cancelled decodes return Cancelled there, and decodes wait there for as long as any of higher priority is
+    // reading pixels. Decodes without a control have priority 0 and never wait
+    EXPORT ErrorCode CreateDecodeControl(int priority, DecodeControlHandle &outControl);
+
+    // must not be attached to a decoder or used by a running DecodeAsync anymore
+    EXPORT void DestroyDecodeControl(DecodeControlHandle &control);
+
+    // may be called from any thread at any time
+    EXPORT void CancelDecode(DecodeControlHandle control);
+    EXPORT void SetDecodePriority(DecodeControlHandle control, int priority);
+
+    // GetImageData*, DecodeNextFrame and GetImageDataBanded of the decoder follow control from now on;
+    // null or resetting the decoder detaches it
+    EXPORT ErrorCode SetDecodeControl(DecoderHandle handle, DecodeControlHandle control);
+
+    // decodes the image like GetImageDataRegion on a background thread and calls complete with the result.
+    // control, if set, replaces the decoder's for the duration; the handle must not be used until complete was called,
+    // except for closing or resetting it, which waits for the decode. Jobs run on a shared pool, as many at a time as
+    // the thread limit allows, and a handle only takes one at a time
+    EXPORT ErrorCode DecodeAsync(DecoderHandle handle, void *memory, size_t stride, DecodeControlHandle control, DecodeCompleteDelegate complete, void *user);
 }
\ No newline at end of file
@@ -0,0 +1,99 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include "api.h"
+
+enum class AlphaOp
+{
+    None,
+    Premultiply,
+    Unpremultiply,
+};
+
+// true if ConvertRows() can write to format to from format from. Any format converts to itself;
+// RGBA_UN8, BGRA_UN8, RGBA_UN16, RGBA_F16 and RGBA_F32 can be written from every format
+bool CanConvert(NativePixelFormat from, NativePixelFormat to);
+
+// conversion between color spaces in linear light: the source's transfer function is undone, a 3x3 matrix
+// maps the primaries and the destination's transfer function gets applied. Power law curves other than
+// Bt1886's gamma 2.4 are Bt1886 with another gamma
+struct ColorTransform
+{
+    TransferFunction from, to;
+    float fromGamma, toGamma;
+
+    // row major, on linear RGB
+    float matrix[9];
+
+    // color gets converted on straight values, premultiplied sources and destinations are handled around it
+    bool unpremultiply;
+    bool premultiply;
+};
+
+// sets up the conversion of an image described by info to the given color space, Source keeping the image's
+// primaries or transfer function. Returns false if the image is in that color space already
+bool CreateColorTransform(const NativeImageInfo &info, ColorPrimaries primaries, TransferFunction transfer, ColorTransform &transform);
+
+// true for the formats ConvertRows() can write with a color transform (the RGBA ones)
+bool CanConvertColor(NativePixelFormat to);
+
+// converts rows of width pixels, applying the alpha operation on the way (which needs four channels). With a color
+// transform alpha has to be None, the transform's own flags take care of it then
+void ConvertRows(uint8_t *dest, size_t destStride, NativePixelFormat destFormat,
+    const uint8_t *src, size_t srcStride, NativePixelFormat srcFormat,
+    uint32_t width, uint32_t rows, AlphaOp alpha, const ColorTransform *color = nullptr);
+
+// applies the PQ (16) or HLG (18, with the 1000 cd/m2 OOTF) EOTF to RGBA_F16 rows in place; 1.0 is
+// 203 cd/m2 afterwards. Returns false for other transfer characteristics, leaving the rows untouched
+bool LinearizeRows(uint8_t *rows, size_t stride, uint32_t width, uint32_t count, int transferCharacteristics);
+
+// planes of a decoded YCbCr image, in luma coordinates; samples of more than 8 bits are uint16_t
+struct YuvPlanes
+{
+    const uint8_t *data[4];     // Y, Cb, Cr, alpha (null without)
+    size_t stride[4];
+    uint32_t depth;
+    uint32_t alphaDepth;
+};
+
+// the planar YUV formats and their subsampling (None for all others)
+ChromaSubsampling GetSubsampling(NativePixelFormat format);
+inline bool IsPlanar(NativePixelFormat format) { return GetSubsampling(format) != ChromaSubsampling::None; }
+
+void ComputePlaneLayout(NativePixelFormat format, uint32_t width, uint32_t height, bool alpha, NativePlaneLayout &layout);
+
+// copies width x height samples at (srcX, srcY) of src to (destX, destY) of the planes of a planar format, which
+// has src's subsampling. Positions have to be multiples of the subsampling. Y and chroma keep their value in the
+// upper bits, alpha gets scaled to the full range of the destination
+void WritePlanes(const YuvPlanes &src, uint32_t srcX, uint32_t srcY, uint32_t width, uint32_t height,
+    NativePixelFormat format, const NativePlane *planes, uint32_t destX, uint32_t destY);
+
+// bytes of a 4x4 block, and the format CompressBlocks() takes for it
+uint32_t GetBlockSize(NativeBlockFormat format);
+NativePixelFormat GetBlockSource(NativeBlockFormat format);
+
+// encodes rows of width pixels in GetBlockSource(format) to (rows + 3) / 4 rows of blocks, destStride bytes
+// apart; a partial block row at the bottom is padded. Safe to call from several threads, see blockCompress.cpp
+bool CompressBlocks(uint8_t *dest, size_t destStride, NativeBlockFormat format, BlockQuality quality,
+    const uint8_t *src, size_t srcStride, uint32_t width, uint32_t rows);
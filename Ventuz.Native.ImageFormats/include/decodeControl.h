@@ -0,0 +1,51 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+
+// cancellation flag and priority shared by the decodes a DecodeControlHandle is attached to
+struct DecodeControl
+{
+    // wake decodes waiting in DecodeCheckpoint()
+    void Cancel();
+    void SetPriority(int priority);
+
+    std::atomic<bool> Cancelled { false };
+    std::atomic<int> Priority { 0 };
+};
+
+// registers a decode that's reading pixels for as long as it lives. Decodes without a control count
+// with priority 0; while any of higher priority is registered the others wait in DecodeCheckpoint()
+class ActiveDecode
+{
+public:
+    explicit ActiveDecode(const DecodeControl *control);
+    ~ActiveDecode();
+
+    ActiveDecode(const ActiveDecode &) = delete;
+    ActiveDecode &operator=(const ActiveDecode &) = delete;
+
+private:
+    const DecodeControl *control;
+};
@@ -21,23 +21,368 @@
 
 #pragma once
 
+#include <math.h>
+#include <string.h>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <vector>
+
 #include "api.h"
 
 #define EXPORT __declspec(dllexport)
 
+// read-only view of a whole file, see mappedFile.cpp
+struct MappedFile
+{
+    ~MappedFile();
+
+    bool Open(const wchar_t *path, LogDelegate log);
+
+    const uint8_t *data = nullptr;
+    size_t size = 0;
+
+private:
+    void *file = nullptr;
+    void *mapping = nullptr;
+};
+
+// size of a file without opening it, 0 if it can't be queried
+uint64_t QueryFileSize(const wchar_t *path);
+
+// see decodeControl.h
+struct DecodeControl;
+
+// called by decoders between bands, tiles and scanline blocks, possibly from several threads.
+// Waits while decodes of higher priority run and returns false once the decode was cancelled
+bool DecodeCheckpoint(const DecodeControl *control);
+
+// cheap counters behind GetDecoderStats(), safe to update from the decoding threads
+struct DecoderCounters
+{
+    // nanoseconds per phase, summed over threads
+    std::atomic<uint64_t> Parse { 0 };
+    std::atomic<uint64_t> Decode { 0 };
+    std::atomic<uint64_t> Convert { 0 };
+    std::atomic<uint64_t> Copy { 0 };
+    std::atomic<uint64_t> Read { 0 };
+
+    std::atomic<uint64_t> ReadCalls { 0 };
+    std::atomic<uint64_t> SeekCalls { 0 };
+    std::atomic<uint64_t> BytesRead { 0 };
+    std::atomic<uint64_t> SeekDistance { 0 };
+
+    // bytes of the buffers the decoders account for (decoded frames and tiles, scratch and
+    // read-ahead buffers), and the most they held at once
+    std::atomic<int64_t> Memory { 0 };
+    std::atomic<int64_t> PeakMemory { 0 };
+
+    void Hold(int64_t bytes)
+    {
+        int64_t now = Memory += bytes;
+        int64_t peak = PeakMemory;
+        while (now > peak && !PeakMemory.compare_exchange_weak(peak, now)) { }
+    }
+
+    // starts over for a new source; buffers that are kept count towards the new peak
+    void Clear()
+    {
+        Parse = Decode = Convert = Copy = Read = 0;
+        ReadCalls = SeekCalls = BytesRead = SeekDistance = 0;
+        PeakMemory = Memory.load();
+    }
+};
+
+// adds the time until it goes out of scope to a phase counter
+class PhaseTimer
+{
+public:
+    explicit PhaseTimer(std::atomic<uint64_t> &phase): phase(phase), start(std::chrono::steady_clock::now()) { }
+
+    ~PhaseTimer()
+    {
+        phase += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    std::atomic<uint64_t> &phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+// accounts a temporary buffer for as long as it's in scope
+class HeldMemory
+{
+public:
+    HeldMemory(DecoderCounters &stats, size_t bytes): stats(stats), bytes((int64_t)bytes) { stats.Hold(this->bytes); }
+    ~HeldMemory() { stats.Hold(-bytes); }
+
+private:
+    DecoderCounters &stats;
+    int64_t bytes;
+};
+
+// read-ahead over the Read/Seek delegates, see bufferedSource.cpp. Reads whole aligned blocks and keeps
+// them, tracks the position itself and only seeks the delegate when a read doesn't continue where the last
+// one ended, so a decode takes a handful of callbacks instead of one per small read
+class BufferedSource
+{
+public:
+    // queries the size once; blockSize 0 means the default. The callbacks and the buffer are accounted in stats.
+    // Nothing at or past available is read from the delegate, for sources that are still arriving
+    void Open(ReadDelegate read, SeekDelegate seek, size_t blockSize, DecoderCounters *stats, const std::atomic<uint64_t> *available);
+
+    // unbinds from the delegates but keeps the buffer for the next source
+    void Close();
+
+    uint64_t Size() const { return size; }
+    uint64_t Tell() const { return pos; }
+
+    // only moves the local position; may go past the end, reads return nothing there
+    void SeekTo(uint64_t p) { pos = p; }
+
+    // reads from the current position, returns the bytes read (less only at the end of the source or of what's available)
+    size_t Read(void *dest, size_t count);
+
+    // contiguous view of [offset, offset + count) clamped to what's available, valid until the next call.
+    // Returns null if the source fails
+    const uint8_t *Peek(uint64_t offset, size_t count, size_t &available);
+
+    static const size_t DefaultBlockSize = 256 * 1024;
+
+private:
+    bool Fill(uint64_t offset, size_t count);
+    uint64_t Limit() const { uint64_t end = arrived ? arrived->load() : size; return end < size ? end : size; }
+    size_t ReadAt(uint64_t offset, uint8_t *dest, size_t count);
+
+    ReadDelegate read = nullptr;
+    SeekDelegate seek = nullptr;
+    size_t blockSize = DefaultBlockSize;
+    DecoderCounters *stats = nullptr;
+    const std::atomic<uint64_t> *arrived = nullptr;
+
+    uint64_t size = 0;
+    uint64_t pos = 0;       // where Read() continues
+    uint64_t sourcePos = 0; // where the delegate's stream is
+
+    // [bufferStart, bufferStart + buffered) of the source
+    std::vector<uint8_t> buffer;
+    uint64_t bufferStart = 0;
+    size_t buffered = 0;
+};
+
+struct Rect
+{
+    uint32_t x, y, width, height;
+};
+
 struct IDecoder
 {
-    virtual ~IDecoder() {};
+    virtual ~IDecoder() { delete Cached; delete File; };
 
     virtual bool Init() = 0;
+
+    // drops everything tied to the current source but keeps what can be reused (codec contexts, buffers);
+    // Init() may be called again afterwards for a new one
+    virtual void Reset() = 0;
     virtual ErrorCode GetImageInfo(NativeImageInfo &info) = 0;
-    virtual ErrorCode GetImageData(void *memory) = 0;
 
-    ReadDelegate Read;
-    SeekDelegate Seek;
-    LogDelegate Log;
+    // returns the size of a metadata block (0 if there's none) and copies it to buffer if that's large enough.
+    // Only called when asked for, so extracting it can be left until then
+    virtual uint32_t GetMetadata(MetadataKind kind, void *buffer, uint32_t size) { return 0; }
+
+    // writes the given part of the image in Format to memory, with rows stride bytes apart.
+    // rect is validated against Width/Height by the caller
+    virtual ErrorCode GetImageData(const Rect &rect, uint8_t *memory, size_t stride) = 0;
+
+    // height of the bands a converting decode is split into; multiples of the format's
+    // natural block height (tiles, line buffers) keep data from being decoded twice
+    virtual uint32_t BandRows() const { return 64; }
+
+    // image sequences; GetImageData works on the selected frame, which is 0 after Init()
+    virtual uint32_t GetFrameCount() { return 1; }
+    virtual bool GetFrameTiming(uint32_t index, NativeFrameTiming &timing) { return false; }
+    virtual ErrorCode SelectFrame(uint32_t index) { return index ? ErrorCode::InvalidParameter : ErrorCode::Ok; }
+
+    // starts decoding a frame in the background so a following SelectFrame(index) finds it ready. Only for
+    // memory and mapped file sources (Data), delegate sources are read on the caller's thread only
+    virtual void Prefetch(uint32_t index) { }
+
+    // lets the decoder write format and alpha itself from now on. Returns false if it can't, the api converts
+    // from Format and Alpha then, which the decoder has to write again. Planar YUV formats can't be converted,
+    // the decoder accepts those if its images match. Format and Alpha stay the native ones either way
+    virtual bool SelectOutput(NativePixelFormat format, AlphaMode alpha) { return false; }
+
+    // writes the selected frame to planes in the planar OutputFormat; the strides are validated by the caller
+    virtual ErrorCode GetImageDataPlanar(const NativePlane *planes) { return ErrorCode::InvalidParameter; }
+
+    // output size, native format and alpha representation (Unknown without alpha) as GetImageInfo reports them, set by Init()
+    uint32_t Width = 0;
+    uint32_t Height = 0;
+    NativePixelFormat Format = NativePixelFormat::RGBA_UN8;
+    AlphaMode Alpha = AlphaMode::Unknown;
+
+    // what the api hands out, see SetOutputFormat(); GetImageData writes it itself if SelectOutput() accepted it
+    NativePixelFormat OutputFormat = NativePixelFormat::RGBA_UN8;
+    AlphaMode OutputAlpha = AlphaMode::Unknown;
+    bool DirectOutput = false;
+
+    // what GetImageData writes
+    NativePixelFormat DataFormat() const { return DirectOutput ? OutputFormat : Format; }
+    AlphaMode DataAlpha() const { return DirectOutput ? OutputAlpha : Alpha; }
+
+    // see SetOutputColorSpace(); the conversion is set up for every read, from what GetImageInfo reports then
+    ColorPrimaries OutputPrimaries = ColorPrimaries::Source;
+    TransferFunction OutputTransfer = TransferFunction::Source;
+
+    // frame GetImageData* read, and the one DecodeNextFrame delivers next
+    uint32_t Frame = 0;
+    uint32_t NextFrame = 0;
+
+    ReadDelegate Read = nullptr;
+    SeekDelegate Seek = nullptr;
+    LogDelegate Log = nullptr;
+
+    // the delegate source, set up before Init(); decoders read through this instead of Read and Seek
+    BufferedSource Source;
+
+    // in-memory source (OpenDecoderFromMemory/File), Read and Seek are null then
+    const uint8_t *Data = nullptr;
+    size_t DataSize = 0;
+
+    // owner of Data for OpenDecoderFromFile; gets unmapped after the derived decoder is gone
+    MappedFile *File = nullptr;
+
+    NativeDecodeOptions Options = {};
+
+    // end of what may be read of the source; below its size while an incremental decode (Options.available)
+    // waits for the rest, see NotifyDataAvailable(). Only ever grows, possibly while a decode runs
+    std::atomic<uint64_t> Available { UINT64_MAX };
+
+    uint64_t SourceSize() const { return Data ? DataSize : Source.Size(); }
+    bool DataMissing() const { return Available < SourceSize(); }
+
+    // what the last read of an incremental decode delivered final, see GetDecodeProgress(). Set by the decoders
+    uint32_t RowsComplete = 0;
+    uint32_t Layers = 0;
+    uint32_t LayerCount = 1;
+
+    // records rows [y, y + rows) as delivered final; they only add to RowsComplete if they continue it
+    void Completed(uint32_t y, uint32_t rows)
+    {
+        if (y <= RowsComplete && y + rows > RowsComplete)
+            RowsComplete = y + rows;
+        if (RowsComplete >= Height)
+            Layers = LayerCount;
+    }
+
+    // resolved from Options.threads and the process wide limit, always >= 1
+    int Threads = 1;
+
+    // see GetDecoderStats(); cleared whenever a source gets bound
+    mutable DecoderCounters Stats;
+
+    // cancellation and priority of the current decode, see SetDecodeControl()
+    const DecodeControl *Control = nullptr;
+
+    // ready once the DecodeAsync job using the handle is done; closing or resetting the handle waits for it
+    std::future<void> Pending;
+
+    // decode cache key of the current source (0 if it isn't cached), and the decoder serving the source from
+    // its cache entry instead of this one's codec, if there was one. See decodeCache.cpp
+    uint64_t CacheKey = 0;
+    IDecoder *Cached = nullptr;
+
+    // GetImageData() stops with Cancelled where this returns false
+    bool Continue() const { return DecodeCheckpoint(Control); }
 };
 
+// process wide thread budget, see SetThreadLimit()
+int GetThreadLimit();
+
+// persistent cache of decoded images, see SetDecodeCache() and decodeCache.cpp
+ErrorCode ConfigureDecodeCache(const wchar_t *directory, uint64_t maxBytes);
+
+// key of an in-memory source and the options that change its pixels; 0 while the cache is off
+uint64_t GetCacheKey(const uint8_t *data, size_t size, const NativeDecodeOptions &options);
+
+// a decoder that delivers the image from its cache entry, or null if there's none
+IDecoder *OpenCachedDecoder(uint64_t key, size_t sourceSize, LogDelegate log);
+
+// adds what decoder just wrote to memory (the whole of its only frame) to the cache, once per source.
+// Only images delivered in the native format, alpha and color space (as GetImageInfo reports them) are kept
+void StoreInCache(IDecoder *decoder, const uint8_t *memory, size_t stride);
+
+// the smallest size an image may be reduced to before decoding so that it still covers
+// Options.targetSizeX/Y when scaled down with its aspect ratio kept (ImageSharp's ResizeMode.Max)
+inline void GetTargetSize(const NativeDecodeOptions &options, uint32_t sizeX, uint32_t sizeY, uint32_t &outX, uint32_t &outY)
+{
+    double scale = 1;
+    if (options.targetSizeX && options.targetSizeX < scale * sizeX)
+        scale = (double)options.targetSizeX / sizeX;
+    if (options.targetSizeY && options.targetSizeY < scale * sizeY)
+        scale = (double)options.targetSizeY / sizeY;
+
+    outX = sizeX;
+    outY = sizeY;
+    if (scale < 1)
+    {
+        outX = (uint32_t)ceil(sizeX * scale);
+        outY = (uint32_t)ceil(sizeY * scale);
+        if (!outX) outX = 1;
+        if (!outY) outY = 1;
+    }
+}
+
+inline uint32_t GetPixelSize(NativePixelFormat format)
+{
+    switch (format)
+    {
+    case NativePixelFormat::RGBA_UN8: return 4;
+    case NativePixelFormat::RGBA_UN16: return 8;
+    case NativePixelFormat::RGBA_F16: return 8;
+    case NativePixelFormat::R_F16: return 2;
+    case NativePixelFormat::R_F32: return 4;
+    case NativePixelFormat::RGBA_F32: return 16;
+    case NativePixelFormat::RGB_F16: return 6;
+    case NativePixelFormat::RGB_F32: return 12;
+    case NativePixelFormat::BGRA_UN8: return 4;
+    default: return 0;
+    }
+}
+
+inline void CopyRows(uint8_t *dest, size_t destStride, const uint8_t *src, size_t srcStride, size_t rowBytes, uint32_t rows)
+{
+    if (destStride == rowBytes && srcStride == rowBytes)
+    {
+        memcpy(dest, src, rowBytes * rows);
+        return;
+    }
+
+    for (uint32_t y = 0; y < rows; y++)
+    {
+        memcpy(dest, src, rowBytes);
+        dest += destStride;
+        src += srcStride;
+    }
+}
+
+// for the parts of an incremental decode that aren't there yet
+inline void ClearRows(uint8_t *dest, size_t stride, size_t rowBytes, uint32_t rows)
+{
+    for (uint32_t y = 0; y < rows; y++)
+        memset(dest + y * stride, 0, rowBytes);
+}
+
+// GetMetadata() for blocks that are at hand anyway
+inline uint32_t CopyMetadata(const void *data, size_t dataSize, void *buffer, uint32_t size)
+{
+    if (!data || dataSize > UINT32_MAX)
+        return 0;
+    if (buffer && dataSize <= size)
+        memcpy(buffer, data, dataSize);
+    return (uint32_t)dataSize;
+}
+
 inline uint32_t SwapEndian(uint32_t x) {
     return ((x & 0xff000000) >> 24) | ((x & 0x00ff0000) >> 8) | ((x & 0x0000ff00) << 8) | ((x & 0x000000ff) << 24);
 }
@@ -0,0 +1,73 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing pool: every thread has its own queue, takes its newest task first and steals the
+// oldest ones from the others when it runs dry. Tasks get the index of the thread running them,
+// 0 being the one that called Wait(), so they can keep per-thread state.
+class ThreadPool
+{
+public:
+    typedef std::function<void(size_t thread)> Task;
+
+    // threads includes the waiting caller, so threads - 1 workers get started
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    size_t GetThreadCount() const { return queues.size(); }
+
+    // queues a task on the given thread's queue (modulo thread count)
+    void Submit(size_t thread, Task task);
+
+    // helps running tasks until all submitted ones are done
+    void Wait();
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<Task> tasks;
+    };
+
+    bool RunOne(size_t thread);
+    void Worker(size_t thread);
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::atomic<size_t> queued { 0 };
+    std::atomic<size_t> unfinished { 0 };
+    bool stop = false;
+};
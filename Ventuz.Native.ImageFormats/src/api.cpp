@@ -19,66 +19,989 @@
  * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+
 #include "api.h"
+#include "convert.h"
+#include "decodeControl.h"
 #include "decoder.h"
+#include "threadPool.h"
 
 // forward declarations for decoders
 IDecoder *CreateAvifDecoder();
 IDecoder *CreateOpenExrDecoder();
 IDecoder *CreateHeicDecoder();
 
+void SetOpenExrThreadPool(int threads);
+
 static void DummyLogger(LogLevel level, const char *str) {};
 static LogDelegate logger = nullptr;
 
+static std::atomic<int> threadLimit { 0 };
+
 void SetLogger(LogDelegate log)
 {
     logger = log;
 }
 
-ErrorCode OpenDecoder(NativeFormat format, ReadDelegate read, SeekDelegate seek, DecoderHandle &handle)
+void SetThreadLimit(int threads)
 {
-    handle = 0;
-    if (!read || !seek)
-        return ErrorCode::InvalidParameter;
+    threadLimit = threads > 0 ? threads : 0;
+    SetOpenExrThreadPool(GetThreadLimit());
+}
 
-    IDecoder *decoder;
+int GetThreadLimit()
+{
+    int limit = threadLimit;
+    if (limit > 0)
+        return limit;
+
+    int hw = (int)std::thread::hardware_concurrency();
+    return hw > 0 ? hw : 1;
+}
+
+ErrorCode SetDecodeCache(const wchar_t *directory, uint64_t maxBytes)
+{
+    return ConfigureDecodeCache(directory, maxBytes);
+}
+
+static IDecoder *CreateDecoder(NativeFormat format)
+{
     switch (format)
     {
-    case NativeFormat::Avif: decoder = CreateAvifDecoder(); break;
-    case NativeFormat::OpenEXR: decoder = CreateOpenExrDecoder(); break;
-    case NativeFormat::Heic: decoder = CreateHeicDecoder(); break;
-    default: return ErrorCode::InvalidParameter;
+    case NativeFormat::Avif: return CreateAvifDecoder();
+    case NativeFormat::OpenEXR: return CreateOpenExrDecoder();
+    case NativeFormat::Heic: return CreateHeicDecoder();
+    default: return nullptr;
     }
+}
+
+// sets up a decoder that has a source
+static ErrorCode StartDecoder(IDecoder *decoder, const NativeDecodeOptions *options)
+{
+    if (options)
+        decoder->Options = *options;
+
+    int limit = GetThreadLimit();
+    int threads = decoder->Options.threads;
+    decoder->Threads = threads > 0 && threads < limit ? threads : limit;
 
-    decoder->Read = read;
-    decoder->Seek = seek;
     decoder->Log = logger ? logger : DummyLogger;
-    if (!decoder->Init())
+    decoder->Stats.Clear();
+    decoder->Available = decoder->Options.available ? decoder->Options.available : UINT64_MAX;
+    if (decoder->Read)
+        decoder->Source.Open(decoder->Read, decoder->Seek, decoder->Options.readBufferSize, &decoder->Stats, &decoder->Available);
+
+    {
+        PhaseTimer timer(decoder->Stats.Parse);
+
+        // in-memory sources may come from the decode cache, the codec isn't needed then. Incremental ones can't
+        // be hashed before they're complete
+        decoder->CacheKey = decoder->Data && !decoder->Options.available ? GetCacheKey(decoder->Data, decoder->DataSize, decoder->Options) : 0;
+        if (decoder->CacheKey && (decoder->Cached = OpenCachedDecoder(decoder->CacheKey, decoder->DataSize, decoder->Log)))
+        {
+            decoder->Cached->Options = decoder->Options;
+            decoder->Cached->Threads = decoder->Threads;
+            decoder->Cached->Log = decoder->Log;
+            decoder->CacheKey = 0;
+            return ErrorCode::Ok;
+        }
+
+        if (!decoder->Init())
+            return decoder->DataMissing() ? ErrorCode::Incomplete : ErrorCode::BadFormat;
+    }
+
+    decoder->OutputFormat = decoder->Format;
+    decoder->OutputAlpha = decoder->Alpha;
+    decoder->DirectOutput = false;
+    return ErrorCode::Ok;
+}
+
+static ErrorCode InitDecoder(IDecoder *decoder, const NativeDecodeOptions *options, DecoderHandle &handle)
+{
+    ErrorCode err = StartDecoder(decoder, options);
+    if (err != ErrorCode::Ok)
     {
         delete decoder;
-        return ErrorCode::BadFormat;
+        return err;
     }
 
     handle = decoder;
     return ErrorCode::Ok;
 }
 
+// lets a DecodeAsync job still using the decoder finish
+static void WaitAsync(IDecoder *decoder)
+{
+    if (decoder->Pending.valid())
+        decoder->Pending.get();
+}
+
+// unbinds a decoder from its source, leaving it without an image until the next reset
+static void ReleaseSource(IDecoder *decoder)
+{
+    WaitAsync(decoder);
+    decoder->Reset();
+    delete decoder->Cached;
+    decoder->Cached = nullptr;
+    decoder->CacheKey = 0;
+    delete decoder->File;
+    decoder->File = nullptr;
+    decoder->Source.Close();
+    decoder->Read = nullptr;
+    decoder->Seek = nullptr;
+    decoder->Data = nullptr;
+    decoder->DataSize = 0;
+
+    decoder->Options = {};
+    decoder->Control = nullptr;
+    decoder->Width = decoder->Height = 0;
+    decoder->Format = decoder->OutputFormat = NativePixelFormat::RGBA_UN8;
+    decoder->Alpha = decoder->OutputAlpha = AlphaMode::Unknown;
+    decoder->DirectOutput = false;
+    decoder->OutputPrimaries = ColorPrimaries::Source;
+    decoder->OutputTransfer = TransferFunction::Source;
+    decoder->Frame = decoder->NextFrame = 0;
+    decoder->Available = UINT64_MAX;
+    decoder->RowsComplete = decoder->Layers = 0;
+    decoder->LayerCount = 1;
+}
+
+static ErrorCode ResetDecoder(IDecoder *decoder, const NativeDecodeOptions *options)
+{
+    ErrorCode err = StartDecoder(decoder, options);
+    if (err != ErrorCode::Ok)
+        ReleaseSource(decoder);
+    return err;
+}
+
+// decoders that were reset without (or to a broken) source have no image. Sources found in the decode
+// cache are served by the decoder of the entry
+static IDecoder *GetDecoder(DecoderHandle handle)
+{
+    auto decoder = (IDecoder *)handle;
+    if (decoder && decoder->Cached)
+        decoder = decoder->Cached;
+    return decoder && decoder->Width ? decoder : nullptr;
+}
+
+// planar output needs the codec's YUV planes, which cache entries don't keep: a source served from the cache
+// gets set up in its own decoder after all, which takes over what was set on the entry's
+static IDecoder *Uncache(DecoderHandle handle)
+{
+    auto decoder = (IDecoder *)handle;
+    IDecoder *cached = decoder->Cached;
+    decoder->Cached = nullptr;
+
+    bool ok;
+    {
+        PhaseTimer timer(decoder->Stats.Parse);
+        ok = decoder->Init();
+    }
+
+    decoder->OutputFormat = decoder->Format;
+    decoder->OutputAlpha = decoder->Alpha;
+    decoder->DirectOutput = false;
+    decoder->OutputPrimaries = cached->OutputPrimaries;
+    decoder->OutputTransfer = cached->OutputTransfer;
+    decoder->Control = cached->Control;
+    delete cached;
+
+    if (!ok)
+    {
+        decoder->Reset();
+        decoder->Width = decoder->Height = 0;
+        return nullptr;
+    }
+    return decoder;
+}
+
+ErrorCode OpenDecoder(NativeFormat format, ReadDelegate read, SeekDelegate seek, const NativeDecodeOptions *options, DecoderHandle &handle)
+{
+    handle = 0;
+    if (!read || !seek)
+        return ErrorCode::InvalidParameter;
+
+    IDecoder *decoder = CreateDecoder(format);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+
+    decoder->Read = read;
+    decoder->Seek = seek;
+    return InitDecoder(decoder, options, handle);
+}
+
+
+ErrorCode OpenDecoderFromMemory(NativeFormat format, const void *data, size_t size, const NativeDecodeOptions *options, DecoderHandle &handle)
+{
+    handle = 0;
+    if (!data || !size)
+        return ErrorCode::InvalidParameter;
+
+    IDecoder *decoder = CreateDecoder(format);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+
+    decoder->Data = (const uint8_t *)data;
+    decoder->DataSize = size;
+    return InitDecoder(decoder, options, handle);
+}
+
+
+ErrorCode OpenDecoderFromFile(NativeFormat format, const wchar_t *path, const NativeDecodeOptions *options, DecoderHandle &handle)
+{
+    handle = 0;
+    if (!path)
+        return ErrorCode::InvalidParameter;
+
+    auto file = new MappedFile();
+    if (!file->Open(path, logger ? logger : DummyLogger))
+    {
+        delete file;
+        return ErrorCode::IOError;
+    }
+
+    IDecoder *decoder = CreateDecoder(format);
+    if (!decoder)
+    {
+        delete file;
+        return ErrorCode::InvalidParameter;
+    }
+
+    decoder->File = file;
+    decoder->Data = file->data;
+    decoder->DataSize = file->size;
+    return InitDecoder(decoder, options, handle);
+}
+
+
+ErrorCode ResetDecoder(DecoderHandle handle, ReadDelegate read, SeekDelegate seek, const NativeDecodeOptions *options)
+{
+    auto decoder = (IDecoder *)handle;
+    if (!decoder || !read != !seek)
+        return ErrorCode::InvalidParameter;
+
+    ReleaseSource(decoder);
+    if (!read)
+        return ErrorCode::Ok;
+
+    decoder->Read = read;
+    decoder->Seek = seek;
+    return ResetDecoder(decoder, options);
+}
+
+
+ErrorCode ResetDecoderFromMemory(DecoderHandle handle, const void *data, size_t size, const NativeDecodeOptions *options)
+{
+    auto decoder = (IDecoder *)handle;
+    if (!decoder || !data || !size)
+        return ErrorCode::InvalidParameter;
+
+    ReleaseSource(decoder);
+    decoder->Data = (const uint8_t *)data;
+    decoder->DataSize = size;
+    return ResetDecoder(decoder, options);
+}
+
+
+ErrorCode ResetDecoderFromFile(DecoderHandle handle, const wchar_t *path, const NativeDecodeOptions *options)
+{
+    auto decoder = (IDecoder *)handle;
+    if (!decoder || !path)
+        return ErrorCode::InvalidParameter;
+
+    ReleaseSource(decoder);
+
+    auto file = new MappedFile();
+    if (!file->Open(path, logger ? logger : DummyLogger))
+    {
+        delete file;
+        return ErrorCode::IOError;
+    }
+
+    decoder->File = file;
+    decoder->Data = file->data;
+    decoder->DataSize = file->size;
+    return ResetDecoder(decoder, options);
+}
+
 
 void CloseDecoder(DecoderHandle &handle)
 {
+    if (handle)
+        WaitAsync((IDecoder *)handle);
     delete (IDecoder *)handle;
     handle = nullptr;
 }
 
 
-ErrorCode GetImageInfo(DecoderHandle handle, NativeImageInfo &info)
+ErrorCode GetImageInfo(DecoderHandle handle, uint32_t metadata, NativeImageInfo &info)
 {
     info = {};
-    return ((IDecoder *)handle)->GetImageInfo(info);
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+
+    ErrorCode err = decoder->GetImageInfo(info);
+    if (err != ErrorCode::Ok)
+        return err;
+
+    if (metadata & (uint32_t)MetadataKind::Exif)
+        info.exifSize = decoder->GetMetadata(MetadataKind::Exif, nullptr, 0);
+    if (metadata & (uint32_t)MetadataKind::Xmp)
+        info.xmpSize = decoder->GetMetadata(MetadataKind::Xmp, nullptr, 0);
+    if (metadata & (uint32_t)MetadataKind::Icc)
+        info.iccSize = decoder->GetMetadata(MetadataKind::Icc, nullptr, 0);
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode GetMetadata(DecoderHandle handle, MetadataKind kind, void *buffer, uint32_t &size)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder || (kind != MetadataKind::Exif && kind != MetadataKind::Xmp && kind != MetadataKind::Icc))
+        return ErrorCode::InvalidParameter;
+
+    uint32_t capacity = buffer ? size : 0;
+    size = decoder->GetMetadata(kind, buffer, capacity);
+    return buffer && size > capacity ? ErrorCode::BufferTooSmall : ErrorCode::Ok;
+}
+
+
+ErrorCode GetDecoderStats(DecoderHandle handle, DecoderStats &stats)
+{
+    auto decoder = (IDecoder *)handle;
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+
+    // the lookup of a cache hit counts as parsing
+    uint64_t lookup = 0;
+    if (decoder->Cached)
+    {
+        lookup = decoder->Stats.Parse;
+        decoder = decoder->Cached;
+    }
+
+    const DecoderCounters &c = decoder->Stats;
+    stats.parseTime = c.Parse + lookup;
+    stats.decodeTime = c.Decode;
+    stats.convertTime = c.Convert;
+    stats.copyTime = c.Copy;
+    stats.readTime = c.Read;
+    stats.readCalls = c.ReadCalls;
+    stats.seekCalls = c.SeekCalls;
+    stats.bytesRead = c.BytesRead;
+    stats.seekDistance = c.SeekDistance;
+    stats.peakMemory = (uint64_t)c.PeakMemory.load();
+    stats.threads = decoder->Threads;
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode SetOutputFormat(DecoderHandle handle, NativePixelFormat format, AlphaMode alpha)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    if (IsPlanar(format) && decoder == ((IDecoder *)handle)->Cached && !(decoder = Uncache(handle)))
+        return ErrorCode::BadFormat;
+
+    // without alpha there's nothing to convert
+    if (decoder->Alpha == AlphaMode::Unknown || alpha == AlphaMode::Unknown)
+        alpha = decoder->Alpha;
+
+    // the decoder may be able to write the format itself, otherwise it gets converted band by band
+    bool direct = decoder->SelectOutput(format, alpha);
+    if (!direct && !CanConvert(decoder->Format, format))
+        return ErrorCode::InvalidParameter;
+
+    decoder->OutputFormat = format;
+    decoder->OutputAlpha = alpha;
+    decoder->DirectOutput = direct && !IsPlanar(format);
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode SetOutputColorSpace(DecoderHandle handle, ColorPrimaries primaries, TransferFunction transfer)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder || (uint32_t)primaries > (uint32_t)ColorPrimaries::ACEScg || (uint32_t)transfer > (uint32_t)TransferFunction::HLG)
+        return ErrorCode::InvalidParameter;
+
+    decoder->OutputPrimaries = primaries;
+    decoder->OutputTransfer = transfer;
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode GetPlaneLayout(DecoderHandle handle, NativePlaneLayout &layout)
+{
+    layout = {};
+    auto decoder = GetDecoder(handle);
+    if (!decoder || !IsPlanar(decoder->OutputFormat))
+        return ErrorCode::InvalidParameter;
+
+    ComputePlaneLayout(decoder->OutputFormat, decoder->Width, decoder->Height, decoder->Alpha != AlphaMode::Unknown, layout);
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode GetImageDataPlanar(DecoderHandle handle, const NativePlane planes[4])
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder || !planes || !IsPlanar(decoder->OutputFormat))
+        return ErrorCode::InvalidParameter;
+
+    NativePlaneLayout layout;
+    ComputePlaneLayout(decoder->OutputFormat, decoder->Width, decoder->Height, decoder->Alpha != AlphaMode::Unknown, layout);
+    for (int i = 0; i < 4; i++)
+    {
+        if (planes[i].memory ? planes[i].stride < layout.rowBytes[i] : i < 3 && layout.width[i])
+            return ErrorCode::InvalidParameter;
+    }
+
+    ActiveDecode active(decoder->Control);
+    if (!decoder->Continue())
+        return ErrorCode::Cancelled;
+
+    ErrorCode err = decoder->SelectFrame(decoder->Frame);
+    if (err != ErrorCode::Ok)
+        return err;
+    return decoder->GetImageDataPlanar(planes);
+}
+
+
+// reads rect in the decoder's output format
+static ErrorCode ReadPixels(IDecoder *decoder, const Rect &rect, uint8_t *memory, size_t stride)
+{
+    NativePixelFormat format = decoder->DataFormat();
+    AlphaMode alpha = decoder->DataAlpha();
+
+    AlphaOp op = AlphaOp::None;
+    if (alpha == AlphaMode::Straight && decoder->OutputAlpha == AlphaMode::Premultiplied)
+        op = AlphaOp::Premultiply;
+    else if (alpha == AlphaMode::Premultiplied && decoder->OutputAlpha == AlphaMode::Straight)
+        op = AlphaOp::Unpremultiply;
+
+    // planar formats only come out of GetImageDataPlanar
+    if (IsPlanar(decoder->OutputFormat))
+        return ErrorCode::InvalidParameter;
+
+    // a color space conversion handles alpha itself
+    ColorTransform color = {};
+    NativeImageInfo info;
+    bool convertColor = (decoder->OutputPrimaries != ColorPrimaries::Source || decoder->OutputTransfer != TransferFunction::Source) &&
+        decoder->GetImageInfo(info) == ErrorCode::Ok && CreateColorTransform(info, decoder->OutputPrimaries, decoder->OutputTransfer, color);
+    if (convertColor)
+    {
+        if (!CanConvertColor(decoder->OutputFormat))
+            return ErrorCode::InvalidParameter;
+        color.unpremultiply = alpha == AlphaMode::Premultiplied;
+        color.premultiply = decoder->OutputAlpha == AlphaMode::Premultiplied;
+        op = AlphaOp::None;
+    }
+
+    // selecting a frame may decode it as a whole
+    if (!decoder->Continue())
+        return ErrorCode::Cancelled;
+
+    ErrorCode err = decoder->SelectFrame(decoder->Frame);
+    if (err != ErrorCode::Ok)
+        return err;
+
+    if (decoder->OutputFormat == format && op == AlphaOp::None && !convertColor)
+        return decoder->GetImageData(rect, memory, stride);
+
+    // decode into a band sized scratch buffer and convert from there, so the image never exists twice.
+    // Bands are aligned to the decoder's own band height. Incomplete bands still have what's there, and zeros
+    ErrorCode result = ErrorCode::Ok;
+    uint32_t bandRows = decoder->BandRows();
+    size_t rowBytes = (size_t)rect.width * GetPixelSize(format);
+    std::vector<uint8_t> band(rowBytes * (bandRows < rect.height ? bandRows : rect.height));
+    HeldMemory held(decoder->Stats, band.size());
+
+    uint32_t bottom = rect.y + rect.height;
+    for (uint32_t y = rect.y; y < bottom;)
+    {
+        uint32_t end = (y / bandRows + 1) * bandRows;
+        uint32_t rows = (end < bottom ? end : bottom) - y;
+
+        if (!decoder->Continue())
+            return ErrorCode::Cancelled;
+
+        err = decoder->GetImageData({ rect.x, y, rect.width, rows }, band.data(), rowBytes);
+        if (err == ErrorCode::Incomplete)
+            result = err;
+        else if (err != ErrorCode::Ok)
+            return err;
+
+        {
+            PhaseTimer timer(decoder->Stats.Convert);
+            ConvertRows(memory + (y - rect.y) * stride, stride, decoder->OutputFormat, band.data(), rowBytes, format, rect.width, rows, op, convertColor ? &color : nullptr);
+        }
+        y += rows;
+    }
+
+    return result;
 }
 
 
 ErrorCode GetImageData(DecoderHandle handle, void *mem)
 {
-    return ((IDecoder *)handle)->GetImageData(mem);
-}
\ No newline at end of file
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    return GetImageDataRegion(handle, 0, 0, decoder->Width, decoder->Height, mem, (size_t)decoder->Width * GetPixelSize(decoder->OutputFormat));
+}
+
+
+ErrorCode GetImageDataRegion(DecoderHandle handle, uint32_t x, uint32_t y, uint32_t width, uint32_t height, void *memory, size_t stride)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    if (!memory || !width || !height || x >= decoder->Width || y >= decoder->Height ||
+        width > decoder->Width - x || height > decoder->Height - y ||
+        stride < (size_t)width * GetPixelSize(decoder->OutputFormat))
+        return ErrorCode::InvalidParameter;
+
+    ActiveDecode active(decoder->Control);
+    ErrorCode err = ReadPixels(decoder, { x, y, width, height }, (uint8_t *)memory, stride);
+
+    // whole images of sources with a cache key go to the decode cache
+    if (err == ErrorCode::Ok && decoder->CacheKey && !x && !y && width == decoder->Width && height == decoder->Height)
+        StoreInCache(decoder, (const uint8_t *)memory, stride);
+    return err;
+}
+
+
+// lowers a decoder's thread count for the duration of a call
+class ThreadShare
+{
+public:
+    ThreadShare(IDecoder *dec, int threads): decoder(dec), saved(dec->Threads) { dec->Threads = threads; }
+    ~ThreadShare() { decoder->Threads = saved; }
+
+    ThreadShare(const ThreadShare &) = delete;
+    ThreadShare &operator=(const ThreadShare &) = delete;
+
+private:
+    IDecoder *decoder;
+    int saved;
+};
+
+// reads the image in bands of the output format and encodes them into blocks
+static ErrorCode CompressImage(IDecoder *decoder, NativeBlockFormat format, BlockQuality quality, uint8_t *dest, size_t stride)
+{
+    // decoding and encoding overlap, so they split the thread budget: the pool's workers encode while the
+    // calling thread reads the next band with the rest, and joins the encoding when it's done
+    int threads = std::min(decoder->Threads, GetThreadLimit());
+    int encodeThreads = threads / 2;
+    ThreadShare share(decoder, threads - encodeThreads);
+
+    // bands are whole block rows, aligned to the decoder's own bands and big enough to give every thread
+    // a slice to encode. The image is read into one band while the other one is encoded
+    const uint32_t sliceRows = 64;
+    uint32_t align = std::max(decoder->BandRows(), 1u);
+    align = align % 4 == 0 ? align : align % 2 == 0 ? align * 2 : align * 4;
+    uint32_t bandRows = std::min(align * ((sliceRows * (uint32_t)(encodeThreads + 1) + align - 1) / align), decoder->Height);
+
+    size_t rowBytes = (size_t)decoder->Width * GetPixelSize(decoder->OutputFormat);
+    std::vector<uint8_t> bands[2];
+    for (auto &band : bands)
+        band.resize(rowBytes * bandRows);
+    HeldMemory held(decoder->Stats, rowBytes * bandRows * 2);
+
+    ActiveDecode active(decoder->Control);
+    ThreadPool pool(encodeThreads + 1);
+    std::atomic<ErrorCode> result { ErrorCode::Ok };
+    bool incomplete = false;
+
+    for (uint32_t y = 0, index = 0; y < decoder->Height; y += bandRows, index++)
+    {
+        uint32_t rows = std::min(bandRows, decoder->Height - y);
+        const uint8_t *band = bands[index & 1].data();
+
+        ErrorCode err = ReadPixels(decoder, { 0, y, decoder->Width, rows }, bands[index & 1].data(), rowBytes);
+        pool.Wait();
+        if (err == ErrorCode::Incomplete)
+        {
+            incomplete = true;
+            err = ErrorCode::Ok;
+        }
+        if (err == ErrorCode::Ok)
+            err = result;
+        if (err != ErrorCode::Ok)
+            return err;
+
+        for (uint32_t slice = 0; slice < rows; slice += sliceRows)
+        {
+            uint32_t count = std::min(sliceRows, rows - slice);
+            uint8_t *blocks = dest + (size_t)((y + slice) / 4) * stride;
+            pool.Submit(slice / sliceRows, [=, &result](size_t)
+            {
+                if (result != ErrorCode::Ok)
+                    return;
+                if (!decoder->Continue())
+                {
+                    result = ErrorCode::Cancelled;
+                    return;
+                }
+
+                PhaseTimer timer(decoder->Stats.Convert);
+                if (!CompressBlocks(blocks, stride, format, quality, band + slice * rowBytes, rowBytes, decoder->Width, count))
+                    result = ErrorCode::InternalError;
+            });
+        }
+    }
+
+    pool.Wait();
+    return result == ErrorCode::Ok && incomplete ? ErrorCode::Incomplete : result.load();
+}
+
+ErrorCode GetImageDataCompressed(DecoderHandle handle, NativeBlockFormat format, BlockQuality quality, void *memory, size_t stride)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    if (!memory || (uint32_t)format > (uint32_t)NativeBlockFormat::BC6H ||
+        stride < (size_t)((decoder->Width + 3) / 4) * GetBlockSize(format))
+        return ErrorCode::InvalidParameter;
+
+    // the blocks get their source format only for this call, the handle keeps what the caller selected
+    NativePixelFormat outputFormat = decoder->OutputFormat;
+    AlphaMode outputAlpha = decoder->OutputAlpha;
+
+    ErrorCode err = SetOutputFormat(handle, GetBlockSource(format), outputAlpha);
+    if (err == ErrorCode::Ok)
+        err = CompressImage(GetDecoder(handle), format, quality, (uint8_t *)memory, stride);
+
+    SetOutputFormat(handle, outputFormat, outputAlpha);
+    return err;
+}
+
+
+ErrorCode NotifyDataAvailable(DecoderHandle handle, uint64_t available)
+{
+    // the decoder itself, a decode may be running on it
+    auto decoder = (IDecoder *)handle;
+    if (!decoder || !decoder->Options.available)
+        return ErrorCode::InvalidParameter;
+
+    uint64_t now = decoder->Available;
+    while (available > now && !decoder->Available.compare_exchange_weak(now, available)) { }
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode GetDecodeProgress(DecoderHandle handle, NativeDecodeProgress &progress)
+{
+    progress = {};
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+
+    if (!decoder->Options.available)
+        progress = { decoder->Height, 1, 1 };
+    else
+        progress = { decoder->RowsComplete, decoder->Layers, decoder->LayerCount };
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode GetFrameCount(DecoderHandle handle, uint32_t &count)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    count = decoder->GetFrameCount();
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode GetFrameTiming(DecoderHandle handle, uint32_t index, NativeFrameTiming &timing)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    if (index >= decoder->GetFrameCount())
+        return ErrorCode::InvalidParameter;
+
+    timing = {};
+    decoder->GetFrameTiming(index, timing);
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode DecodeNextFrame(DecoderHandle handle, void *memory)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    uint32_t count = decoder->GetFrameCount();
+    if (decoder->NextFrame >= count)
+        return ErrorCode::EndOfStream;
+
+    decoder->Frame = decoder->NextFrame++;
+    ErrorCode err = GetImageData(handle, memory);
+    if (err == ErrorCode::Ok && decoder->NextFrame < count)
+        decoder->Prefetch(decoder->NextFrame);
+
+    return err;
+}
+
+
+ErrorCode SeekToFrame(DecoderHandle handle, uint32_t index)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    if (index >= decoder->GetFrameCount())
+        return ErrorCode::InvalidParameter;
+
+    decoder->NextFrame = index;
+    return ErrorCode::Ok;
+}
+
+
+ErrorCode GetImageDataBanded(DecoderHandle handle, uint32_t bandRows, void **buffers, uint32_t numBuffers, size_t stride, BandDelegate callback)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    size_t rowBytes = (size_t)decoder->Width * GetPixelSize(decoder->OutputFormat);
+    if (!callback || !bandRows)
+        return ErrorCode::InvalidParameter;
+
+    std::vector<uint8_t> band;
+    if (!buffers || !numBuffers)
+    {
+        stride = rowBytes;
+        band.resize(rowBytes * (bandRows < decoder->Height ? bandRows : decoder->Height));
+    }
+    else if (stride < rowBytes)
+        return ErrorCode::InvalidParameter;
+
+    ActiveDecode active(decoder->Control);
+    ErrorCode result = ErrorCode::Ok;
+    uint32_t index = 0;
+    for (uint32_t y = 0; y < decoder->Height; y += bandRows, index++)
+    {
+        uint32_t rows = decoder->Height - y < bandRows ? decoder->Height - y : bandRows;
+        uint8_t *mem = band.empty() ? (uint8_t *)buffers[index % numBuffers] : band.data();
+        if (!mem)
+            return ErrorCode::InvalidParameter;
+
+        ErrorCode err = ReadPixels(decoder, { 0, y, decoder->Width, rows }, mem, stride);
+        if (err == ErrorCode::Incomplete)
+            result = err;
+        else if (err != ErrorCode::Ok)
+            return err;
+
+        if (!callback(y, rows, mem, stride))
+            return ErrorCode::Cancelled;
+    }
+
+    return result;
+}
+
+
+// decodes one batch item with the given thread's decoder for its format, which gets reset for every image
+static ErrorCode DecodeRequest(NativeDecodeRequest &req, uint32_t index, const NativeBatchOptions &batch, int threads, DecoderHandle &handle)
+{
+    NativeDecodeOptions options = req.options;
+    options.threads = threads;
+
+    ErrorCode err;
+    if (handle)
+        err = req.data ? ResetDecoderFromMemory(handle, req.data, req.size, &options) : ResetDecoderFromFile(handle, req.path, &options);
+    else
+        err = req.data ? OpenDecoderFromMemory(req.format, req.data, req.size, &options, handle) : OpenDecoderFromFile(req.format, req.path, &options, handle);
+    if (err != ErrorCode::Ok)
+        return err;
+
+    auto decoder = GetDecoder(handle);
+    if (req.convert && IsPlanar(req.outputFormat))
+        return ErrorCode::InvalidParameter;
+    if (req.convert && (err = SetOutputFormat(handle, req.outputFormat, req.outputAlpha)) != ErrorCode::Ok)
+        return err;
+
+    req.sizeX = decoder->Width;
+    req.sizeY = decoder->Height;
+    req.pixelFormat = decoder->OutputFormat;
+
+    size_t rowBytes = (size_t)decoder->Width * GetPixelSize(decoder->OutputFormat);
+    void *memory = req.memory;
+    size_t stride = req.stride ? req.stride : rowBytes;
+
+    if (!memory)
+    {
+        NativeImageInfo info = {};
+        if (batch.allocate && (err = decoder->GetImageInfo(info)) == ErrorCode::Ok)
+        {
+            info.format = decoder->OutputFormat;
+            info.alpha = decoder->OutputAlpha;
+            stride = rowBytes;
+            memory = batch.allocate(batch.user, index, info, stride);
+        }
+        if (err != ErrorCode::Ok)
+            return err;
+        if (!memory)
+            return batch.allocate ? ErrorCode::Cancelled : ErrorCode::InvalidParameter;
+    }
+    else if (stride < rowBytes || stride * (decoder->Height - 1) + rowBytes > req.capacity)
+        return ErrorCode::ImageTooLarge;
+
+    return GetImageDataRegion(handle, 0, 0, decoder->Width, decoder->Height, memory, stride);
+}
+
+
+ErrorCode DecodeBatch(NativeDecodeRequest *requests, uint32_t count, const NativeBatchOptions *options)
+{
+    if (!requests && count)
+        return ErrorCode::InvalidParameter;
+
+    NativeBatchOptions batch = options ? *options : NativeBatchOptions{};
+    int limit = GetThreadLimit();
+    int threads = batch.threads > 0 && batch.threads < limit ? batch.threads : limit;
+    int poolThreads = std::min(threads, (int)std::max(count, 1u));
+
+    // whatever the pool doesn't use goes to the codecs: many small images decode one per thread,
+    // a few big ones get the codecs' own threading on top
+    int decodeThreads = std::max(threads / poolThreads, 1);
+
+    // biggest first, so the long ones don't end up last on a single thread. Files are looked up for their size
+    std::vector<uint32_t> order(count);
+    std::vector<uint64_t> sizes(count);
+    for (uint32_t i = 0; i < count; i++)
+    {
+        order[i] = i;
+        sizes[i] = requests[i].data ? requests[i].size : QueryFileSize(requests[i].path);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return sizes[a] > sizes[b]; });
+
+    ThreadPool pool(poolThreads);
+    std::vector<std::vector<DecoderHandle>> handles(pool.GetThreadCount(), std::vector<DecoderHandle>(NativeFormatCount, nullptr));
+
+    for (uint32_t i = 0; i < count; i++)
+    {
+        uint32_t index = order[i];
+        pool.Submit(i, [&, index](size_t thread)
+        {
+            NativeDecodeRequest &req = requests[index];
+            req.result = (uint32_t)req.format < NativeFormatCount && (req.data || req.path) ?
+                DecodeRequest(req, index, batch, decodeThreads, handles[thread][(uint32_t)req.format]) :
+                ErrorCode::InvalidParameter;
+
+            if (batch.complete)
+                batch.complete(batch.user, index, req.result);
+        });
+    }
+
+    pool.Wait();
+
+    for (auto &perThread : handles)
+        for (auto &handle : perThread)
+            if (handle)
+                CloseDecoder(handle);
+
+    return ErrorCode::Ok;
+}
+
+
+
+ErrorCode CreateDecodeControl(int priority, DecodeControlHandle &control)
+{
+    auto ctl = new DecodeControl();
+    ctl->Priority = priority;
+    control = ctl;
+    return ErrorCode::Ok;
+}
+
+
+void DestroyDecodeControl(DecodeControlHandle &control)
+{
+    delete (DecodeControl *)control;
+    control = nullptr;
+}
+
+
+void CancelDecode(DecodeControlHandle control)
+{
+    if (control)
+        ((DecodeControl *)control)->Cancel();
+}
+
+
+void SetDecodePriority(DecodeControlHandle control, int priority)
+{
+    if (control)
+        ((DecodeControl *)control)->SetPriority(priority);
+}
+
+
+ErrorCode SetDecodeControl(DecoderHandle handle, DecodeControlHandle control)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+
+    decoder->Control = (const DecodeControl *)control;
+    return ErrorCode::Ok;
+}
+
+
+// DecodeAsync jobs run on a pool of their own, as many at once as the thread limit allowed when it was first
+// used. Nobody waits on it, the jobs all go to queue 0 and get taken from there oldest first. It's never
+// destroyed, joining its threads while the library unloads would deadlock
+static ThreadPool &AsyncPool()
+{
+    static ThreadPool *pool = new ThreadPool(GetThreadLimit() + 1);
+    return *pool;
+}
+
+ErrorCode DecodeAsync(DecoderHandle handle, void *memory, size_t stride, DecodeControlHandle control, DecodeCompleteDelegate complete, void *user)
+{
+    auto decoder = GetDecoder(handle);
+    if (!decoder)
+        return ErrorCode::InvalidParameter;
+    if (!memory || !complete || stride < (size_t)decoder->Width * GetPixelSize(decoder->OutputFormat))
+        return ErrorCode::InvalidParameter;
+
+    // one job per handle at a time
+    auto owner = (IDecoder *)handle;
+    if (owner->Pending.valid() && owner->Pending.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        return ErrorCode::InvalidParameter;
+
+    try
+    {
+        auto done = std::make_shared<std::promise<void>>();
+        owner->Pending = done->get_future();
+        AsyncPool().Submit(0, [=](size_t)
+        {
+            auto previous = decoder->Control;
+            if (control)
+                decoder->Control = (const DecodeControl *)control;
+
+            ErrorCode err = GetImageDataRegion(handle, 0, 0, decoder->Width, decoder->Height, memory, stride);
+            decoder->Control = previous;
+
+            // the handle is free again before complete, which may close or reuse it
+            done->set_value();
+            complete(user, err);
+        });
+    }
+    catch (const std::system_error &)
+    {
+        owner->Pending = std::future<void>();
+        return ErrorCode::InternalError;
+    }
+
+    return ErrorCode::Ok;
+}
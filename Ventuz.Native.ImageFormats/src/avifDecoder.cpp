@@ -19,11 +19,14 @@
  * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <future>
+#include <vector>
+
+#include "convert.h"
 #include "decoder.h"
 #include "avif/avif.h"
 
-#define BUFFER_ALL 0
-
 class AvifDecoder: public IDecoder
 {
 public:
@@ -32,42 +35,80 @@ public:
 
     ~AvifDecoder()
     {
+        WaitPrefetch();
         if (decoder)
             avifDecoderDestroy(decoder);
+        delete io;
     }
 
     bool Init() override
     {
-        decoder = avifDecoderCreate();
+        // a reset decoder keeps its avifDecoder and IO buffer, avifDecoderParse() starts over
+        if (!decoder)
+            decoder = avifDecoderCreate();
         if (!decoder)
             return false;
 
-        avifDecoderSetIO(decoder, new IO(this));
+        // dav1d splits the work across tiles and frame threads
+        decoder->maxThreads = Threads;
 
-        auto res = avifDecoderParse(decoder);
-        if (res != AVIF_RESULT_OK)
+        // an incremental decode shows the layers of progressive images as they arrive, see DecodeFrame()
+        decoder->allowProgressive = Options.available ? AVIF_TRUE : AVIF_FALSE;
+
+        // memory sources are handed to libavif as a persistent IO, so it can point into them without copying.
+        // Incremental ones need the IO's checks against what's there yet
+        if (Data && !Options.available)
+            avifDecoderSetIOMemory(decoder, Data, DataSize);
+        else
         {
-            if (decoder->diag.error) Log(LogLevel::Error, decoder->diag.error);
-            return false;
+            if (!io)
+                io = new IO(this);
+            io->Open();
+            avifDecoderSetIO(decoder, io);
         }
 
-        res = avifDecoderNextImage(decoder);
+        auto res = avifDecoderParse(decoder);
         if (res != AVIF_RESULT_OK)
         {
             if (decoder->diag.error) Log(LogLevel::Error, decoder->diag.error);
             return false;
         }
 
+        // the parsed container already has size, depth, CICP and metadata in decoder->image;
+        // the AV1 payload only gets decoded once pixels are actually requested
         avifRGBImageSetDefaults(&rgbImage, decoder->image);
-        //rgbImage.isFloat = rgbImage.depth == 10 ? 1 : 0;
+        // half float output (isFloat) is only used for images that get linearized or when asked for through SelectOutput()
         rgbImage.depth = rgbImage.depth > 8 ? 16 : 8;
+        rgbImage.chromaUpsampling =
+            Options.chromaUpsampling == ChromaUpsampling::Fastest ? AVIF_CHROMA_UPSAMPLING_FASTEST :
+            Options.chromaUpsampling == ChromaUpsampling::BestQuality ? AVIF_CHROMA_UPSAMPLING_BEST_QUALITY :
+            AVIF_CHROMA_UPSAMPLING_AUTOMATIC;
         rgbImage.alphaPremultiplied = decoder->image->alphaPremultiplied;
-
+        rgbImage.maxThreads = Threads;
+
+        // for a target size the YUV planes get scaled before the conversion, so only the reduced image is converted
+        GetTargetSize(Options, decoder->image->width, decoder->image->height, rgbImage.width, rgbImage.height);
+
+        // the rows of grids decoded so far can be shown before the rest arrives, unless the frame gets scaled:
+        // that happens in place, and libavif continues decoding into the frame
+        decoder->allowIncremental = Options.available && !Layered() &&
+            rgbImage.width == decoder->image->width && rgbImage.height == decoder->image->height ? AVIF_TRUE : AVIF_FALSE;
+        LayerCount = Layered() ? (uint32_t)decoder->imageCount : 1;
+
+        Width = rgbImage.width;
+        Height = rgbImage.height;
+        if (decoder->alphaPresent)
+            Alpha = decoder->image->alphaPremultiplied ? AlphaMode::Premultiplied : AlphaMode::Straight;
+        // images that get linearized only exist as half float
+        Format = rgbImage.depth > 8 ? (LinearHdr() ? NativePixelFormat::RGBA_F16 : NativePixelFormat::RGBA_UN16) : NativePixelFormat::RGBA_UN8;
+        SetRgbFormat(Format);
+        rgbFormat = Format;
         return true;
     }
 
     ErrorCode GetImageInfo(NativeImageInfo &info) override
     {
+        WaitPrefetch();
         if (!decoder || !decoder->image)
             return ErrorCode::BadFormat;
 
@@ -76,80 +117,369 @@ public:
 
         info.sizeX = rgbImage.width;
         info.sizeY = rgbImage.height;
-        info.format = rgbImage.depth > 8 ? (rgbImage.isFloat ? NativePixelFormat::RGBA_F16 : NativePixelFormat::RGBA_UN16) : NativePixelFormat::RGBA_UN8;
-        info.alpha = decoder->image->alphaPlane ?
-            (decoder->image->alphaPremultiplied ? AlphaMode::Premultiplied : AlphaMode::Straight) :
-            AlphaMode::Unknown;
+        info.format = Format;
+        info.alpha = Alpha;
         info.colorPrimaries = decoder->image->colorPrimaries;
-        info.transferCharacteristics = decoder->image->transferCharacteristics;
+        info.transferCharacteristics = Linearize() ? 8 : decoder->image->transferCharacteristics;
+        info.matrixCoefficients = decoder->image->matrixCoefficients;
+        info.fullRange = decoder->image->yuvRange == AVIF_RANGE_FULL;
+        info.subsampling = ToSubsampling(decoder->image->yuvFormat);
+        info.bitDepth = decoder->image->depth;
+        return ErrorCode::Ok;
+    }
 
-        info.exifData = decoder->image->exif.data;
-        info.exifSize = (int)decoder->image->exif.size;
-        info.xmpData = decoder->image->xmp.data;
-        info.xmpSize = (int)decoder->image->xmp.size;
-        info.iccData = decoder->image->icc.data;
-        info.iccSize = (int)decoder->image->icc.size;
+    uint32_t GetMetadata(MetadataKind kind, void *buffer, uint32_t size) override
+    {
+        // libavif parses all of it along with the container
+        WaitPrefetch();
+        if (!decoder || !decoder->image)
+            return 0;
 
-        return ErrorCode::Ok;
+        const avifRWData &data =
+            kind == MetadataKind::Exif ? decoder->image->exif :
+            kind == MetadataKind::Xmp ? decoder->image->xmp :
+            decoder->image->icc;
+        return CopyMetadata(data.data, data.size, buffer, size);
     }
 
-    ErrorCode GetImageData(void *memory) override
+    ErrorCode GetImageData(const Rect &rect, uint8_t *memory, size_t stride) override
     {
-        if (!memory)
-            return ErrorCode::InvalidParameter;
+        WaitPrefetch();
+        if (current < 0)
+        {
+            ErrorCode err = DecodeFrame(0);
+            if (err != ErrorCode::Ok)
+                return err;
+        }
 
-        rgbImage.pixels = (uint8_t *)memory;
-        rgbImage.rowBytes = rgbImage.width * (rgbImage.depth > 8 ? 8 : 4);
+        // the conversion runs in bands (of even height, for subsampled chroma), so a cancelled
+        // or preempted decode stops in between. Each band is still split across the threads.
+        // Rows a partial frame doesn't have yet are zero
+        uint32_t bandRows = 32 * (Threads > 2 ? Threads : 2);
+        uint32_t bottom = rect.y + rect.height;
+        uint32_t shown = std::min(std::max(shownRows, rect.y), bottom);
+        for (uint32_t y = rect.y; y < shown;)
+        {
+            if (!Continue())
+                return ErrorCode::Cancelled;
+
+            uint32_t end = (y / bandRows + 1) * bandRows;
+            uint32_t rows = (end < shown ? end : shown) - y;
+
+            ErrorCode err = ConvertRect({ rect.x, y, rect.width, rows }, memory + (y - rect.y) * stride, stride);
+            if (err != ErrorCode::Ok)
+                return err;
+            y += rows;
+        }
+
+        if (shown < bottom)
+            ClearRows(memory + (shown - rect.y) * stride, stride, rect.width * GetPixelSize(rgbFormat), bottom - shown);
+        return partial ? ErrorCode::Incomplete : ErrorCode::Ok;
+    }
+
+    void Reset() override
+    {
+        WaitPrefetch();
+        current = -1;
+        partial = false;
+        shownRows = 0;
+        rgbImage = {};
+        Stats.Hold(-(int64_t)frameBytes);
+        frameBytes = 0;
+    }
+
+    uint32_t GetFrameCount() override
+    {
+        if (Layered())
+            return 1;
+        return decoder->imageCount > 0 ? (uint32_t)decoder->imageCount : 1;
+    }
+
+    bool GetFrameTiming(uint32_t index, NativeFrameTiming &timing) override
+    {
+        avifImageTiming t;
+        if (avifDecoderNthImageTiming(decoder, index, &t) != AVIF_RESULT_OK)
+            return false;
+
+        timing.timescale = t.timescale;
+        timing.pts = t.pts;
+        timing.ptsInTimescales = t.ptsInTimescales;
+        timing.duration = t.duration;
+        timing.durationInTimescales = t.durationInTimescales;
+        return true;
+    }
+
+    ErrorCode SelectFrame(uint32_t index) override
+    {
+        WaitPrefetch();
+        return (int)index == current && !partial ? ErrorCode::Ok : DecodeFrame(index);
+    }
+
+    void Prefetch(uint32_t index) override
+    {
+        // delegate sources only get read on the caller's thread, their callbacks needn't be thread safe
+        WaitPrefetch();
+        if (Data && (int)index != current)
+            prefetch = std::async(std::launch::async, [this, index] { DecodeFrame(index); });
+    }
+
+    ErrorCode GetImageDataPlanar(const NativePlane *planes) override
+    {
+        WaitPrefetch();
+        if (current < 0)
+        {
+            ErrorCode err = DecodeFrame(0);
+            if (err != ErrorCode::Ok)
+                return err;
+        }
+
+        if (!shownRows)
+            return ErrorCode::Incomplete;
+
+        // the decoded frame (scaled to the target size, if any) has exactly the planes asked for.
+        // Rows a partial frame doesn't have yet are left alone
+        const avifImage *image = decoder->image;
+        YuvPlanes src = {
+            { image->yuvPlanes[AVIF_CHAN_Y], image->yuvPlanes[AVIF_CHAN_U], image->yuvPlanes[AVIF_CHAN_V], image->alphaPlane },
+            { image->yuvRowBytes[AVIF_CHAN_Y], image->yuvRowBytes[AVIF_CHAN_U], image->yuvRowBytes[AVIF_CHAN_V], image->alphaRowBytes },
+            image->depth, image->depth };
+
+        PhaseTimer timer(Stats.Copy);
+        WritePlanes(src, 0, 0, Width, shownRows, OutputFormat, planes, 0, 0);
+        return partial ? ErrorCode::Incomplete : ErrorCode::Ok;
+    }
+
+    bool SelectOutput(NativePixelFormat format, AlphaMode alpha) override
+    {
+        // the YUV planes of linearized images aren't linear, so they aren't handed out
+        if (IsPlanar(format))
+            return !LinearHdr() && GetSubsampling(format) == ToSubsampling(decoder->image->yuvFormat);
+
+        // anything libavif can't write goes back to the native format, the api converts from that.
+        // So do linearized images in anything but half float, the curves are applied to those
+        bool direct = (!LinearHdr() || format == NativePixelFormat::RGBA_F16) && SetRgbFormat(format);
+        if (!direct)
+        {
+            SetRgbFormat(Format);
+            format = Format;
+            alpha = Alpha;
+        }
+
+        rgbImage.alphaPremultiplied = alpha == AlphaMode::Premultiplied;
+        rgbFormat = format;
+        return direct;
+    }
+
+private:
+
+    // libavif converts from YUV to all of these in one go
+    bool SetRgbFormat(NativePixelFormat format)
+    {
+        switch (format)
+        {
+        case NativePixelFormat::RGBA_UN8: rgbImage.format = AVIF_RGB_FORMAT_RGBA; rgbImage.depth = 8; break;
+        case NativePixelFormat::BGRA_UN8: rgbImage.format = AVIF_RGB_FORMAT_BGRA; rgbImage.depth = 8; break;
+        case NativePixelFormat::RGBA_UN16: rgbImage.format = AVIF_RGB_FORMAT_RGBA; rgbImage.depth = 16; break;
+        case NativePixelFormat::RGBA_F16: rgbImage.format = AVIF_RGB_FORMAT_RGBA; rgbImage.depth = 16; break;
+        default: return false;
+        }
+
+        rgbImage.isFloat = format == NativePixelFormat::RGBA_F16;
+        return true;
+    }
+
+    // converts rect of the decoded frame to RGB
+    ErrorCode ConvertRect(const Rect &rect, uint8_t *memory, size_t stride)
+    {
+        // libavif decodes grids as a whole, but at least the conversion is limited to the rectangle.
+        // Views into subsampled chroma need an even origin, so odd ones convert a bit more into a temp buffer
+        avifPixelFormatInfo fmtInfo;
+        avifGetPixelFormatInfo(decoder->image->yuvFormat, &fmtInfo);
+        uint32_t x0 = rect.x & ~((1u << fmtInfo.chromaShiftX) - 1);
+        uint32_t y0 = rect.y & ~((1u << fmtInfo.chromaShiftY) - 1);
+
+        avifCropRect crop = { x0, y0, rect.width + rect.x - x0, rect.height + rect.y - y0 };
+        avifImage *view = avifImageCreateEmpty();
+        auto res = avifImageSetViewRect(view, decoder->image, &crop);
+
+        avifRGBImage rgb = rgbImage;
+        rgb.width = crop.width;
+        rgb.height = crop.height;
+
+        size_t ps = GetPixelSize(rgbFormat);
+        bool direct = x0 == rect.x && y0 == rect.y;
+        if (direct)
+        {
+            rgb.pixels = memory;
+            rgb.rowBytes = (uint32_t)stride;
+        }
+        else
+        {
+            rgb.rowBytes = (uint32_t)(crop.width * ps);
+            size_t capacity = scratch.capacity();
+            scratch.resize((size_t)rgb.rowBytes * crop.height);
+            Stats.Hold((int64_t)scratch.capacity() - (int64_t)capacity);
+            rgb.pixels = scratch.data();
+        }
+
+        if (res == AVIF_RESULT_OK)
+        {
+            PhaseTimer timer(Stats.Convert);
+            res = avifImageYUVToRGB(view, &rgb);
+        }
+        avifImageDestroy(view);
 
-        auto res = avifImageYUVToRGB(decoder->image, &rgbImage);
         if (res != AVIF_RESULT_OK)
         {
             if (decoder->diag.error) Log(LogLevel::Error, decoder->diag.error);
             return ErrorCode::InternalError;
         }
 
+        if (!direct)
+        {
+            PhaseTimer timer(Stats.Copy);
+            CopyRows(memory, stride, rgb.pixels + (rect.y - y0) * rgb.rowBytes + (rect.x - x0) * ps, rgb.rowBytes, rect.width * ps, rect.height);
+        }
+
+        // while the rectangle is still in the cache
+        if (Linearize())
+        {
+            PhaseTimer timer(Stats.Convert);
+            LinearizeRows(memory, stride, rect.width, rect.height, decoder->image->transferCharacteristics);
+        }
+
         return ErrorCode::Ok;
     }
 
-private:
+    // decodes a frame into decoder->image, keeping dav1d's state when it's the next one in sequence.
+    // While an incremental source is missing data the frame may be partial, the next call continues it
+    ErrorCode DecodeFrame(uint32_t index)
+    {
+        current = -1;
+        PhaseTimer timer(Stats.Decode);
+
+        // the layers of a progressive image make up its one frame, each refining the one before.
+        // As many get decoded as there's data for, the last one is shown
+        avifResult res = AVIF_RESULT_OK;
+        if (Layered())
+        {
+            while (decoder->imageIndex + 1 < decoder->imageCount && (res = avifDecoderNextImage(decoder)) == AVIF_RESULT_OK) { }
+            if (res == AVIF_RESULT_WAITING_ON_IO && decoder->imageIndex >= 0)
+                res = AVIF_RESULT_OK;
+        }
+        else
+            res = (int)index == decoder->imageIndex + 1 ? avifDecoderNextImage(decoder) : avifDecoderNthImage(decoder, index);
+
+        partial = Layered() ? decoder->imageIndex + 1 < decoder->imageCount : res == AVIF_RESULT_WAITING_ON_IO;
+        Layers = Layered() ? (uint32_t)(decoder->imageIndex + 1) : partial ? 0 : 1;
+        if (res == AVIF_RESULT_WAITING_ON_IO)
+        {
+            // the rows of a grid that are decoded already (allowIncremental), if any; layers come whole
+            shownRows = Layered() ? 0 : avifDecoderDecodedRowCount(decoder);
+            RowsComplete = shownRows;
+            current = (int)index;
+            return ErrorCode::Ok;
+        }
+
+        if (res != AVIF_RESULT_OK)
+        {
+            if (decoder->diag.error) Log(LogLevel::Error, decoder->diag.error);
+            return ErrorCode::BadFormat;
+        }
+
+        if (rgbImage.width != decoder->image->width || rgbImage.height != decoder->image->height)
+        {
+            res = avifImageScale(decoder->image, rgbImage.width, rgbImage.height, &decoder->diag);
+            if (res != AVIF_RESULT_OK)
+            {
+                if (decoder->diag.error) Log(LogLevel::Error, decoder->diag.error);
+                return ErrorCode::InternalError;
+            }
+        }
+
+        size_t bytes = FrameBytes();
+        Stats.Hold((int64_t)bytes - (int64_t)frameBytes);
+        frameBytes = bytes;
+
+        shownRows = Height;
+        RowsComplete = partial ? 0 : Height;
+        current = (int)index;
+        return ErrorCode::Ok;
+    }
+
+    // a progressive image whose layers get decoded one by one, only for incremental decodes
+    bool Layered() const
+    {
+        return decoder->progressiveState == AVIF_PROGRESSIVE_STATE_ACTIVE;
+    }
+
+    static ChromaSubsampling ToSubsampling(avifPixelFormat format)
+    {
+        switch (format)
+        {
+        case AVIF_PIXEL_FORMAT_YUV420: return ChromaSubsampling::Yuv420;
+        case AVIF_PIXEL_FORMAT_YUV422: return ChromaSubsampling::Yuv422;
+        case AVIF_PIXEL_FORMAT_YUV444: return ChromaSubsampling::Yuv444;
+        case AVIF_PIXEL_FORMAT_YUV400: return ChromaSubsampling::Yuv400;
+        default: return ChromaSubsampling::None;
+        }
+    }
+
+    // size of the planes of the decoded frame
+    size_t FrameBytes() const
+    {
+        const avifImage *image = decoder->image;
+        avifPixelFormatInfo fmtInfo;
+        avifGetPixelFormatInfo(image->yuvFormat, &fmtInfo);
+        size_t chromaRows = (image->height + fmtInfo.chromaShiftY) >> fmtInfo.chromaShiftY;
+        return (size_t)image->yuvRowBytes[AVIF_CHAN_Y] * image->height +
+            ((size_t)image->yuvRowBytes[AVIF_CHAN_U] + image->yuvRowBytes[AVIF_CHAN_V]) * chromaRows +
+            (size_t)image->alphaRowBytes * image->height;
+    }
+
+    void WaitPrefetch()
+    {
+        if (prefetch.valid())
+            prefetch.get();
+    }
+
+    // PQ/HLG of more than 8 bits to linear light, applied to half float output
+    bool LinearHdr() const
+    {
+        int tc = decoder->image->transferCharacteristics;
+        return Options.linearize && decoder->image->depth > 8 && (tc == 16 || tc == 18);
+    }
+
+    bool Linearize() const
+    {
+        return LinearHdr() && rgbFormat == NativePixelFormat::RGBA_F16;
+    }
 
     class IO: public avifIO
     {
     public:
+        // owned by the AvifDecoder, so libavif doesn't destroy it and it survives resets
         IO(AvifDecoder *dec): decoder(dec)
         {
-            destroy = Destroy;
+            destroy = nullptr;
             read = ReadProxy;
             write = nullptr;
             persistent = AVIF_FALSE;
             data = nullptr;
-
-            fsize = (uint64_t)decoder->Seek(0, SeekOrigin::End);
-            fpos = fsize;
-            sizeHint = fsize;
-
-#if BUFFER_ALL
-            buffer = new uint8_t[fsize];
-            decoder->Seek(0, SeekOrigin::Begin);
-            decoder->Read(buffer, fsize);
-            persistent = AVIF_TRUE;
-#endif
         }
 
-        ~IO()
+        // binds to the decoder's current source; memory ones stay valid as long as the decoder needs them
+        void Open()
         {
-            delete[] buffer;
+            sizeHint = decoder->SourceSize();
+            persistent = decoder->Data ? AVIF_TRUE : AVIF_FALSE;
         }
 
     private:
 
         AvifDecoder *decoder;
-        uint64_t fpos;
-        uint64_t fsize;
-
-        uint8_t *buffer = nullptr;
-        size_t bsize = 0;
 
+        // the data only has to stay valid until the next read, so it can point into the source's buffer
         avifResult Read(uint32_t readFlags, uint64_t offset, size_t size, avifROData *out)
         {
             if (readFlags != 0) {
@@ -157,44 +487,42 @@ private:
                 return AVIF_RESULT_IO_ERROR;
             }
 
-            if (size > fsize - offset)
-                size = fsize - offset;
+            uint64_t sourceSize = decoder->SourceSize();
+            if (offset > sourceSize)
+                return AVIF_RESULT_IO_ERROR;
 
-#if BUFFER_ALL
-            out->data = buffer + offset;
-            out->size = size;
-#else
-            if (offset != fpos)
-                decoder->Seek((int64_t)offset, SeekOrigin::Begin);
+            // data of an incremental source that hasn't arrived yet; libavif asks again on the next decode
+            uint64_t end = size < sourceSize - offset ? offset + size : sourceSize;
+            if (end > decoder->Available)
+                return AVIF_RESULT_WAITING_ON_IO;
 
-            if (size > bsize)
+            if (decoder->Data)
             {
-                delete[] buffer;
-                bsize = size * 2;
-                if (bsize < 65536) bsize = 65536;
-                buffer = new uint8_t[bsize];
+                out->data = decoder->Data + offset;
+                out->size = (size_t)(end - offset);
+                return AVIF_RESULT_OK;
             }
 
-            out->data = buffer;
-            out->size = (size_t)decoder->Read(buffer, (int)size);
-            fpos += offset + out->size;
-#endif
-            return AVIF_RESULT_OK;
+            out->data = decoder->Source.Peek(offset, size, out->size);
+            return out->data ? AVIF_RESULT_OK : AVIF_RESULT_IO_ERROR;
         }
 
         static avifResult ReadProxy(struct avifIO *io, uint32_t readFlags, uint64_t offset, size_t size, avifROData *out)
         {
             return ((IO *)io)->Read(readFlags, offset, size, out);
         }
-
-        static void Destroy(struct avifIO *io)
-        {
-            delete (IO *)io;
-        }
     };
 
     avifDecoder *decoder = nullptr;
+    IO *io = nullptr;
     avifRGBImage rgbImage = {};
+    NativePixelFormat rgbFormat = NativePixelFormat::RGBA_UN8; // what rgbImage is set up for
+    int current = -1; // frame in decoder->image
+    bool partial = false; // decoder->image is a lower layer or the top rows of the frame
+    uint32_t shownRows = 0; // rows of decoder->image that have pixels
+    std::future<void> prefetch;
+    std::vector<uint8_t> scratch;
+    size_t frameBytes = 0;
 };
 
 IDecoder *CreateAvifDecoder() { return new AvifDecoder(); }
@@ -0,0 +1,94 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+
+#include <DirectXTex.h>
+
+#include "convert.h"
+#include "decoder.h"
+
+// The encoders are DirectXTex's. It works on whole images, so every band goes in as an image of its own,
+// and the api runs several of them at once instead of using DirectXTex's OpenMP path.
+
+uint32_t GetBlockSize(NativeBlockFormat format)
+{
+    return format == NativeBlockFormat::BC1 ? 8 : 16;
+}
+
+NativePixelFormat GetBlockSource(NativeBlockFormat format)
+{
+    return format == NativeBlockFormat::BC6H ? NativePixelFormat::RGBA_F16 : NativePixelFormat::RGBA_UN8;
+}
+
+static DXGI_FORMAT GetDxgiFormat(NativeBlockFormat format)
+{
+    switch (format)
+    {
+    case NativeBlockFormat::BC1: return DXGI_FORMAT_BC1_UNORM;
+    case NativeBlockFormat::BC3: return DXGI_FORMAT_BC3_UNORM;
+    case NativeBlockFormat::BC7: return DXGI_FORMAT_BC7_UNORM;
+    case NativeBlockFormat::BC6H: return DXGI_FORMAT_BC6H_UF16;
+    default: return DXGI_FORMAT_UNKNOWN;
+    }
+}
+
+static DirectX::TEX_COMPRESS_FLAGS GetCompressFlags(NativeBlockFormat format, BlockQuality quality)
+{
+    switch (quality)
+    {
+    case BlockQuality::Fast:
+        // BC7 mode 6 only; the others skip the perceptual channel weighting
+        return format == NativeBlockFormat::BC7 ? DirectX::TEX_COMPRESS_BC7_QUICK : DirectX::TEX_COMPRESS_UNIFORM;
+    case BlockQuality::Best:
+        return format == NativeBlockFormat::BC7 ? DirectX::TEX_COMPRESS_BC7_USE_3SUBSETS : DirectX::TEX_COMPRESS_DEFAULT;
+    default:
+        return DirectX::TEX_COMPRESS_DEFAULT;
+    }
+}
+
+bool CompressBlocks(uint8_t *dest, size_t destStride, NativeBlockFormat format, BlockQuality quality,
+    const uint8_t *src, size_t srcStride, uint32_t width, uint32_t rows)
+{
+    DXGI_FORMAT blockFormat = GetDxgiFormat(format);
+    if (blockFormat == DXGI_FORMAT_UNKNOWN || !width || !rows)
+        return false;
+
+    DirectX::Image image = {};
+    image.width = width;
+    image.height = rows;
+    image.format = format == NativeBlockFormat::BC6H ? DXGI_FORMAT_R16G16B16A16_FLOAT : DXGI_FORMAT_R8G8B8A8_UNORM;
+    image.rowPitch = srcStride;
+    image.slicePitch = srcStride * rows;
+    image.pixels = const_cast<uint8_t *>(src);
+
+    DirectX::ScratchImage blocks;
+    if (FAILED(DirectX::Compress(image, blockFormat, GetCompressFlags(format, quality), DirectX::TEX_THRESHOLD_DEFAULT, blocks)))
+        return false;
+
+    const DirectX::Image *out = blocks.GetImage(0, 0, 0);
+    if (!out)
+        return false;
+
+    size_t rowBytes = (size_t)((width + 3) / 4) * GetBlockSize(format);
+    CopyRows(dest, destStride, out->pixels, out->rowPitch, rowBytes, (rows + 3) / 4);
+    return true;
+}
@@ -0,0 +1,185 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <limits.h>
+
+#include "decoder.h"
+
+void BufferedSource::Open(ReadDelegate r, SeekDelegate s, size_t block, DecoderCounters *counters, const std::atomic<uint64_t> *available)
+{
+    read = r;
+    seek = s;
+    stats = counters;
+    arrived = available;
+
+    // whole blocks are read at aligned offsets, so it has to be a power of two
+    blockSize = 4096;
+    while (blockSize < (block ? block : DefaultBlockSize) && blockSize < ((size_t)1 << 30))
+        blockSize *= 2;
+
+    int64_t end;
+    {
+        PhaseTimer timer(stats->Read);
+        end = seek(0, SeekOrigin::End);
+        stats->SeekCalls++;
+    }
+    size = end > 0 ? (uint64_t)end : 0;
+    sourcePos = size;
+    pos = 0;
+    bufferStart = 0;
+    buffered = 0;
+}
+
+void BufferedSource::Close()
+{
+    read = nullptr;
+    seek = nullptr;
+    arrived = nullptr;
+    size = pos = sourcePos = 0;
+    bufferStart = 0;
+    buffered = 0;
+}
+
+size_t BufferedSource::Read(void *dest, size_t count)
+{
+    auto out = (uint8_t *)dest;
+    size_t total = 0;
+    uint64_t limit = Limit();
+
+    while (count && pos < limit)
+    {
+        // from what's buffered
+        if (pos >= bufferStart && pos < bufferStart + buffered)
+        {
+            size_t offset = (size_t)(pos - bufferStart);
+            size_t n = buffered - offset < count ? buffered - offset : count;
+            memcpy(out, buffer.data() + offset, n);
+            out += n;
+            pos += n;
+            total += n;
+            count -= n;
+            continue;
+        }
+
+        // large reads go straight to the destination, everything else through a block
+        if (count >= blockSize)
+        {
+            size_t n = ReadAt(pos, out, limit - pos < count ? (size_t)(limit - pos) : count);
+            pos += n;
+            total += n;
+            break;
+        }
+
+        Fill(pos, count);
+        if (pos < bufferStart || pos >= bufferStart + buffered)
+            break;
+    }
+
+    return total;
+}
+
+const uint8_t *BufferedSource::Peek(uint64_t offset, size_t count, size_t &available)
+{
+    available = 0;
+    uint64_t limit = Limit();
+    if (offset >= limit)
+        return buffer.data();
+    if (count > limit - offset)
+        count = (size_t)(limit - offset);
+
+    if (!Fill(offset, count))
+        return nullptr;
+
+    available = count;
+    return buffer.data() + (offset - bufferStart);
+}
+
+// makes the buffer cover [offset, offset + count), in whole blocks. A range that overlaps the end of the
+// buffered one keeps the overlap and only reads what's missing, so nearby ranges coalesce into one read
+bool BufferedSource::Fill(uint64_t offset, size_t count)
+{
+    uint64_t limit = Limit();
+    uint64_t end = offset + count < limit ? offset + count : limit;
+    if (offset >= bufferStart && end <= bufferStart + buffered)
+        return true;
+
+    // the last block may be a partial one while the source is still arriving; it gets completed once more is there
+    uint64_t start = offset & ~(uint64_t)(blockSize - 1);
+    uint64_t blockEnd = (end + blockSize - 1) & ~(uint64_t)(blockSize - 1);
+    if (blockEnd > limit)
+        blockEnd = limit;
+
+    size_t keep = 0;
+    if (start >= bufferStart && start < bufferStart + buffered)
+    {
+        keep = (size_t)(bufferStart + buffered - start);
+        memmove(buffer.data(), buffer.data() + (start - bufferStart), keep);
+    }
+
+    size_t needed = (size_t)(blockEnd - start);
+    if (buffer.size() < needed)
+    {
+        stats->Hold((int64_t)needed - (int64_t)buffer.size());
+        buffer.resize(needed);
+    }
+
+    bufferStart = start;
+    buffered = keep + ReadAt(start + keep, buffer.data() + keep, needed - keep);
+    return end <= bufferStart + buffered;
+}
+
+size_t BufferedSource::ReadAt(uint64_t offset, uint8_t *dest, size_t count)
+{
+    if (!read)
+        return 0;
+
+    PhaseTimer timer(stats->Read);
+    if (offset != sourcePos)
+    {
+        stats->SeekCalls++;
+        stats->SeekDistance += offset > sourcePos ? offset - sourcePos : sourcePos - offset;
+
+        int64_t p = seek((int64_t)offset, SeekOrigin::Begin);
+        if (p != (int64_t)offset)
+        {
+            sourcePos = p < 0 ? size : (uint64_t)p;
+            return 0;
+        }
+        sourcePos = offset;
+    }
+
+    // the delegate takes int sizes
+    size_t total = 0;
+    while (total < count)
+    {
+        size_t chunk = count - total < (size_t)INT_MAX ? count - total : (size_t)INT_MAX;
+        int n = read(dest + total, (int)chunk);
+        stats->ReadCalls++;
+        if (n <= 0)
+            break;
+        total += n;
+    }
+
+    sourcePos += total;
+    stats->BytesRead += total;
+    return total;
+}
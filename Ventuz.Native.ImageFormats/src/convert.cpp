@@ -0,0 +1,1295 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <intrin.h>
+#include <immintrin.h>
+#include <math.h>
+#include <string.h>
+#include <mutex>
+
+#include "convert.h"
+#include "decoder.h"
+
+// Rows get converted four pixels at a time, each as a float4 in an SSE register: a loader per source
+// format, an optional alpha operation and a storer per destination format, all inlined into one loop
+// per combination. The SSE kernels need SSE4.1 and F16C (anything since Ivy Bridge); without them, and for
+// the less common source formats, a scalar path does the same.
+
+static float HalfToFloat(uint16_t h)
+{
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+
+    uint32_t bits;
+    if (exp == 0x1f)
+        bits = sign | 0x7f800000 | (mant << 13);
+    else if (exp)
+        bits = sign | ((exp + 112) << 23) | (mant << 13);
+    else if (mant)
+    {
+        // denormal: normalize
+        exp = 113;
+        while (!(mant & 0x400))
+        {
+            mant <<= 1;
+            exp--;
+        }
+        bits = sign | (exp << 23) | ((mant & 0x3ff) << 13);
+    }
+    else
+        bits = sign;
+
+    float f;
+    memcpy(&f, &bits, 4);
+    return f;
+}
+
+static uint16_t FloatToHalf(float f)
+{
+    uint32_t bits;
+    memcpy(&bits, &f, 4);
+
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    uint32_t exp = (bits >> 23) & 0xff;
+    uint32_t mant = bits & 0x7fffff;
+
+    if (exp == 0xff)
+        return (uint16_t)(sign | 0x7c00 | (mant ? 0x200 : 0));
+    if (exp > 142)
+        return (uint16_t)(sign | 0x7c00);
+    if (exp < 102)
+        return sign;
+
+    uint32_t shift;
+    uint32_t value;
+    if (exp < 113)
+    {
+        // denormal result
+        mant |= 0x800000;
+        shift = 126 - exp;
+        value = mant >> shift;
+    }
+    else
+    {
+        shift = 13;
+        value = ((exp - 112) << 10) | (mant >> 13);
+    }
+
+    // round to nearest even; a carry into the exponent is what we want
+    uint32_t rest = mant & ((1u << shift) - 1);
+    uint32_t half = 1u << (shift - 1);
+    if (rest > half || (rest == half && (value & 1)))
+        value++;
+
+    return (uint16_t)(sign | value);
+}
+
+static float Saturate(float x)
+{
+    return x > 0 ? (x < 1 ? x : 1) : 0;
+}
+
+static void LoadPixel(NativePixelFormat format, const uint8_t *p, float v[4])
+{
+    auto p16 = (const uint16_t *)p;
+    auto p32 = (const float *)p;
+
+    v[0] = v[1] = v[2] = 0;
+    v[3] = 1;
+
+    switch (format)
+    {
+    case NativePixelFormat::RGBA_UN8:
+        for (int i = 0; i < 4; i++) v[i] = p[i] * (1.0f / 255);
+        break;
+    case NativePixelFormat::BGRA_UN8:
+        v[0] = p[2] * (1.0f / 255);
+        v[1] = p[1] * (1.0f / 255);
+        v[2] = p[0] * (1.0f / 255);
+        v[3] = p[3] * (1.0f / 255);
+        break;
+    case NativePixelFormat::RGBA_UN16:
+        for (int i = 0; i < 4; i++) v[i] = p16[i] * (1.0f / 65535);
+        break;
+    case NativePixelFormat::RGBA_F16:
+        for (int i = 0; i < 4; i++) v[i] = HalfToFloat(p16[i]);
+        break;
+    case NativePixelFormat::R_F16:
+        v[0] = HalfToFloat(p16[0]);
+        break;
+    case NativePixelFormat::R_F32:
+        v[0] = p32[0];
+        break;
+    case NativePixelFormat::RGBA_F32:
+        for (int i = 0; i < 4; i++) v[i] = p32[i];
+        break;
+    case NativePixelFormat::RGB_F16:
+        for (int i = 0; i < 3; i++) v[i] = HalfToFloat(p16[i]);
+        break;
+    case NativePixelFormat::RGB_F32:
+        for (int i = 0; i < 3; i++) v[i] = p32[i];
+        break;
+    default:
+        break;
+    }
+}
+
+static void StorePixel(NativePixelFormat format, uint8_t *p, const float v[4])
+{
+    auto p16 = (uint16_t *)p;
+    auto p32 = (float *)p;
+
+    switch (format)
+    {
+    case NativePixelFormat::RGBA_UN8:
+        for (int i = 0; i < 4; i++) p[i] = (uint8_t)(Saturate(v[i]) * 255 + 0.5f);
+        break;
+    case NativePixelFormat::BGRA_UN8:
+        p[0] = (uint8_t)(Saturate(v[2]) * 255 + 0.5f);
+        p[1] = (uint8_t)(Saturate(v[1]) * 255 + 0.5f);
+        p[2] = (uint8_t)(Saturate(v[0]) * 255 + 0.5f);
+        p[3] = (uint8_t)(Saturate(v[3]) * 255 + 0.5f);
+        break;
+    case NativePixelFormat::RGBA_UN16:
+        for (int i = 0; i < 4; i++) p16[i] = (uint16_t)(Saturate(v[i]) * 65535 + 0.5f);
+        break;
+    case NativePixelFormat::RGBA_F16:
+        for (int i = 0; i < 4; i++) p16[i] = FloatToHalf(v[i]);
+        break;
+    case NativePixelFormat::RGBA_F32:
+        for (int i = 0; i < 4; i++) p32[i] = v[i];
+        break;
+    default:
+        break;
+    }
+}
+
+static void ApplyAlpha(float v[4], AlphaOp alpha)
+{
+    if (alpha == AlphaOp::Premultiply)
+    {
+        for (int i = 0; i < 3; i++) v[i] *= v[3];
+    }
+    else if (alpha == AlphaOp::Unpremultiply)
+    {
+        float scale = v[3] > 0 ? 1 / v[3] : 0;
+        for (int i = 0; i < 3; i++) v[i] *= scale;
+    }
+}
+
+static void ConvertRowScalar(uint8_t *dest, NativePixelFormat destFormat, const uint8_t *src, NativePixelFormat srcFormat, uint32_t width, AlphaOp alpha)
+{
+    uint32_t srcSize = GetPixelSize(srcFormat);
+    uint32_t destSize = GetPixelSize(destFormat);
+
+    for (uint32_t x = 0; x < width; x++)
+    {
+        float v[4];
+        LoadPixel(srcFormat, src, v);
+        ApplyAlpha(v, alpha);
+        StorePixel(destFormat, dest, v);
+        src += srcSize;
+        dest += destSize;
+    }
+}
+
+// SSE loaders and storers, one pixel as float4 each; Load4 and Store4 move four pixels with full
+// width memory accesses
+
+struct LoadUN8
+{
+    static const uint32_t Size = 4;
+    static __m128 Load(const uint8_t *p)
+    {
+        int32_t bits;
+        memcpy(&bits, p, 4);
+        __m128i i = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(bits));
+        return _mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(1.0f / 255));
+    }
+    static void Load4(const uint8_t *p, __m128 v[4])
+    {
+        __m128i i = _mm_loadu_si128((const __m128i *)p);
+        __m128 scale = _mm_set1_ps(1.0f / 255);
+        v[0] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(i)), scale);
+        v[1] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(i, 4))), scale);
+        v[2] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(i, 8))), scale);
+        v[3] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_srli_si128(i, 12))), scale);
+    }
+};
+
+struct LoadUN16
+{
+    static const uint32_t Size = 8;
+    static __m128 Load(const uint8_t *p)
+    {
+        __m128i i = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)p));
+        return _mm_mul_ps(_mm_cvtepi32_ps(i), _mm_set1_ps(1.0f / 65535));
+    }
+    static void Load4(const uint8_t *p, __m128 v[4])
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *)p);
+        __m128i hi = _mm_loadu_si128((const __m128i *)(p + 16));
+        __m128 scale = _mm_set1_ps(1.0f / 65535);
+        v[0] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(lo)), scale);
+        v[1] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(lo, 8))), scale);
+        v[2] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(hi)), scale);
+        v[3] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_cvtepu16_epi32(_mm_srli_si128(hi, 8))), scale);
+    }
+};
+
+struct LoadF16
+{
+    static const uint32_t Size = 8;
+    static __m128 Load(const uint8_t *p)
+    {
+        return _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)p));
+    }
+    static void Load4(const uint8_t *p, __m128 v[4])
+    {
+        __m128i lo = _mm_loadu_si128((const __m128i *)p);
+        __m128i hi = _mm_loadu_si128((const __m128i *)(p + 16));
+        v[0] = _mm_cvtph_ps(lo);
+        v[1] = _mm_cvtph_ps(_mm_srli_si128(lo, 8));
+        v[2] = _mm_cvtph_ps(hi);
+        v[3] = _mm_cvtph_ps(_mm_srli_si128(hi, 8));
+    }
+};
+
+struct LoadF32
+{
+    static const uint32_t Size = 16;
+    static __m128 Load(const uint8_t *p)
+    {
+        return _mm_loadu_ps((const float *)p);
+    }
+    static void Load4(const uint8_t *p, __m128 v[4])
+    {
+        for (int i = 0; i < 4; i++)
+            v[i] = _mm_loadu_ps((const float *)p + 4 * i);
+    }
+};
+
+static __m128i ToUnorm(__m128 v, float scale)
+{
+    v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1));
+    return _mm_cvtps_epi32(_mm_mul_ps(v, _mm_set1_ps(scale)));
+}
+
+struct StoreUN8
+{
+    static const uint32_t Size = 4;
+    static void Store(uint8_t *p, __m128 v)
+    {
+        __m128i i = ToUnorm(v, 255);
+        i = _mm_packus_epi16(_mm_packus_epi32(i, i), i);
+        int32_t bits = _mm_cvtsi128_si32(i);
+        memcpy(p, &bits, 4);
+    }
+    static void Store4(uint8_t *p, const __m128 v[4])
+    {
+        __m128i lo = _mm_packus_epi32(ToUnorm(v[0], 255), ToUnorm(v[1], 255));
+        __m128i hi = _mm_packus_epi32(ToUnorm(v[2], 255), ToUnorm(v[3], 255));
+        _mm_storeu_si128((__m128i *)p, _mm_packus_epi16(lo, hi));
+    }
+};
+
+struct StoreBGRA8
+{
+    static const uint32_t Size = 4;
+    static void Store(uint8_t *p, __m128 v)
+    {
+        StoreUN8::Store(p, _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 0, 1, 2)));
+    }
+    static void Store4(uint8_t *p, const __m128 v[4])
+    {
+        __m128 bgra[4];
+        for (int i = 0; i < 4; i++)
+            bgra[i] = _mm_shuffle_ps(v[i], v[i], _MM_SHUFFLE(3, 0, 1, 2));
+        StoreUN8::Store4(p, bgra);
+    }
+};
+
+struct StoreUN16
+{
+    static const uint32_t Size = 8;
+    static void Store(uint8_t *p, __m128 v)
+    {
+        __m128i i = ToUnorm(v, 65535);
+        _mm_storel_epi64((__m128i *)p, _mm_packus_epi32(i, i));
+    }
+    static void Store4(uint8_t *p, const __m128 v[4])
+    {
+        _mm_storeu_si128((__m128i *)p, _mm_packus_epi32(ToUnorm(v[0], 65535), ToUnorm(v[1], 65535)));
+        _mm_storeu_si128((__m128i *)(p + 16), _mm_packus_epi32(ToUnorm(v[2], 65535), ToUnorm(v[3], 65535)));
+    }
+};
+
+struct StoreF16
+{
+    static const uint32_t Size = 8;
+    static void Store(uint8_t *p, __m128 v)
+    {
+        _mm_storel_epi64((__m128i *)p, _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+    static void Store4(uint8_t *p, const __m128 v[4])
+    {
+        __m128i h[4];
+        for (int i = 0; i < 4; i++)
+            h[i] = _mm_cvtps_ph(v[i], _MM_FROUND_TO_NEAREST_INT);
+        _mm_storeu_si128((__m128i *)p, _mm_unpacklo_epi64(h[0], h[1]));
+        _mm_storeu_si128((__m128i *)(p + 16), _mm_unpacklo_epi64(h[2], h[3]));
+    }
+};
+
+struct StoreF32
+{
+    static const uint32_t Size = 16;
+    static void Store(uint8_t *p, __m128 v)
+    {
+        _mm_storeu_ps((float *)p, v);
+    }
+    static void Store4(uint8_t *p, const __m128 v[4])
+    {
+        for (int i = 0; i < 4; i++)
+            _mm_storeu_ps((float *)p + 4 * i, v[i]);
+    }
+};
+
+static __m128 PremultiplySse(__m128 v)
+{
+    __m128 a = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+    return _mm_blend_ps(_mm_mul_ps(v, a), v, 8);
+}
+
+static __m128 UnpremultiplySse(__m128 v)
+{
+    __m128 a = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3, 3, 3, 3));
+    __m128 scaled = _mm_and_ps(_mm_div_ps(v, a), _mm_cmpgt_ps(a, _mm_setzero_ps()));
+    return _mm_blend_ps(scaled, v, 8);
+}
+
+template <AlphaOp A>
+static __m128 ApplyAlphaSse(__m128 v)
+{
+    if (A == AlphaOp::Premultiply)
+        return PremultiplySse(v);
+    if (A == AlphaOp::Unpremultiply)
+        return UnpremultiplySse(v);
+    return v;
+}
+
+template <class L, class S, AlphaOp A>
+static void ConvertRowSse(uint8_t *dest, const uint8_t *src, uint32_t width)
+{
+    uint32_t x = 0;
+
+    for (; x + 4 <= width; x += 4)
+    {
+        __m128 v[4];
+        L::Load4(src, v);
+        for (int i = 0; i < 4; i++)
+            v[i] = ApplyAlphaSse<A>(v[i]);
+        S::Store4(dest, v);
+        src += 4 * L::Size;
+        dest += 4 * S::Size;
+    }
+
+    for (; x < width; x++)
+    {
+        S::Store(dest, ApplyAlphaSse<A>(L::Load(src)));
+        src += L::Size;
+        dest += S::Size;
+    }
+}
+
+typedef void (*RowFunc)(uint8_t *dest, const uint8_t *src, uint32_t width);
+
+template <class L, class S>
+static RowFunc SelectRow(AlphaOp alpha)
+{
+    switch (alpha)
+    {
+    case AlphaOp::Premultiply: return ConvertRowSse<L, S, AlphaOp::Premultiply>;
+    case AlphaOp::Unpremultiply: return ConvertRowSse<L, S, AlphaOp::Unpremultiply>;
+    default: return ConvertRowSse<L, S, AlphaOp::None>;
+    }
+}
+
+template <class L>
+static RowFunc SelectRow(NativePixelFormat to, AlphaOp alpha)
+{
+    switch (to)
+    {
+    case NativePixelFormat::RGBA_UN8: return SelectRow<L, StoreUN8>(alpha);
+    case NativePixelFormat::BGRA_UN8: return SelectRow<L, StoreBGRA8>(alpha);
+    case NativePixelFormat::RGBA_UN16: return SelectRow<L, StoreUN16>(alpha);
+    case NativePixelFormat::RGBA_F16: return SelectRow<L, StoreF16>(alpha);
+    case NativePixelFormat::RGBA_F32: return SelectRow<L, StoreF32>(alpha);
+    default: return nullptr;
+    }
+}
+
+static RowFunc SelectRow(NativePixelFormat from, NativePixelFormat to, AlphaOp alpha)
+{
+    switch (from)
+    {
+    case NativePixelFormat::RGBA_UN8: return SelectRow<LoadUN8>(to, alpha);
+    case NativePixelFormat::RGBA_UN16: return SelectRow<LoadUN16>(to, alpha);
+    case NativePixelFormat::RGBA_F16: return SelectRow<LoadF16>(to, alpha);
+    case NativePixelFormat::RGBA_F32: return SelectRow<LoadF32>(to, alpha);
+    default: return nullptr;
+    }
+}
+
+static bool HasSse41F16C()
+{
+    static const bool supported = []
+    {
+        int regs[4];
+        __cpuid(regs, 1);
+        if (!(regs[2] & (1 << 19)) || !(regs[2] & (1 << 29)))
+            return false;
+
+        // F16C is VEX encoded, so the OS has to save the YMM state as well
+        if (!(regs[2] & (1 << 27)))
+            return false;
+        return (_xgetbv(0) & 6) == 6;
+    }();
+    return supported;
+}
+
+static bool IsRgbaOutput(NativePixelFormat format)
+{
+    switch (format)
+    {
+    case NativePixelFormat::RGBA_UN8:
+    case NativePixelFormat::BGRA_UN8:
+    case NativePixelFormat::RGBA_UN16:
+    case NativePixelFormat::RGBA_F16:
+    case NativePixelFormat::RGBA_F32:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool CanConvert(NativePixelFormat from, NativePixelFormat to)
+{
+    return GetPixelSize(from) && (from == to || IsRgbaOutput(to));
+}
+
+bool CanConvertColor(NativePixelFormat to)
+{
+    return IsRgbaOutput(to);
+}
+
+static void ConvertColorRows(uint8_t *dest, size_t destStride, NativePixelFormat destFormat,
+    const uint8_t *src, size_t srcStride, NativePixelFormat srcFormat,
+    uint32_t width, uint32_t rows, const ColorTransform &color);
+
+void ConvertRows(uint8_t *dest, size_t destStride, NativePixelFormat destFormat,
+    const uint8_t *src, size_t srcStride, NativePixelFormat srcFormat,
+    uint32_t width, uint32_t rows, AlphaOp alpha, const ColorTransform *color)
+{
+    if (color)
+    {
+        ConvertColorRows(dest, destStride, destFormat, src, srcStride, srcFormat, width, rows, *color);
+        return;
+    }
+
+    if (srcFormat == destFormat && alpha == AlphaOp::None)
+    {
+        CopyRows(dest, destStride, src, srcStride, (size_t)width * GetPixelSize(srcFormat), rows);
+        return;
+    }
+
+    RowFunc row = HasSse41F16C() ? SelectRow(srcFormat, destFormat, alpha) : nullptr;
+
+    for (uint32_t y = 0; y < rows; y++)
+    {
+        if (row)
+            row(dest, src, width);
+        else
+            ConvertRowScalar(dest, destFormat, src, srcFormat, width, alpha);
+
+        dest += destStride;
+        src += srcStride;
+    }
+}
+
+// PQ and HLG go through tables indexed by the half float bits, built on first use
+
+static const float ReferenceWhite = 203;
+
+static double PqToNits(double e)
+{
+    const double m1 = 2610.0 / 16384, m2 = 2523.0 / 4096 * 128;
+    const double c1 = 3424.0 / 4096, c2 = 2413.0 / 4096 * 32, c3 = 2392.0 / 4096 * 32;
+
+    double p = pow(e, 1 / m2);
+    double num = p - c1 > 0 ? p - c1 : 0;
+    return 10000 * pow(num / (c2 - c3 * p), 1 / m1);
+}
+
+static double HlgToScene(double e)
+{
+    const double a = 0.17883277, b = 0.28466892, c = 0.55991073;
+    return e <= 0.5 ? e * e / 3 : (exp((e - c) / a) + b) / 12;
+}
+
+static const uint16_t *GetTransferTable(int transferCharacteristics)
+{
+    static uint16_t pq[65536], hlg[65536];
+    static std::once_flag pqOnce, hlgOnce;
+
+    auto build = [](uint16_t *table, double (*func)(double), double scale)
+    {
+        for (uint32_t h = 0; h < 65536; h++)
+        {
+            float e = Saturate(HalfToFloat((uint16_t)h));
+            table[h] = FloatToHalf((float)(func(e) * scale));
+        }
+    };
+
+    switch (transferCharacteristics)
+    {
+    case 16:
+        std::call_once(pqOnce, build, pq, PqToNits, 1.0 / ReferenceWhite);
+        return pq;
+    case 18:
+        std::call_once(hlgOnce, build, hlg, HlgToScene, 1.0);
+        return hlg;
+    default:
+        return nullptr;
+    }
+}
+
+bool LinearizeRows(uint8_t *rows, size_t stride, uint32_t width, uint32_t count, int transferCharacteristics)
+{
+    const uint16_t *table = GetTransferTable(transferCharacteristics);
+    if (!table)
+        return false;
+
+    for (uint32_t y = 0; y < count; y++, rows += stride)
+    {
+        auto p = (uint16_t *)rows;
+        for (uint32_t x = 0; x < width; x++, p += 4)
+        {
+            p[0] = table[p[0]];
+            p[1] = table[p[1]];
+            p[2] = table[p[2]];
+
+            if (transferCharacteristics == 18)
+            {
+                // HLG OOTF for a 1000 cd/m2 display: gamma 1.2 on the BT.2020 luminance
+                float r = HalfToFloat(p[0]), g = HalfToFloat(p[1]), b = HalfToFloat(p[2]);
+                float lum = 0.2627f * r + 0.6780f * g + 0.0593f * b;
+                float scale = lum > 0 ? 1000 / ReferenceWhite * powf(lum, 0.2f) : 0;
+                p[0] = FloatToHalf(r * scale);
+                p[1] = FloatToHalf(g * scale);
+                p[2] = FloatToHalf(b * scale);
+            }
+        }
+    }
+
+    return true;
+}
+
+
+// Color space conversion: decode to linear light, a 3x3 matrix, encode. The SSE path evaluates the curves
+// with the cephes polynomials for exp and log, which are within a few ulps of the C library
+
+struct Chromaticities
+{
+    double rx, ry, gx, gy, bx, by, wx, wy;
+};
+
+static const Chromaticities Rec709Primaries = { 0.64, 0.33, 0.30, 0.60, 0.15, 0.06, 0.3127, 0.3290 };
+static const Chromaticities Rec2020Primaries = { 0.708, 0.292, 0.170, 0.797, 0.131, 0.046, 0.3127, 0.3290 };
+static const Chromaticities P3D65Primaries = { 0.680, 0.320, 0.265, 0.690, 0.150, 0.060, 0.3127, 0.3290 };
+static const Chromaticities P3DciPrimaries = { 0.680, 0.320, 0.265, 0.690, 0.150, 0.060, 0.314, 0.351 };
+static const Chromaticities AP1Primaries = { 0.713, 0.293, 0.165, 0.830, 0.128, 0.044, 0.32168, 0.33767 };
+
+static const float PqM1 = 2610.0f / 16384, PqM2 = 2523.0f / 4096 * 128;
+static const float PqC1 = 3424.0f / 4096, PqC2 = 2413.0f / 4096 * 32, PqC3 = 2392.0f / 4096 * 32;
+static const float HlgA = 0.17883277f, HlgB = 0.28466892f, HlgC = 0.55991073f;
+
+// display peak of the HLG OOTF, in linear units
+static const float HlgPeak = 1000 / ReferenceWhite;
+
+static void Multiply(const double a[3][3], const double b[3][3], double out[3][3])
+{
+    for (int i = 0; i < 3; i++)
+        for (int j = 0; j < 3; j++)
+            out[i][j] = a[i][0] * b[0][j] + a[i][1] * b[1][j] + a[i][2] * b[2][j];
+}
+
+static void Invert(const double m[3][3], double out[3][3])
+{
+    double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    double det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+
+    out[0][0] = c00 / det;
+    out[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) / det;
+    out[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) / det;
+    out[1][0] = c01 / det;
+    out[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) / det;
+    out[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) / det;
+    out[2][0] = c02 / det;
+    out[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) / det;
+    out[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) / det;
+}
+
+static void GetWhiteXyz(const Chromaticities &c, double xyz[3])
+{
+    xyz[0] = c.wx / c.wy;
+    xyz[1] = 1;
+    xyz[2] = (1 - c.wx - c.wy) / c.wy;
+}
+
+static void GetRgbToXyz(const Chromaticities &c, double out[3][3])
+{
+    double p[3][3] =
+    {
+        { c.rx / c.ry, c.gx / c.gy, c.bx / c.by },
+        { 1, 1, 1 },
+        { (1 - c.rx - c.ry) / c.ry, (1 - c.gx - c.gy) / c.gy, (1 - c.bx - c.by) / c.by },
+    };
+
+    // scale the primaries so that RGB 1, 1, 1 is the white point
+    double inv[3][3], white[3];
+    Invert(p, inv);
+    GetWhiteXyz(c, white);
+    for (int j = 0; j < 3; j++)
+    {
+        double s = inv[j][0] * white[0] + inv[j][1] * white[1] + inv[j][2] * white[2];
+        for (int i = 0; i < 3; i++)
+            out[i][j] = p[i][j] * s;
+    }
+}
+
+// Bradford adaptation of XYZ from one white point to another
+static void GetAdaptation(const Chromaticities &from, const Chromaticities &to, double out[3][3])
+{
+    static const double bradford[3][3] =
+    {
+        { 0.8951, 0.2664, -0.1614 },
+        { -0.7502, 1.7135, 0.0367 },
+        { 0.0389, -0.0685, 1.0296 },
+    };
+
+    double fromWhite[3], toWhite[3];
+    GetWhiteXyz(from, fromWhite);
+    GetWhiteXyz(to, toWhite);
+
+    double scale[3][3] = {};
+    for (int i = 0; i < 3; i++)
+    {
+        double f = bradford[i][0] * fromWhite[0] + bradford[i][1] * fromWhite[1] + bradford[i][2] * fromWhite[2];
+        double t = bradford[i][0] * toWhite[0] + bradford[i][1] * toWhite[1] + bradford[i][2] * toWhite[2];
+        scale[i][i] = t / f;
+    }
+
+    double inv[3][3], tmp[3][3];
+    Invert(bradford, inv);
+    Multiply(scale, bradford, tmp);
+    Multiply(inv, tmp, out);
+}
+
+static Chromaticities GetImagePrimaries(const NativeImageInfo &info)
+{
+    if (info.cRy > 0 && info.cGy > 0 && info.cBy > 0 && info.cWy > 0)
+        return { info.cRx, info.cRy, info.cGx, info.cGy, info.cBx, info.cBy, info.cWx, info.cWy };
+
+    switch (info.colorPrimaries)
+    {
+    case 9: return Rec2020Primaries;
+    case 11: return P3DciPrimaries;
+    case 12: return P3D65Primaries;
+    default: return Rec709Primaries;
+    }
+}
+
+static TransferFunction GetImageTransfer(int transferCharacteristics, float &gamma)
+{
+    gamma = 2.4f;
+    switch (transferCharacteristics)
+    {
+    case 8: return TransferFunction::Linear;
+    case 16: return TransferFunction::PQ;
+    case 18: return TransferFunction::HLG;
+    case 1:
+    case 6:
+    case 14:
+    case 15:
+        return TransferFunction::Bt1886;
+    case 4:
+        gamma = 2.2f;
+        return TransferFunction::Bt1886;
+    case 5:
+        gamma = 2.8f;
+        return TransferFunction::Bt1886;
+    default:
+        return TransferFunction::Srgb;
+    }
+}
+
+bool CreateColorTransform(const NativeImageInfo &info, ColorPrimaries primaries, TransferFunction transfer, ColorTransform &transform)
+{
+    transform = {};
+    transform.from = GetImageTransfer(info.transferCharacteristics, transform.fromGamma);
+    transform.to = transfer == TransferFunction::Source ? transform.from : transfer;
+    transform.toGamma = transfer == TransferFunction::Source ? transform.fromGamma : 2.4f;
+
+    Chromaticities from = GetImagePrimaries(info);
+    Chromaticities to = from;
+    switch (primaries)
+    {
+    case ColorPrimaries::Rec709: to = Rec709Primaries; break;
+    case ColorPrimaries::Rec2020: to = Rec2020Primaries; break;
+    case ColorPrimaries::DisplayP3: to = P3D65Primaries; break;
+    case ColorPrimaries::ACEScg: to = AP1Primaries; break;
+    default: break;
+    }
+
+    // source RGB -> XYZ -> adapted to the destination's white -> destination RGB
+    double toXyz[3][3], fromXyz[3][3], adapt[3][3], tmp[3][3], tmp2[3][3], m[3][3];
+    GetRgbToXyz(from, toXyz);
+    GetRgbToXyz(to, tmp);
+    Invert(tmp, fromXyz);
+    GetAdaptation(from, to, adapt);
+    Multiply(adapt, toXyz, tmp2);
+    Multiply(fromXyz, tmp2, m);
+
+    bool identity = transform.from == transform.to && transform.fromGamma == transform.toGamma;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            transform.matrix[i * 3 + j] = (float)m[i][j];
+            if (fabs(m[i][j] - (i == j)) > 1e-6)
+                identity = false;
+        }
+    }
+
+    return !identity;
+}
+
+// scalar curves, on R, G and B
+
+static void ToLinear(const ColorTransform &c, float v[4])
+{
+    switch (c.from)
+    {
+    case TransferFunction::Srgb:
+        for (int i = 0; i < 3; i++)
+            v[i] = v[i] <= 0.04045f ? v[i] / 12.92f : powf((v[i] + 0.055f) / 1.055f, 2.4f);
+        break;
+    case TransferFunction::Bt1886:
+        for (int i = 0; i < 3; i++)
+            v[i] = v[i] > 0 ? powf(v[i], c.fromGamma) : 0;
+        break;
+    case TransferFunction::PQ:
+        for (int i = 0; i < 3; i++)
+            v[i] = (float)(PqToNits(Saturate(v[i])) / ReferenceWhite);
+        break;
+    case TransferFunction::HLG:
+    {
+        for (int i = 0; i < 3; i++)
+            v[i] = (float)HlgToScene(Saturate(v[i]));
+        float lum = 0.2627f * v[0] + 0.6780f * v[1] + 0.0593f * v[2];
+        float scale = lum > 0 ? HlgPeak * powf(lum, 0.2f) : 0;
+        for (int i = 0; i < 3; i++)
+            v[i] *= scale;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void FromLinear(const ColorTransform &c, float v[4])
+{
+    switch (c.to)
+    {
+    case TransferFunction::Srgb:
+        for (int i = 0; i < 3; i++)
+            v[i] = v[i] <= 0.0031308f ? v[i] * 12.92f : 1.055f * powf(v[i], 1 / 2.4f) - 0.055f;
+        break;
+    case TransferFunction::Bt1886:
+        for (int i = 0; i < 3; i++)
+            v[i] = v[i] > 0 ? powf(v[i], 1 / c.toGamma) : 0;
+        break;
+    case TransferFunction::PQ:
+        for (int i = 0; i < 3; i++)
+        {
+            float y = powf(v[i] > 0 ? v[i] * (ReferenceWhite / 10000) : 0, PqM1);
+            v[i] = powf((PqC1 + PqC2 * y) / (1 + PqC3 * y), PqM2);
+        }
+        break;
+    case TransferFunction::HLG:
+    {
+        // inverse OOTF back to scene light, then the OETF
+        for (int i = 0; i < 3; i++)
+            v[i] = v[i] > 0 ? v[i] / HlgPeak : 0;
+        float lum = 0.2627f * v[0] + 0.6780f * v[1] + 0.0593f * v[2];
+        float scale = lum > 0 ? powf(lum, -0.2f / 1.2f) : 0;
+        for (int i = 0; i < 3; i++)
+        {
+            float e = v[i] * scale;
+            v[i] = e <= 1.0f / 12 ? sqrtf(3 * e) : HlgA * logf(12 * e - HlgB) + HlgC;
+        }
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+static void ApplyColor(const ColorTransform &c, float v[4])
+{
+    if (c.unpremultiply)
+        ApplyAlpha(v, AlphaOp::Unpremultiply);
+
+    ToLinear(c, v);
+    const float *m = c.matrix;
+    float r = v[0], g = v[1], b = v[2];
+    v[0] = m[0] * r + m[1] * g + m[2] * b;
+    v[1] = m[3] * r + m[4] * g + m[5] * b;
+    v[2] = m[6] * r + m[7] * g + m[8] * b;
+    FromLinear(c, v);
+
+    if (c.premultiply)
+        ApplyAlpha(v, AlphaOp::Premultiply);
+}
+
+// SSE curves, alpha gets restored by the caller
+
+static __m128 LogSse(__m128 x)
+{
+    // x = m * 2^e with m in [sqrt(0.5), sqrt(2)); zero and negative values end up at the smallest normal
+    x = _mm_max_ps(x, _mm_set1_ps(1.17549435e-38f));
+    __m128i bits = _mm_castps_si128(x);
+    __m128 e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(bits, 23), _mm_set1_epi32(126)));
+    __m128 m = _mm_or_ps(_mm_and_ps(x, _mm_castsi128_ps(_mm_set1_epi32(0x007fffff))), _mm_set1_ps(0.5f));
+
+    __m128 small = _mm_cmplt_ps(m, _mm_set1_ps(0.707106781186547524f));
+    e = _mm_sub_ps(e, _mm_and_ps(_mm_set1_ps(1), small));
+    m = _mm_add_ps(_mm_sub_ps(m, _mm_set1_ps(1)), _mm_and_ps(m, small));
+
+    __m128 z = _mm_mul_ps(m, m);
+    __m128 y = _mm_set1_ps(7.0376836292e-2f);
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(-1.1514610310e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(1.1676998740e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(-1.2420140846e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(1.4249322787e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(-1.6668057665e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(2.0000714765e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(-2.4999993993e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, m), _mm_set1_ps(3.3333331174e-1f));
+    y = _mm_mul_ps(_mm_mul_ps(y, m), z);
+
+    y = _mm_add_ps(y, _mm_mul_ps(e, _mm_set1_ps(-2.12194440e-4f)));
+    y = _mm_sub_ps(y, _mm_mul_ps(z, _mm_set1_ps(0.5f)));
+    return _mm_add_ps(_mm_add_ps(m, y), _mm_mul_ps(e, _mm_set1_ps(0.693359375f)));
+}
+
+static __m128 ExpSse(__m128 x)
+{
+    x = _mm_min_ps(_mm_max_ps(x, _mm_set1_ps(-87.3f)), _mm_set1_ps(88.3f));
+
+    // x = n * ln 2 + r
+    __m128 n = _mm_floor_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+    x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+
+    __m128 y = _mm_set1_ps(1.9875691500e-4f);
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+    y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+    y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), x), _mm_set1_ps(1));
+
+    __m128i pow2n = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+    return _mm_mul_ps(y, _mm_castsi128_ps(pow2n));
+}
+
+// x^y, 0 for x <= 0
+static __m128 PowSse(__m128 x, float y)
+{
+    __m128 r = ExpSse(_mm_mul_ps(LogSse(x), _mm_set1_ps(y)));
+    return _mm_and_ps(r, _mm_cmpgt_ps(x, _mm_setzero_ps()));
+}
+
+static __m128 HlgLuminanceSse(__m128 v)
+{
+    return _mm_dp_ps(v, _mm_setr_ps(0.2627f, 0.6780f, 0.0593f, 0), 0x7f);
+}
+
+static __m128 ToLinearSse(const ColorTransform &c, __m128 v)
+{
+    switch (c.from)
+    {
+    case TransferFunction::Srgb:
+    {
+        __m128 low = _mm_mul_ps(v, _mm_set1_ps(1 / 12.92f));
+        __m128 high = PowSse(_mm_mul_ps(_mm_add_ps(v, _mm_set1_ps(0.055f)), _mm_set1_ps(1 / 1.055f)), 2.4f);
+        return _mm_blendv_ps(low, high, _mm_cmpgt_ps(v, _mm_set1_ps(0.04045f)));
+    }
+    case TransferFunction::Bt1886:
+        return PowSse(v, c.fromGamma);
+    case TransferFunction::PQ:
+    {
+        __m128 p = PowSse(_mm_min_ps(v, _mm_set1_ps(1)), 1 / PqM2);
+        __m128 num = _mm_max_ps(_mm_sub_ps(p, _mm_set1_ps(PqC1)), _mm_setzero_ps());
+        __m128 den = _mm_sub_ps(_mm_set1_ps(PqC2), _mm_mul_ps(_mm_set1_ps(PqC3), p));
+        return _mm_mul_ps(PowSse(_mm_div_ps(num, den), 1 / PqM1), _mm_set1_ps(10000 / ReferenceWhite));
+    }
+    case TransferFunction::HLG:
+    {
+        v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1));
+        __m128 low = _mm_mul_ps(_mm_mul_ps(v, v), _mm_set1_ps(1.0f / 3));
+        __m128 high = ExpSse(_mm_mul_ps(_mm_sub_ps(v, _mm_set1_ps(HlgC)), _mm_set1_ps(1 / HlgA)));
+        high = _mm_mul_ps(_mm_add_ps(high, _mm_set1_ps(HlgB)), _mm_set1_ps(1.0f / 12));
+        __m128 e = _mm_blendv_ps(low, high, _mm_cmpgt_ps(v, _mm_set1_ps(0.5f)));
+        return _mm_mul_ps(e, _mm_mul_ps(PowSse(HlgLuminanceSse(e), 0.2f), _mm_set1_ps(HlgPeak)));
+    }
+    default:
+        return v;
+    }
+}
+
+static __m128 FromLinearSse(const ColorTransform &c, __m128 v)
+{
+    switch (c.to)
+    {
+    case TransferFunction::Srgb:
+    {
+        __m128 low = _mm_mul_ps(v, _mm_set1_ps(12.92f));
+        __m128 high = _mm_sub_ps(_mm_mul_ps(PowSse(v, 1 / 2.4f), _mm_set1_ps(1.055f)), _mm_set1_ps(0.055f));
+        return _mm_blendv_ps(low, high, _mm_cmpgt_ps(v, _mm_set1_ps(0.0031308f)));
+    }
+    case TransferFunction::Bt1886:
+        return PowSse(v, 1 / c.toGamma);
+    case TransferFunction::PQ:
+    {
+        __m128 y = PowSse(_mm_mul_ps(v, _mm_set1_ps(ReferenceWhite / 10000)), PqM1);
+        __m128 num = _mm_add_ps(_mm_set1_ps(PqC1), _mm_mul_ps(_mm_set1_ps(PqC2), y));
+        __m128 den = _mm_add_ps(_mm_set1_ps(1), _mm_mul_ps(_mm_set1_ps(PqC3), y));
+        return PowSse(_mm_div_ps(num, den), PqM2);
+    }
+    case TransferFunction::HLG:
+    {
+        v = _mm_mul_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(1 / HlgPeak));
+        __m128 e = _mm_mul_ps(v, PowSse(HlgLuminanceSse(v), -0.2f / 1.2f));
+        __m128 low = _mm_sqrt_ps(_mm_mul_ps(e, _mm_set1_ps(3)));
+        __m128 high = LogSse(_mm_sub_ps(_mm_mul_ps(e, _mm_set1_ps(12)), _mm_set1_ps(HlgB)));
+        high = _mm_add_ps(_mm_mul_ps(high, _mm_set1_ps(HlgA)), _mm_set1_ps(HlgC));
+        return _mm_blendv_ps(low, high, _mm_cmpgt_ps(e, _mm_set1_ps(1.0f / 12)));
+    }
+    default:
+        return v;
+    }
+}
+
+template <class L, class S>
+static void ConvertColorRowSse(uint8_t *dest, const uint8_t *src, uint32_t width, const ColorTransform &c)
+{
+    const float *m = c.matrix;
+    __m128 r = _mm_setr_ps(m[0], m[3], m[6], 0);
+    __m128 g = _mm_setr_ps(m[1], m[4], m[7], 0);
+    __m128 b = _mm_setr_ps(m[2], m[5], m[8], 0);
+
+    for (uint32_t x = 0; x < width; x++)
+    {
+        __m128 v = L::Load(src);
+        if (c.unpremultiply)
+            v = UnpremultiplySse(v);
+
+        __m128 lin = ToLinearSse(c, v);
+        __m128 out = _mm_mul_ps(r, _mm_shuffle_ps(lin, lin, _MM_SHUFFLE(0, 0, 0, 0)));
+        out = _mm_add_ps(out, _mm_mul_ps(g, _mm_shuffle_ps(lin, lin, _MM_SHUFFLE(1, 1, 1, 1))));
+        out = _mm_add_ps(out, _mm_mul_ps(b, _mm_shuffle_ps(lin, lin, _MM_SHUFFLE(2, 2, 2, 2))));
+        v = _mm_blend_ps(FromLinearSse(c, out), v, 8);
+
+        if (c.premultiply)
+            v = PremultiplySse(v);
+
+        S::Store(dest, v);
+        src += L::Size;
+        dest += S::Size;
+    }
+}
+
+// the color path also takes the EXR layouts: single channels are gray, and all of them are opaque
+struct LoadGrayF16
+{
+    static const uint32_t Size = 2;
+    static __m128 Load(const uint8_t *p)
+    {
+        uint16_t bits;
+        memcpy(&bits, p, 2);
+        __m128 v = _mm_cvtph_ps(_mm_cvtsi32_si128(bits));
+        return _mm_blend_ps(_mm_shuffle_ps(v, v, 0), _mm_set1_ps(1), 8);
+    }
+};
+
+struct LoadGrayF32
+{
+    static const uint32_t Size = 4;
+    static __m128 Load(const uint8_t *p)
+    {
+        __m128 v = _mm_load_ss((const float *)p);
+        return _mm_blend_ps(_mm_shuffle_ps(v, v, 0), _mm_set1_ps(1), 8);
+    }
+};
+
+struct LoadRgbF16
+{
+    static const uint32_t Size = 6;
+    static __m128 Load(const uint8_t *p)
+    {
+        uint16_t bits[4] = { 0, 0, 0, 0x3c00 };
+        memcpy(bits, p, 6);
+        return _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)bits));
+    }
+};
+
+struct LoadRgbF32
+{
+    static const uint32_t Size = 12;
+    static __m128 Load(const uint8_t *p)
+    {
+        float v[4] = { 0, 0, 0, 1 };
+        memcpy(v, p, 12);
+        return _mm_loadu_ps(v);
+    }
+};
+
+typedef void (*ColorRowFunc)(uint8_t *dest, const uint8_t *src, uint32_t width, const ColorTransform &color);
+
+template <class L>
+static ColorRowFunc SelectColorRow(NativePixelFormat to)
+{
+    switch (to)
+    {
+    case NativePixelFormat::RGBA_UN8: return ConvertColorRowSse<L, StoreUN8>;
+    case NativePixelFormat::BGRA_UN8: return ConvertColorRowSse<L, StoreBGRA8>;
+    case NativePixelFormat::RGBA_UN16: return ConvertColorRowSse<L, StoreUN16>;
+    case NativePixelFormat::RGBA_F16: return ConvertColorRowSse<L, StoreF16>;
+    case NativePixelFormat::RGBA_F32: return ConvertColorRowSse<L, StoreF32>;
+    default: return nullptr;
+    }
+}
+
+static ColorRowFunc SelectColorRow(NativePixelFormat from, NativePixelFormat to)
+{
+    switch (from)
+    {
+    case NativePixelFormat::RGBA_UN8: return SelectColorRow<LoadUN8>(to);
+    case NativePixelFormat::RGBA_UN16: return SelectColorRow<LoadUN16>(to);
+    case NativePixelFormat::RGBA_F16: return SelectColorRow<LoadF16>(to);
+    case NativePixelFormat::RGBA_F32: return SelectColorRow<LoadF32>(to);
+    case NativePixelFormat::R_F16: return SelectColorRow<LoadGrayF16>(to);
+    case NativePixelFormat::R_F32: return SelectColorRow<LoadGrayF32>(to);
+    case NativePixelFormat::RGB_F16: return SelectColorRow<LoadRgbF16>(to);
+    case NativePixelFormat::RGB_F32: return SelectColorRow<LoadRgbF32>(to);
+    default: return nullptr;
+    }
+}
+
+static void ConvertColorRows(uint8_t *dest, size_t destStride, NativePixelFormat destFormat,
+    const uint8_t *src, size_t srcStride, NativePixelFormat srcFormat,
+    uint32_t width, uint32_t rows, const ColorTransform &color)
+{
+    ColorRowFunc row = HasSse41F16C() ? SelectColorRow(srcFormat, destFormat) : nullptr;
+    uint32_t srcSize = GetPixelSize(srcFormat);
+    uint32_t destSize = GetPixelSize(destFormat);
+
+    // single channel images are gray, not red, as far as the primaries are concerned
+    bool gray = srcFormat == NativePixelFormat::R_F16 || srcFormat == NativePixelFormat::R_F32;
+
+    for (uint32_t y = 0; y < rows; y++)
+    {
+        if (row)
+            row(dest, src, width, color);
+        else
+        {
+            for (uint32_t x = 0; x < width; x++)
+            {
+                float v[4];
+                LoadPixel(srcFormat, src + x * srcSize, v);
+                if (gray)
+                    v[1] = v[2] = v[0];
+                ApplyColor(color, v);
+                StorePixel(destFormat, dest + x * destSize, v);
+            }
+        }
+
+        dest += destStride;
+        src += srcStride;
+    }
+}
+
+
+ChromaSubsampling GetSubsampling(NativePixelFormat format)
+{
+    switch (format)
+    {
+    case NativePixelFormat::YUV420_P8:
+    case NativePixelFormat::YUV420_P16:
+    case NativePixelFormat::YUV420_SP8:
+    case NativePixelFormat::YUV420_SP16:
+        return ChromaSubsampling::Yuv420;
+    case NativePixelFormat::YUV422_P8:
+    case NativePixelFormat::YUV422_P16:
+    case NativePixelFormat::YUV422_SP8:
+    case NativePixelFormat::YUV422_SP16:
+        return ChromaSubsampling::Yuv422;
+    case NativePixelFormat::YUV444_P8:
+    case NativePixelFormat::YUV444_P16:
+    case NativePixelFormat::YUV444_SP8:
+    case NativePixelFormat::YUV444_SP16:
+        return ChromaSubsampling::Yuv444;
+    default:
+        return ChromaSubsampling::None;
+    }
+}
+
+static bool IsSemiPlanar(NativePixelFormat format)
+{
+    return format >= NativePixelFormat::YUV420_SP8 && format <= NativePixelFormat::YUV444_SP16;
+}
+
+static uint32_t GetSampleSize(NativePixelFormat format)
+{
+    return (format >= NativePixelFormat::YUV420_P16 && format <= NativePixelFormat::YUV444_P16) || format >= NativePixelFormat::YUV420_SP16 ? 2 : 1;
+}
+
+void ComputePlaneLayout(NativePixelFormat format, uint32_t width, uint32_t height, bool alpha, NativePlaneLayout &layout)
+{
+    layout = {};
+    ChromaSubsampling subsampling = GetSubsampling(format);
+    if (subsampling == ChromaSubsampling::None)
+        return;
+
+    uint32_t shiftX = subsampling != ChromaSubsampling::Yuv444 ? 1 : 0;
+    uint32_t shiftY = subsampling == ChromaSubsampling::Yuv420 ? 1 : 0;
+    uint32_t sampleSize = GetSampleSize(format);
+
+    layout.width[0] = width;
+    layout.height[0] = height;
+    for (int i = 1; i <= (IsSemiPlanar(format) ? 1 : 2); i++)
+    {
+        layout.width[i] = (width + shiftX) >> shiftX;
+        layout.height[i] = (height + shiftY) >> shiftY;
+    }
+    if (alpha)
+    {
+        layout.width[3] = width;
+        layout.height[3] = height;
+    }
+
+    for (int i = 0; i < 4; i++)
+        layout.rowBytes[i] = (size_t)layout.width[i] * sampleSize * (i == 1 && IsSemiPlanar(format) ? 2 : 1);
+}
+
+// count samples of depth bits to every step-th sample of an 8 or 16 bit row; scale maps the full ranges
+// onto each other instead of keeping the value in the upper bits
+static void WriteSamples(uint8_t *dest, uint32_t destSize, size_t step, const uint8_t *src, uint32_t depth, uint32_t count, bool scale)
+{
+    uint32_t srcMax = (1u << depth) - 1;
+    if (depth <= 8)
+    {
+        if (destSize == 1 && step == 1)
+            memcpy(dest, src, count);
+        else if (destSize == 1)
+        {
+            for (uint32_t i = 0; i < count; i++)
+                dest[i * step] = src[i];
+        }
+        else
+        {
+            auto out = (uint16_t *)dest;
+            for (uint32_t i = 0; i < count; i++)
+                out[i * step] = (uint16_t)(scale ? src[i] * 65535u / srcMax : src[i] << 8);
+        }
+        return;
+    }
+
+    auto in = (const uint16_t *)src;
+    if (destSize == 2)
+    {
+        auto out = (uint16_t *)dest;
+        for (uint32_t i = 0; i < count; i++)
+            out[i * step] = (uint16_t)(scale ? in[i] * 65535u / srcMax : in[i] << (16 - depth));
+    }
+    else
+    {
+        uint32_t shift = depth - 8;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            uint32_t v = scale ? (in[i] * 255u + srcMax / 2) / srcMax : (in[i] + (1u << (shift - 1))) >> shift;
+            dest[i * step] = (uint8_t)(v < 255 ? v : 255);
+        }
+    }
+}
+
+void WritePlanes(const YuvPlanes &src, uint32_t srcX, uint32_t srcY, uint32_t width, uint32_t height,
+    NativePixelFormat format, const NativePlane *planes, uint32_t destX, uint32_t destY)
+{
+    ChromaSubsampling subsampling = GetSubsampling(format);
+    uint32_t shiftX = subsampling != ChromaSubsampling::Yuv444 ? 1 : 0;
+    uint32_t shiftY = subsampling == ChromaSubsampling::Yuv420 ? 1 : 0;
+    uint32_t destSize = GetSampleSize(format);
+    uint32_t srcSize = src.depth > 8 ? 2 : 1;
+    bool semiPlanar = IsSemiPlanar(format);
+
+    for (int p = 0; p < 4; p++)
+    {
+        // Cb and Cr of the semi-planar formats go to alternate samples of plane 1
+        bool chroma = p == 1 || p == 2;
+        const NativePlane &plane = planes[semiPlanar && chroma ? 1 : p];
+        if (!src.data[p] || !plane.memory)
+            continue;
+
+        uint32_t sx = chroma ? shiftX : 0;
+        uint32_t sy = chroma ? shiftY : 0;
+        uint32_t depth = p == 3 ? src.alphaDepth : src.depth;
+        uint32_t sampleSize = p == 3 ? (src.alphaDepth > 8 ? 2 : 1) : srcSize;
+        uint32_t count = (width + (1u << sx) - 1) >> sx;
+        uint32_t rows = (height + (1u << sy) - 1) >> sy;
+
+        size_t step = semiPlanar && chroma ? 2 : 1;
+        uint8_t *dest = (uint8_t *)plane.memory + (size_t)(destY >> sy) * plane.stride + (size_t)(destX >> sx) * step * destSize;
+        if (semiPlanar && p == 2)
+            dest += destSize;
+
+        const uint8_t *in = src.data[p] + (size_t)(srcY >> sy) * src.stride[p] + (size_t)(srcX >> sx) * sampleSize;
+        for (uint32_t y = 0; y < rows; y++)
+            WriteSamples(dest + y * plane.stride, destSize, step, in + y * src.stride[p], depth, count, p == 3);
+    }
+}
@@ -0,0 +1,410 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "windows.h"
+
+#include <algorithm>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "decoder.h"
+
+// Decoded images are kept as files named after a hash of the source bytes and the options that change the
+// pixels. A file is a CacheHeader followed by the rows in the decoder's own format, packed, and the metadata
+// blocks; a hit maps it and serves GetImageData from the view without touching the codec. Hits touch the
+// file's write time, and whenever an entry gets added the least recently used ones go until the directory
+// fits the size limit again. Entries are written to a temporary name and renamed, so other processes
+// sharing the directory never see one half written.
+
+static const uint32_t CacheMagic = 0x43445a56;    // "VZDC"
+static const uint32_t CacheVersion = 1;
+
+struct CacheHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint64_t sourceSize;
+
+    // as GetImageInfo reported it, without the metadata sizes
+    NativeImageInfo info;
+
+    // the rows are in info.format, width * pixel size bytes each
+    uint64_t pixels;
+
+    // Exif, XMP and ICC
+    uint64_t metadata[3];
+    uint32_t metadataSize[3];
+};
+
+static const MetadataKind MetadataKinds[3] = { MetadataKind::Exif, MetadataKind::Xmp, MetadataKind::Icc };
+
+static std::mutex cacheLock;
+static std::wstring cacheDirectory;     // with a trailing separator; empty while the cache is off
+static uint64_t cacheLimit = 0;
+
+// XXH64, it's hashing whole source files on every open
+static const uint64_t Prime1 = 0x9e3779b185ebca87ull;
+static const uint64_t Prime2 = 0xc2b2ae3d27d4eb4full;
+static const uint64_t Prime3 = 0x165667b19e3779f9ull;
+static const uint64_t Prime4 = 0x85ebca77c2b2ae63ull;
+static const uint64_t Prime5 = 0x27d4eb2f165667c5ull;
+
+static uint64_t Rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t Load64(const uint8_t *p)
+{
+    uint64_t x;
+    memcpy(&x, p, 8);
+    return x;
+}
+
+static uint64_t Round(uint64_t acc, uint64_t input)
+{
+    return Rotl(acc + input * Prime2, 31) * Prime1;
+}
+
+static uint64_t Merge(uint64_t acc, uint64_t v)
+{
+    return (acc ^ Round(0, v)) * Prime1 + Prime4;
+}
+
+static uint64_t Hash(const uint8_t *p, size_t size, uint64_t seed)
+{
+    const uint8_t *end = p + size;
+    uint64_t h;
+
+    if (size >= 32)
+    {
+        uint64_t v1 = seed + Prime1 + Prime2;
+        uint64_t v2 = seed + Prime2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - Prime1;
+        for (; end - p >= 32; p += 32)
+        {
+            v1 = Round(v1, Load64(p));
+            v2 = Round(v2, Load64(p + 8));
+            v3 = Round(v3, Load64(p + 16));
+            v4 = Round(v4, Load64(p + 24));
+        }
+
+        h = Rotl(v1, 1) + Rotl(v2, 7) + Rotl(v3, 12) + Rotl(v4, 18);
+        h = Merge(Merge(Merge(Merge(h, v1), v2), v3), v4);
+    }
+    else
+        h = seed + Prime5;
+
+    h += size;
+    for (; end - p >= 8; p += 8)
+        h = Rotl(h ^ Round(0, Load64(p)), 27) * Prime1 + Prime4;
+    if (end - p >= 4)
+    {
+        uint32_t x;
+        memcpy(&x, p, 4);
+        h = Rotl(h ^ (x * Prime1), 23) * Prime2 + Prime3;
+        p += 4;
+    }
+    for (; p < end; p++)
+        h = Rotl(h ^ (*p * Prime5), 11) * Prime1;
+
+    h ^= h >> 33;
+    h *= Prime2;
+    h ^= h >> 29;
+    h *= Prime3;
+    h ^= h >> 32;
+    return h;
+}
+
+static std::wstring GetEntryPath(const std::wstring &directory, uint64_t key)
+{
+    std::wstring name(16, L'0');
+    for (int i = 0; i < 16; i++)
+        name[i] = L"0123456789abcdef"[(key >> (60 - 4 * i)) & 15];
+    return directory + name + L".vzc";
+}
+
+// removes the least recently used entries until the rest fits the limit; entries other processes have mapped
+// are gone once they close them
+static void TrimCache(const std::wstring &directory, uint64_t limit)
+{
+    struct Entry
+    {
+        std::wstring name;
+        uint64_t size;
+        uint64_t used;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+
+    WIN32_FIND_DATAW found;
+    HANDLE find = FindFirstFileW((directory + L"*.vzc").c_str(), &found);
+    if (find == INVALID_HANDLE_VALUE)
+        return;
+    do
+    {
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            continue;
+        uint64_t size = ((uint64_t)found.nFileSizeHigh << 32) | found.nFileSizeLow;
+        uint64_t used = ((uint64_t)found.ftLastWriteTime.dwHighDateTime << 32) | found.ftLastWriteTime.dwLowDateTime;
+        entries.push_back({ found.cFileName, size, used });
+        total += size;
+    } while (FindNextFileW(find, &found));
+    FindClose(find);
+
+    if (!limit || total <= limit)
+        return;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.used < b.used; });
+    for (auto &entry : entries)
+    {
+        if (total <= limit)
+            break;
+        if (DeleteFileW((directory + entry.name).c_str()))
+            total -= entry.size;
+    }
+}
+
+static bool WriteAll(HANDLE file, const uint8_t *data, size_t size)
+{
+    while (size)
+    {
+        DWORD chunk = (DWORD)std::min(size, (size_t)1 << 30);
+        DWORD written = 0;
+        if (!WriteFile(file, data, chunk, &written, nullptr) || written != chunk)
+            return false;
+        data += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+class CachedDecoder : public IDecoder
+{
+public:
+    bool Load(uint64_t key, size_t sourceSize)
+    {
+        if (File->size < sizeof(CacheHeader))
+            return false;
+        memcpy(&header, File->data, sizeof(CacheHeader));
+        if (header.magic != CacheMagic || header.version != CacheVersion || header.key != key || header.sourceSize != sourceSize)
+            return false;
+
+        uint64_t rowBytes = (uint64_t)header.info.sizeX * GetPixelSize(header.info.format);
+        if (!rowBytes || !header.info.sizeY || header.pixels > File->size || rowBytes * header.info.sizeY > File->size - header.pixels)
+            return false;
+        for (int i = 0; i < 3; i++)
+            if (header.metadata[i] > File->size || header.metadataSize[i] > File->size - header.metadata[i])
+                return false;
+
+        Data = File->data;
+        DataSize = File->size;
+        Width = header.info.sizeX;
+        Height = header.info.sizeY;
+        Format = OutputFormat = header.info.format;
+        Alpha = OutputAlpha = header.info.alpha;
+        return true;
+    }
+
+    bool Init() override { return true; }
+    void Reset() override { }
+
+    ErrorCode GetImageInfo(NativeImageInfo &info) override
+    {
+        info = header.info;
+        return ErrorCode::Ok;
+    }
+
+    uint32_t GetMetadata(MetadataKind kind, void *buffer, uint32_t size) override
+    {
+        for (int i = 0; i < 3; i++)
+            if (kind == MetadataKinds[i] && header.metadataSize[i])
+                return CopyMetadata(Data + header.metadata[i], header.metadataSize[i], buffer, size);
+        return 0;
+    }
+
+    ErrorCode GetImageData(const Rect &rect, uint8_t *memory, size_t stride) override
+    {
+        PhaseTimer timer(Stats.Copy);
+        size_t pixelSize = GetPixelSize(Format);
+        size_t rowBytes = Width * pixelSize;
+        CopyRows(memory, stride, Data + header.pixels + rect.y * rowBytes + rect.x * pixelSize, rowBytes, rect.width * pixelSize, rect.height);
+        return ErrorCode::Ok;
+    }
+
+private:
+    CacheHeader header = {};
+};
+
+ErrorCode ConfigureDecodeCache(const wchar_t *directory, uint64_t maxBytes)
+{
+    std::lock_guard<std::mutex> guard(cacheLock);
+    cacheDirectory.clear();
+    cacheLimit = 0;
+    if (!directory || !*directory)
+        return ErrorCode::Ok;
+
+    if (!CreateDirectoryW(directory, nullptr) && GetLastError() != ERROR_ALREADY_EXISTS)
+        return ErrorCode::IOError;
+
+    cacheDirectory = directory;
+    if (cacheDirectory.back() != L'\\' && cacheDirectory.back() != L'/')
+        cacheDirectory += L'\\';
+    cacheLimit = maxBytes;
+    TrimCache(cacheDirectory, cacheLimit);
+    return ErrorCode::Ok;
+}
+
+uint64_t GetCacheKey(const uint8_t *data, size_t size, const NativeDecodeOptions &options)
+{
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        if (cacheDirectory.empty())
+            return 0;
+    }
+
+    // threads and the read-ahead don't change the result
+    uint32_t keyed[] = { options.targetSizeX, options.targetSizeY, (uint32_t)options.chromaUpsampling, (uint32_t)options.linearize };
+    uint64_t key = Hash((const uint8_t *)keyed, sizeof(keyed), Hash(data, size, CacheVersion));
+    return key ? key : 1;
+}
+
+IDecoder *OpenCachedDecoder(uint64_t key, size_t sourceSize, LogDelegate log)
+{
+    std::wstring path;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        if (cacheDirectory.empty())
+            return nullptr;
+        path = GetEntryPath(cacheDirectory, key);
+    }
+
+    auto decoder = new CachedDecoder();
+    decoder->File = new MappedFile();
+    if (!decoder->File->Open(path.c_str(), log) || !decoder->Load(key, sourceSize))
+    {
+        delete decoder;
+        return nullptr;
+    }
+
+    // marks it as recently used
+    HANDLE file = CreateFileW(path.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+        nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        FILETIME now;
+        GetSystemTimeAsFileTime(&now);
+        SetFileTime(file, nullptr, nullptr, &now);
+        CloseHandle(file);
+    }
+
+    return decoder;
+}
+
+void StoreInCache(IDecoder *decoder, const uint8_t *memory, size_t stride)
+{
+    // the key only covers the source and the options, so entries hold the pixels exactly as the decoder
+    // produces them natively: reads in another format, alpha representation or color space aren't kept
+    uint64_t key = decoder->CacheKey;
+    decoder->CacheKey = 0;
+    if (!key || decoder->Frame || decoder->GetFrameCount() != 1 ||
+        decoder->OutputFormat != decoder->Format || decoder->OutputAlpha != decoder->Alpha ||
+        decoder->DataFormat() != decoder->Format || decoder->DataAlpha() != decoder->Alpha ||
+        decoder->OutputPrimaries != ColorPrimaries::Source || decoder->OutputTransfer != TransferFunction::Source)
+        return;
+
+    CacheHeader header = {};
+    if (decoder->GetImageInfo(header.info) != ErrorCode::Ok || header.info.format != decoder->Format || header.info.alpha != decoder->Alpha ||
+        header.info.sizeX != decoder->Width || header.info.sizeY != decoder->Height)
+        return;
+    header.info.exifSize = header.info.xmpSize = header.info.iccSize = 0;
+
+    std::vector<uint8_t> metadata[3];
+    for (int i = 0; i < 3; i++)
+    {
+        metadata[i].resize(decoder->GetMetadata(MetadataKinds[i], nullptr, 0));
+        if (!metadata[i].empty())
+            decoder->GetMetadata(MetadataKinds[i], metadata[i].data(), (uint32_t)metadata[i].size());
+    }
+
+    size_t rowBytes = (size_t)decoder->Width * GetPixelSize(decoder->Format);
+    header.magic = CacheMagic;
+    header.version = CacheVersion;
+    header.key = key;
+    header.sourceSize = decoder->DataSize;
+    header.pixels = (sizeof(CacheHeader) + 63) & ~(uint64_t)63;
+    uint64_t end = header.pixels + (uint64_t)rowBytes * decoder->Height;
+    for (int i = 0; i < 3; i++)
+    {
+        header.metadata[i] = end;
+        header.metadataSize[i] = (uint32_t)metadata[i].size();
+        end += metadata[i].size();
+    }
+
+    // entries can be big, so the file is written without holding the lock; others keep looking up entries
+    // meanwhile. The temporary name is unique per thread
+    std::wstring directory;
+    uint64_t limit;
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        directory = cacheDirectory;
+        limit = cacheLimit;
+    }
+    if (directory.empty() || (limit && end > limit))
+        return;
+
+    std::wstring path = GetEntryPath(directory, key);
+    std::wstring temp = path + L"." + std::to_wstring(GetCurrentProcessId()) + L"." + std::to_wstring(GetCurrentThreadId()) + L".tmp";
+    HANDLE file = CreateFileW(temp.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        decoder->Log(LogLevel::Debug, "DecodeCache: can't create entry");
+        return;
+    }
+
+    static const uint8_t padding[64] = {};
+    bool ok = WriteAll(file, (const uint8_t *)&header, sizeof(CacheHeader)) &&
+        WriteAll(file, padding, (size_t)header.pixels - sizeof(CacheHeader));
+    if (stride == rowBytes)
+        ok = ok && WriteAll(file, memory, rowBytes * decoder->Height);
+    for (uint32_t y = 0; ok && stride != rowBytes && y < decoder->Height; y++)
+        ok = WriteAll(file, memory + y * stride, rowBytes);
+    for (int i = 0; ok && i < 3; i++)
+        ok = WriteAll(file, metadata[i].data(), metadata[i].size());
+    CloseHandle(file);
+
+    // only publishing it needs the lock, in case the cache was moved or turned off meanwhile. An entry
+    // someone has mapped can't be replaced, but then it's there already
+    {
+        std::lock_guard<std::mutex> guard(cacheLock);
+        ok = ok && cacheDirectory == directory && MoveFileExW(temp.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING);
+    }
+    if (!ok)
+    {
+        DeleteFileW(temp.c_str());
+        return;
+    }
+
+    // works on the directory alone, other processes trim it at the same time anyway
+    TrimCache(directory, limit);
+}
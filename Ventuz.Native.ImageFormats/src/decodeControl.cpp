@@ -0,0 +1,105 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <climits>
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#include "decodeControl.h"
+#include "decoder.h"
+
+// all decodes currently reading pixels; there are only ever a handful, so a list is fine
+static std::mutex activeLock;
+static std::condition_variable activeChanged;
+static std::vector<const DecodeControl *> active;
+
+static int GetPriority(const DecodeControl *control)
+{
+    return control ? control->Priority.load() : 0;
+}
+
+static int GetHighestPriority()
+{
+    int highest = INT_MIN;
+    for (auto control : active)
+    {
+        int priority = GetPriority(control);
+        if (priority > highest)
+            highest = priority;
+    }
+    return highest;
+}
+
+ActiveDecode::ActiveDecode(const DecodeControl *control): control(control)
+{
+    std::lock_guard<std::mutex> lock(activeLock);
+    active.push_back(control);
+}
+
+ActiveDecode::~ActiveDecode()
+{
+    {
+        std::lock_guard<std::mutex> lock(activeLock);
+        for (auto it = active.begin(); it != active.end(); ++it)
+        {
+            if (*it == control)
+            {
+                active.erase(it);
+                break;
+            }
+        }
+    }
+    activeChanged.notify_all();
+}
+
+bool DecodeCheckpoint(const DecodeControl *control)
+{
+    // decodes without a control can't be cancelled and never step aside
+    if (!control)
+        return true;
+    if (control->Cancelled)
+        return false;
+
+    std::unique_lock<std::mutex> lock(activeLock);
+    activeChanged.wait(lock, [control] { return control->Cancelled || GetHighestPriority() <= GetPriority(control); });
+    return !control->Cancelled;
+}
+
+// the changes are made under the lock so a decode can't miss them between its check and going to sleep
+void DecodeControl::Cancel()
+{
+    {
+        std::lock_guard<std::mutex> lock(activeLock);
+        Cancelled = true;
+    }
+    activeChanged.notify_all();
+}
+
+void DecodeControl::SetPriority(int priority)
+{
+    {
+        std::lock_guard<std::mutex> lock(activeLock);
+        Priority = priority;
+    }
+    activeChanged.notify_all();
+}
@@ -20,8 +20,17 @@
  */
 
 #include <string.h>
-
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <vector>
+
+#include "convert.h"
 #include "decoder.h"
+#include "threadPool.h"
+#include "avif/avif.h"
 #include "libheif/heif.h"
 
 class HeicDecoder: public IDecoder
@@ -32,145 +41,368 @@ public:
 
     ~HeicDecoder()
     {
-        if (image)
-            heif_image_handle_release(image);
+        Reset();
+        if (decodeOptions)
+            heif_decoding_options_free(decodeOptions);
+    }
+
+    void Reset() override
+    {
+        TakePrefetch(UINT32_MAX);
+        ReleaseImage();
         if (context)
             heif_context_free(context);
+        context = nullptr;
         delete reader;
-        delete exif;
-        delete icc;
-        delete xmp;
+        reader = nullptr;
+        frames.clear();
+        frame = 0;
     }
 
     bool Init() override
     {
+        // libheif has no way to reuse a context for another file
         context = heif_context_alloc();
-        reader = new Reader(this);
-
         heif_context_set_maximum_image_size_limit(context, 16384);
 
-        heif_error err = heif_context_read_from_reader(context, reader, reader, nullptr);
+        // grid tiles get decoded in parallel
+        heif_context_set_max_decoding_threads(context, Threads);
+
+        // incremental sources go through the reader even from memory, it tells libheif what's there yet
+        heif_error err;
+        if (Data && !Options.available)
+            err = heif_context_read_from_memory_without_copy(context, Data, DataSize, nullptr);
+        else
+        {
+            reader = new Reader(this);
+            err = heif_context_read_from_reader(context, reader, reader, nullptr);
+        }
+
         if (IsError(err))
             return false;
 
-        err = heif_context_get_primary_image_handle(context, &image);
+        // frames are the primary image followed by the other top-level images
+        heif_item_id primary;
+        err = heif_context_get_primary_image_ID(context, &primary);
         if (IsError(err))
             return false;
 
-        width = heif_image_handle_get_ispe_width(image);
-        height = heif_image_handle_get_ispe_height(image);
-        hasAlpha = !!heif_image_handle_has_alpha_channel(image);
-        bpp = heif_image_handle_get_luma_bits_per_pixel(image);
+        int numImages = heif_context_get_number_of_top_level_images(context);
+        std::vector<heif_item_id> ids(numImages > 0 ? numImages : 0);
+        numImages = heif_context_get_list_of_top_level_image_IDs(context, ids.data(), numImages);
+
+        frames.push_back(primary);
+        for (int i = 0; i < numImages; i++)
+            if (ids[i] != primary)
+                frames.push_back(ids[i]);
+
+        if (!OpenImage(primary))
+            return false;
+
+        if (hasAlpha)
+            Alpha = heif_image_handle_is_premultiplied_alpha(PixelHandle()) ? AlphaMode::Premultiplied : AlphaMode::Straight;
+
+        if (!decodeOptions)
+            decodeOptions = heif_decoding_options_alloc();
+        decodeOptions->ignore_transformations = 1;
+        decodeOptions->color_conversion_options.only_use_preferred_chroma_algorithm = 0;
+        if (Options.chromaUpsampling != ChromaUpsampling::Automatic)
+        {
+            decodeOptions->color_conversion_options.preferred_chroma_upsampling_algorithm =
+                Options.chromaUpsampling == ChromaUpsampling::Fastest ? heif_chroma_upsampling_nearest_neighbor : heif_chroma_upsampling_bilinear;
+            decodeOptions->color_conversion_options.only_use_preferred_chroma_algorithm = 1;
+        }
+
+        Width = width;
+        Height = height;
+        Format = bpp > 8 ? NativePixelFormat::RGBA_UN16 : NativePixelFormat::RGBA_UN8;
         return true;
     }
 
     ErrorCode GetImageInfo(NativeImageInfo &info) override
     {
-        bool isPremul = !!heif_image_handle_is_premultiplied_alpha(image);
-
         info.sizeX = width;
         info.sizeY = height;
-        info.format = bpp > 8 ? NativePixelFormat::RGBA_UN16 : NativePixelFormat::RGBA_UN8;
-        info.alpha = hasAlpha ? (isPremul ? AlphaMode::Premultiplied : AlphaMode::Straight) : AlphaMode::Unknown;
+        info.format = Format;
+        info.alpha = Alpha;
 
         heif_color_profile_nclx *nclx{};
         if (heif_image_handle_get_nclx_color_profile(image, &nclx).code == heif_error_Ok)
         {
             info.colorPrimaries = nclx->color_primaries;
             info.transferCharacteristics = nclx->transfer_characteristics;
+            info.matrixCoefficients = nclx->matrix_coefficients;
+            info.fullRange = nclx->full_range_flag;
+            heif_nclx_color_profile_free(nclx);
         }
 
-        if (heif_image_handle_get_color_profile_type(image) == heif_color_profile_type_prof)
+        // only what gets decoded as YCbCr counts, see GetDecodeFormat()
+        info.subsampling =
+            decodeColorspace != heif_colorspace_YCbCr ? ChromaSubsampling::None :
+            decodeChroma == heif_chroma_420 ? ChromaSubsampling::Yuv420 :
+            decodeChroma == heif_chroma_422 ? ChromaSubsampling::Yuv422 : ChromaSubsampling::Yuv444;
+        info.bitDepth = (uint32_t)bpp;
+
+        return ErrorCode::Ok;
+    }
+
+    uint32_t GetMetadata(MetadataKind kind, void *buffer, uint32_t size) override
+    {
+        if (kind == MetadataKind::Icc)
         {
-            int iccSize = (int)heif_image_handle_get_raw_color_profile_size(image);
-            icc = new uint8_t[iccSize];
-            heif_image_handle_get_raw_color_profile(image, icc);
-            info.iccData = icc;
-            info.iccSize = iccSize;
+            auto type = heif_image_handle_get_color_profile_type(image);
+            if (type != heif_color_profile_type_prof && type != heif_color_profile_type_rICC)
+                return 0;
+
+            size_t iccSize = heif_image_handle_get_raw_color_profile_size(image);
+            if (buffer && iccSize <= size)
+                heif_image_handle_get_raw_color_profile(image, buffer);
+            return (uint32_t)iccSize;
         }
 
-        int nMeta = heif_image_handle_get_number_of_metadata_blocks(image, nullptr);
-        heif_item_id *metaIds = new heif_item_id[nMeta];
-        heif_image_handle_get_list_of_metadata_block_IDs(image, nullptr, metaIds, nMeta);
+        heif_item_id id;
+        if (!FindMetadata(kind, id))
+            return 0;
 
-        for (int i = 0; i < nMeta; i++)
+        size_t blockSize = heif_image_handle_get_metadata_size(image, id);
+        if (kind == MetadataKind::Xmp)
         {
-            heif_item_id id = metaIds[i];
-            const char *type = heif_image_handle_get_metadata_type(image, id);
-            if (!strcmp(type, "Exif"))
+            if (buffer && blockSize <= size)
+                heif_image_handle_get_metadata(image, id, buffer);
+            return (uint32_t)blockSize;
+        }
+
+        // Exif blocks start with the offset to the TIFF header, so they need a detour
+        std::vector<uint8_t> block(blockSize);
+        if (blockSize < 4 || IsError(heif_image_handle_get_metadata(image, id, block.data())))
+            return 0;
+
+        uint32_t offs = SwapEndian(*(uint32_t *)block.data()) + 4;
+        return offs < blockSize ? CopyMetadata(block.data() + offs, blockSize - offs, buffer, size) : 0;
+    }
+
+    ErrorCode GetImageData(const Rect &rect, uint8_t *memory, size_t stride) override
+    {
+        if (!image)
+            return ErrorCode::BadFormat;
+
+        // single images get decoded as a whole; YCbCr ones are converted straight into memory
+        if (!isGrid || fullImage)
+        {
+            if (!fullImage)
             {
-                size_t exifSize = heif_image_handle_get_metadata_size(image, id);
-                exif = new uint8_t[exifSize];
-                heif_image_handle_get_metadata(image, id, exif);
-                uint32_t offs = SwapEndian(*(uint32_t *)exif) + 4;
-                if (offs < exifSize)
+                PhaseTimer timer(Stats.Decode);
+                if (IsError(heif_decode_image(PixelHandle(), &fullImage, decodeColorspace, decodeChroma, decodeOptions)))
                 {
-                    info.exifData = exif + offs;
-                    info.exifSize = (int)(exifSize - offs);
+                    fullImage = nullptr;
+                    if (!DataMissing())
+                        return ErrorCode::BadFormat;
+                    ClearRows(memory, stride, rect.width * GetPixelSize(Format), rect.height);
+                    return ErrorCode::Incomplete;
                 }
+                Track(fullImage);
+            }
+
+            bool ok = WriteRegion(fullImage, 0, 0, rect, memory, stride, Threads);
+            if (rect.x == 0 && rect.width == Width)
+                Completed(rect.y, rect.height);
+
+            // partial requests (regions, bands) are usually followed by more, so keep the image until one
+            // reaches the bottom right corner, which ends bands as well as regions read in order
+            if (rect.x + rect.width == Width && rect.y + rect.height == Height)
+            {
+                ReleaseDecoded(fullImage);
+                fullImage = nullptr;
             }
-            
-            type = heif_image_handle_get_metadata_content_type(image, id);
-            if (!strcmp(type, "application/rdf+xml"))
+            return ok ? ErrorCode::Ok : ErrorCode::InternalError;
+        }
+
+        // grids never exist as a whole: every tile is converted into its place in memory right after decoding
+        // it, so a decode needs one frame plus a row of tiles. The last row of tiles stays around, so
+        // consecutive bands don't decode the same tiles again
+        uint32_t tx0 = rect.x / tiling.tile_width;
+        uint32_t tx1 = (rect.x + rect.width - 1) / tiling.tile_width;
+        uint32_t ty0 = rect.y / tiling.tile_height;
+        uint32_t ty1 = (rect.y + rect.height - 1) / tiling.tile_height;
+
+        // tiles an incremental source doesn't have yet are zero, the others are delivered anyway
+        ThreadPool &pool = TilePool();
+        ErrorCode result = ErrorCode::Ok;
+        for (uint32_t ty = ty0; ty <= ty1; ty++)
+        {
+            if (ty != tileRowY)
             {
-                size_t xmpSize = heif_image_handle_get_metadata_size(image, id);
-                xmp = new uint8_t[xmpSize];
-                heif_image_handle_get_metadata(image, id, xmp);
-                info.xmpData = xmp + 4;
-                info.xmpSize = (int)xmpSize;
+                ReleaseTileRow();
+                tileRow.assign(tiling.num_columns, nullptr);
+                tileRowY = ty;
             }
+
+            ErrorCode err = DecodeTiles(pool, tx0, tx1, ty, [&](const heif_image *tile, uint32_t tx)
+            {
+                if (!tile)
+                    return ClearRegion(tx * tiling.tile_width, ty * tiling.tile_height, rect, memory, stride);
+                return WriteRegion(tile, tx * tiling.tile_width, ty * tiling.tile_height, rect, memory, stride, 1);
+            });
+            if (err == ErrorCode::Incomplete)
+                result = err;
+            else if (err != ErrorCode::Ok)
+                return err;
+            else if (tx0 == 0 && tx1 == tiling.num_columns - 1)
+                Completed(ty * tiling.tile_height, std::min(tiling.tile_height, Height - ty * tiling.tile_height));
         }
 
-        delete[] metaIds;
-        
-        return ErrorCode::Ok;
+        return result;
     }
 
-    ErrorCode GetImageData(void *memory) override
+    ErrorCode GetImageDataPlanar(const NativePlane *planes) override
     {
-        heif_image *outImg{};
-        heif_chroma chroma = bpp > 8 ? heif_chroma_interleaved_RRGGBBAA_LE : heif_chroma_interleaved_RGBA;
-        auto options = heif_decoding_options_alloc();
-        options->ignore_transformations = 1;
+        if (!image)
+            return ErrorCode::BadFormat;
 
-        auto err = heif_decode_image(image, &outImg, heif_colorspace_RGB, chroma, options);
-        if (IsError(err))
+        if (!isGrid || fullImage)
         {
-            heif_decoding_options_free(options);
-            return ErrorCode::BadFormat;
-        }
+            if (!fullImage)
+            {
+                PhaseTimer timer(Stats.Decode);
+                if (IsError(heif_decode_image(PixelHandle(), &fullImage, decodeColorspace, decodeChroma, decodeOptions)))
+                {
+                    fullImage = nullptr;
+                    return DataMissing() ? ErrorCode::Incomplete : ErrorCode::BadFormat;
+                }
+                Track(fullImage);
+            }
 
-        int stride = 0;
-        const uint8_t *data = heif_image_get_plane_readonly(outImg, heif_channel_interleaved, &stride);
+            {
+                PhaseTimer timer(Stats.Copy);
+                WritePlanes(GetPlanes(fullImage), 0, 0, Width, Height, OutputFormat, planes, 0, 0);
+            }
+            ReleaseDecoded(fullImage);
+            fullImage = nullptr;
+            Completed(0, Height);
+            return ErrorCode::Ok;
+        }
 
-        int outStride = width * (bpp > 8 ? 8 : 4);
-        if (stride != outStride)
+        // tiles go to their place in the planes like they do for RGB; their origins are multiples of the subsampling.
+        // Those an incremental source doesn't have yet are left alone
+        ThreadPool &pool = TilePool();
+        ErrorCode result = ErrorCode::Ok;
+        for (uint32_t ty = 0; ty < tiling.num_rows; ty++)
         {
-            uint8_t *dest = (uint8_t *)memory;
-            for (int y = 0; y < height; y++)
+            if (ty != tileRowY)
             {
-                memcpy(dest, data, outStride);
-                data += stride;
-                dest += outStride;
+                ReleaseTileRow();
+                tileRow.assign(tiling.num_columns, nullptr);
+                tileRowY = ty;
             }
+
+            ErrorCode err = DecodeTiles(pool, 0, tiling.num_columns - 1, ty, [&](const heif_image *tile, uint32_t tx)
+            {
+                if (!tile)
+                    return true;
+                uint32_t x = tx * tiling.tile_width;
+                uint32_t y = ty * tiling.tile_height;
+                PhaseTimer timer(Stats.Copy);
+                WritePlanes(GetPlanes(tile), 0, 0, std::min(tiling.tile_width, Width - x), std::min(tiling.tile_height, Height - y),
+                    OutputFormat, planes, x, y);
+                return true;
+            });
+            if (err == ErrorCode::Incomplete)
+                result = err;
+            else if (err != ErrorCode::Ok)
+                return err;
+            else
+                Completed(ty * tiling.tile_height, std::min(tiling.tile_height, Height - ty * tiling.tile_height));
         }
-        else
-            memcpy(memory, data, (size_t)stride * height);
 
-        for (int i = 0;; i++)
+        return result;
+    }
+
+    bool SelectOutput(NativePixelFormat format, AlphaMode alpha) override
+    {
+        // only planar YUV of the stored layout; RGB output is converted by WriteRegion and the api
+        NativeImageInfo info;
+        return IsPlanar(format) && GetImageInfo(info) == ErrorCode::Ok && GetSubsampling(format) == info.subsampling;
+    }
+
+    uint32_t BandRows() const override
+    {
+        // one row of grid tiles at a time, decoded in parallel
+        return isGrid ? tiling.tile_height : 64;
+    }
+
+    uint32_t GetFrameCount() override
+    {
+        return (uint32_t)frames.size();
+    }
+
+    ErrorCode SelectFrame(uint32_t index) override
+    {
+        heif_image *prefetched = TakePrefetch(index);
+        if (index == frame && image)
         {
-            heif_error warning{};
-            int ret = heif_image_get_decoding_warnings(outImg, i, &warning, 1);
-            if (!ret || !warning.message)
-                break;
-            Log(LogLevel::Warning, warning.message);
+            if (prefetched)
+                ReleaseDecoded(prefetched);
+            return ErrorCode::Ok;
+        }
+
+        frame = UINT32_MAX;
+        if (index >= frames.size() || !OpenImage(frames[index]))
+        {
+            if (prefetched)
+                ReleaseDecoded(prefetched);
+            return ErrorCode::BadFormat;
+        }
+
+        if ((uint32_t)width != Width || (uint32_t)height != Height || (bpp > 8) != (Format == NativePixelFormat::RGBA_UN16))
+        {
+            Log(LogLevel::Error, "HEIF frame differs in size or bit depth from the primary image");
+            if (prefetched)
+                ReleaseDecoded(prefetched);
+            ReleaseImage();
+            return ErrorCode::BadFormat;
         }
-       
-        heif_image_release(outImg);
-        heif_decoding_options_free(options);
+
+        frame = index;
+        fullImage = prefetched;
         return ErrorCode::Ok;
     }
 
+    void Prefetch(uint32_t index) override
+    {
+        // a delegate source can't be read from two threads at once
+        TakePrefetch(UINT32_MAX);
+        if (index >= frames.size() || reader)
+            return;
+
+        heif_image_handle *handle = nullptr;
+        if (heif_context_get_image_handle(context, frames[index], &handle).code != heif_error_Ok)
+            return;
+
+        int w = heif_image_handle_get_ispe_width(handle);
+        int h = heif_image_handle_get_ispe_height(handle);
+        heif_image_handle *thumb = FindThumbnail(handle, w, h);
+        if (thumb)
+        {
+            heif_image_handle_release(handle);
+            handle = thumb;
+        }
+
+        heif_colorspace colorspace;
+        heif_chroma chroma;
+        GetDecodeFormat(handle, colorspace, chroma);
+        prefetchFrame = index;
+        prefetch = std::async(std::launch::async, [this, handle, colorspace, chroma]
+        {
+            PhaseTimer timer(Stats.Decode);
+            heif_image *img = nullptr;
+            if (IsError(heif_decode_image(handle, &img, colorspace, chroma, decodeOptions)))
+                img = nullptr;
+            Track(img);
+            heif_image_handle_release(handle);
+            return img;
+        });
+    }
+
 private:
 
     struct Reader: heif_reader
@@ -183,36 +415,509 @@ private:
             seek = [](int64_t pos, void *p) { return ((Reader *)p)->Seek(pos); };
             wait_for_file_size = [](int64_t target, void *p) { return ((Reader *)p)->Wait(target); };
 
-            fsize = dec->Seek(0, SeekOrigin::End);
-            dec->Seek(0, SeekOrigin::Begin);
+            fsize = (int64_t)dec->SourceSize();
         };
 
+        // all local, the source only calls the delegates when it runs out of buffered data.
+        // Memory sources only come here for incremental decodes
         int64_t GetPos() const
         {
-            return dec->Seek(0, SeekOrigin::Current);
+            return dec->Data ? (int64_t)pos : (int64_t)dec->Source.Tell();
         }
 
-        int Read(void *data, size_t size) const
+        int Read(void *data, size_t size)
         {
-            size_t hasread = dec->Read(data, (int)size);
+            if (dec->Data)
+            {
+                if (pos + size > dec->DataSize || pos + size > dec->Available)
+                    return heif_error_Invalid_input;
+                memcpy(data, dec->Data + pos, size);
+                pos += size;
+                return heif_error_Ok;
+            }
+
+            size_t hasread = dec->Source.Read(data, size);
             return hasread == size ? heif_error_Ok : heif_error_Invalid_input;
         }
 
-        int Seek(int64_t pos) const
+        int Seek(int64_t p)
         {
-            int64_t haspos = dec->Seek(pos, SeekOrigin::Begin);
-            return haspos == pos ? heif_error_Ok : heif_error_Invalid_input;
+            if (p < 0 || p > fsize)
+                return heif_error_Invalid_input;
+            if (dec->Data)
+                pos = (uint64_t)p;
+            else
+                dec->Source.SeekTo((uint64_t)p);
+            return heif_error_Ok;
         }
 
+        // libheif asks before it reads anything. Data of an incremental source that hasn't arrived yet times out,
+        // which fails what libheif was doing (parsing, decoding a tile) without a read beyond what's there
         heif_reader_grow_status Wait(int64_t target_size) const
         {
-            return target_size > fsize ? heif_reader_grow_status_size_beyond_eof : heif_reader_grow_status_size_reached;
+            if (target_size > fsize)
+                return heif_reader_grow_status_size_beyond_eof;
+            return (uint64_t)target_size > dec->Available ? heif_reader_grow_status_timeout : heif_reader_grow_status_size_reached;
         }
 
         int64_t fsize = 0;
+        uint64_t pos = 0;
         HeicDecoder *dec = nullptr;
     };
 
+    // the pool grid tiles are decoded on, within Threads and the process wide limit. It's kept for all reads
+    // of the decoder and only started again when the thread count changes. A reader can't be used from
+    // several threads at once
+    ThreadPool &TilePool()
+    {
+        int threads = reader ? 1 : std::min({ Threads, GetThreadLimit(), (int)tiling.num_columns });
+        if (!tilePool || tilePool->GetThreadCount() != (size_t)threads)
+            tilePool.reset(new ThreadPool(threads));
+        return *tilePool;
+    }
+
+    // decodes the tiles tx0 to tx1 of row ty into tileRow where they're missing and hands them to write,
+    // spread over the pool. Tiles an incremental source doesn't have yet are handed over as null
+    ErrorCode DecodeTiles(ThreadPool &pool, uint32_t tx0, uint32_t tx1, uint32_t ty, const std::function<bool(const heif_image *tile, uint32_t tx)> &write)
+    {
+        std::atomic<bool> ok { true };
+        std::atomic<bool> cancelled { false };
+        std::atomic<bool> missing { false };
+        auto work = [&](uint32_t tx)
+        {
+            if (cancelled || !Continue())
+            {
+                cancelled = true;
+                return;
+            }
+
+            if (!tileRow[tx])
+            {
+                PhaseTimer timer(Stats.Decode);
+                if (IsError(heif_image_handle_decode_image_tile(PixelHandle(), &tileRow[tx], decodeColorspace, decodeChroma, decodeOptions, tx, ty)))
+                {
+                    // the tile gets another try on the next read of an incremental source
+                    tileRow[tx] = nullptr;
+                    if (DataMissing())
+                    {
+                        missing = true;
+                        if (!write(nullptr, tx))
+                            ok = false;
+                    }
+                    else
+                        ok = false;
+                    return;
+                }
+                Track(tileRow[tx]);
+            }
+
+            if (!write(tileRow[tx], tx))
+                ok = false;
+        };
+
+        for (uint32_t tx = tx0; tx <= tx1; tx++)
+            pool.Submit(tx - tx0, [&work, tx](size_t) { work(tx); });
+        pool.Wait();
+
+        if (cancelled)
+            return ErrorCode::Cancelled;
+        if (!ok)
+            return ErrorCode::BadFormat;
+        return missing ? ErrorCode::Incomplete : ErrorCode::Ok;
+    }
+
+    // makes an image the current one, with its thumbnail if the target size allows
+    bool OpenImage(heif_item_id id)
+    {
+        ReleaseImage();
+        if (IsError(heif_context_get_image_handle(context, id, &image)))
+            return false;
+
+        width = heif_image_handle_get_ispe_width(image);
+        height = heif_image_handle_get_ispe_height(image);
+        thumbnail = FindThumbnail(image, width, height);
+
+        hasAlpha = !!heif_image_handle_has_alpha_channel(PixelHandle());
+        bpp = heif_image_handle_get_luma_bits_per_pixel(PixelHandle());
+        GetDecodeFormat(PixelHandle(), decodeColorspace, decodeChroma);
+
+        isGrid = heif_image_handle_get_image_tiling(PixelHandle(), 0, &tiling).code == heif_error_Ok &&
+            tiling.num_columns * tiling.num_rows > 1 && tiling.tile_width && tiling.tile_height;
+        return true;
+    }
+
+    void ReleaseImage()
+    {
+        ReleaseTileRow();
+        if (fullImage)
+            ReleaseDecoded(fullImage);
+        if (thumbnail)
+            heif_image_handle_release(thumbnail);
+        if (image)
+            heif_image_handle_release(image);
+        fullImage = nullptr;
+        thumbnail = nullptr;
+        image = nullptr;
+    }
+
+    // waits for a running prefetch and returns its image if it was for the given frame
+    heif_image *TakePrefetch(uint32_t index)
+    {
+        if (!prefetch.valid())
+            return nullptr;
+
+        heif_image *img = prefetch.get();
+        if (img && prefetchFrame != index)
+        {
+            ReleaseDecoded(img);
+            img = nullptr;
+        }
+        return img;
+    }
+
+    // decoded images count towards the memory in the stats until they're released
+    void Track(const heif_image *img)
+    {
+        if (img)
+            Stats.Hold((int64_t)ImageBytes(img));
+    }
+
+    void ReleaseDecoded(heif_image *img)
+    {
+        Stats.Hold(-(int64_t)ImageBytes(img));
+        heif_image_release(img);
+    }
+
+    static size_t ImageBytes(const heif_image *img)
+    {
+        const heif_channel channels[] = { heif_channel_Y, heif_channel_Cb, heif_channel_Cr, heif_channel_Alpha, heif_channel_interleaved };
+        size_t bytes = 0;
+        for (auto channel : channels)
+        {
+            int planeStride = 0;
+            if (heif_image_has_channel(img, channel) && heif_image_get_plane_readonly(img, channel, &planeStride))
+                bytes += (size_t)planeStride * heif_image_get_height(img, channel);
+        }
+        return bytes;
+    }
+
+    void ReleaseTileRow()
+    {
+        for (auto tile : tileRow)
+            if (tile)
+                ReleaseDecoded(tile);
+        tileRow.clear();
+        tileRowY = UINT32_MAX;
+    }
+
+    // YCbCr images are kept in their stored layout and converted by WriteRegion, everything else
+    // (monochrome, RGB coded) gets converted to RGBA by libheif
+    static void GetDecodeFormat(const heif_image_handle *handle, heif_colorspace &colorspace, heif_chroma &chroma)
+    {
+        int depth = heif_image_handle_get_luma_bits_per_pixel(handle);
+        colorspace = heif_colorspace_undefined;
+        chroma = heif_chroma_undefined;
+        if (heif_image_handle_get_preferred_decoding_colorspace(handle, &colorspace, &chroma).code == heif_error_Ok &&
+            colorspace == heif_colorspace_YCbCr && (chroma == heif_chroma_420 || chroma == heif_chroma_422 || chroma == heif_chroma_444) &&
+            heif_image_handle_get_chroma_bits_per_pixel(handle) == depth)
+            return;
+
+        colorspace = heif_colorspace_RGB;
+        chroma = depth > 8 ? heif_chroma_interleaved_RRGGBBAA_LE : heif_chroma_interleaved_RGBA;
+    }
+
+    static YuvPlanes GetPlanes(const heif_image *img)
+    {
+        YuvPlanes planes = {};
+        const heif_channel channels[] = { heif_channel_Y, heif_channel_Cb, heif_channel_Cr, heif_channel_Alpha };
+        for (int i = 0; i < 4; i++)
+        {
+            int planeStride = 0;
+            if (heif_image_has_channel(img, channels[i]))
+                planes.data[i] = heif_image_get_plane_readonly(img, channels[i], &planeStride);
+            planes.stride[i] = (size_t)planeStride;
+        }
+        planes.depth = (uint32_t)heif_image_get_bits_per_pixel_range(img, heif_channel_Y);
+        if (planes.data[3])
+            planes.alphaDepth = (uint32_t)heif_image_get_bits_per_pixel_range(img, heif_channel_Alpha);
+        return planes;
+    }
+
+    // writes the part of a decoded image (placed at imgX, imgY) that overlaps rect
+    bool WriteRegion(const heif_image *img, uint32_t imgX, uint32_t imgY, const Rect &rect, uint8_t *memory, size_t stride, int threads) const
+    {
+        bool yuv = heif_image_get_colorspace(img) == heif_colorspace_YCbCr;
+        heif_channel channel = yuv ? heif_channel_Y : heif_channel_interleaved;
+
+        uint32_t x0 = rect.x > imgX ? rect.x : imgX;
+        uint32_t y0 = rect.y > imgY ? rect.y : imgY;
+        uint32_t x1 = imgX + heif_image_get_width(img, channel);
+        uint32_t y1 = imgY + heif_image_get_height(img, channel);
+        if (x1 > rect.x + rect.width) x1 = rect.x + rect.width;
+        if (y1 > rect.y + rect.height) y1 = rect.y + rect.height;
+
+        bool ok = true;
+        if (x0 < x1 && y0 < y1)
+        {
+            size_t ps = GetPixelSize(Format);
+            uint8_t *dest = memory + (y0 - rect.y) * stride + (x0 - rect.x) * ps;
+            Rect src = { x0 - imgX, y0 - imgY, x1 - x0, y1 - y0 };
+
+            if (yuv)
+                ok = ConvertYCbCr(img, src, dest, stride, threads);
+            else
+                CopyRGBA(img, src, dest, stride);
+        }
+
+        for (int i = 0;; i++)
+        {
+            heif_error warning{};
+            int ret = heif_image_get_decoding_warnings((heif_image *)img, i, &warning, 1);
+            if (!ret || !warning.message)
+                break;
+            Log(LogLevel::Warning, warning.message);
+        }
+
+        return ok;
+    }
+
+    // zeroes the part of rect a tile at (tileX, tileY) covers
+    bool ClearRegion(uint32_t tileX, uint32_t tileY, const Rect &rect, uint8_t *memory, size_t stride) const
+    {
+        uint32_t x0 = rect.x > tileX ? rect.x : tileX;
+        uint32_t y0 = rect.y > tileY ? rect.y : tileY;
+        uint32_t x1 = std::min(tileX + tiling.tile_width, rect.x + rect.width);
+        uint32_t y1 = std::min(tileY + tiling.tile_height, rect.y + rect.height);
+        if (x0 < x1 && y0 < y1)
+        {
+            size_t ps = GetPixelSize(Format);
+            ClearRows(memory + (y0 - rect.y) * stride + (x0 - rect.x) * ps, stride, (x1 - x0) * ps, y1 - y0);
+        }
+        return true;
+    }
+
+    // converts rect of a YCbCr image into dest with libavif's converter (the CICP semantics are the same),
+    // which reads the planes in place and writes the RGB rows directly
+    bool ConvertYCbCr(const heif_image *img, const Rect &rect, uint8_t *dest, size_t stride, int threads) const
+    {
+        avifImage *planes = avifImageCreateEmpty();
+        planes->width = heif_image_get_width(img, heif_channel_Y);
+        planes->height = heif_image_get_height(img, heif_channel_Y);
+        planes->depth = heif_image_get_bits_per_pixel_range(img, heif_channel_Y);
+
+        switch (heif_image_get_chroma_format(img))
+        {
+        case heif_chroma_444: planes->yuvFormat = AVIF_PIXEL_FORMAT_YUV444; break;
+        case heif_chroma_422: planes->yuvFormat = AVIF_PIXEL_FORMAT_YUV422; break;
+        default: planes->yuvFormat = AVIF_PIXEL_FORMAT_YUV420; break;
+        }
+
+        // libheif's own conversion defaults to full range BT.601 without a profile
+        planes->yuvRange = AVIF_RANGE_FULL;
+        planes->matrixCoefficients = 6;
+        heif_color_profile_nclx *nclx = nullptr;
+        if (heif_image_get_nclx_color_profile(img, &nclx).code == heif_error_Ok)
+        {
+            planes->yuvRange = nclx->full_range_flag ? AVIF_RANGE_FULL : AVIF_RANGE_LIMITED;
+            planes->matrixCoefficients = (uint16_t)nclx->matrix_coefficients;
+            planes->colorPrimaries = (uint16_t)nclx->color_primaries;
+            planes->transferCharacteristics = (uint16_t)nclx->transfer_characteristics;
+            heif_nclx_color_profile_free(nclx);
+        }
+
+        const heif_channel channels[] = { heif_channel_Y, heif_channel_Cb, heif_channel_Cr };
+        for (int i = 0; i < 3; i++)
+        {
+            int planeStride = 0;
+            planes->yuvPlanes[i] = (uint8_t *)heif_image_get_plane_readonly(img, channels[i], &planeStride);
+            planes->yuvRowBytes[i] = (uint32_t)planeStride;
+        }
+        planes->imageOwnsYUVPlanes = AVIF_FALSE;
+
+        // views into subsampled chroma need an even origin, so odd ones convert a bit more into a temp buffer
+        avifPixelFormatInfo fmtInfo;
+        avifGetPixelFormatInfo(planes->yuvFormat, &fmtInfo);
+        uint32_t x0 = rect.x & ~((1u << fmtInfo.chromaShiftX) - 1);
+        uint32_t y0 = rect.y & ~((1u << fmtInfo.chromaShiftY) - 1);
+
+        avifCropRect crop = { x0, y0, rect.width + rect.x - x0, rect.height + rect.y - y0 };
+        avifImage *view = avifImageCreateEmpty();
+        auto res = avifImageSetViewRect(view, planes, &crop);
+
+        avifRGBImage rgb;
+        avifRGBImageSetDefaults(&rgb, view);
+        rgb.format = AVIF_RGB_FORMAT_RGBA;
+        rgb.depth = Format == NativePixelFormat::RGBA_UN16 ? 16 : 8;
+        rgb.chromaUpsampling =
+            Options.chromaUpsampling == ChromaUpsampling::Fastest ? AVIF_CHROMA_UPSAMPLING_FASTEST :
+            Options.chromaUpsampling == ChromaUpsampling::BestQuality ? AVIF_CHROMA_UPSAMPLING_BEST_QUALITY :
+            AVIF_CHROMA_UPSAMPLING_AUTOMATIC;
+        rgb.maxThreads = threads;
+        rgb.width = crop.width;
+        rgb.height = crop.height;
+
+        size_t ps = GetPixelSize(Format);
+        bool direct = x0 == rect.x && y0 == rect.y;
+        std::vector<uint8_t> scratch;
+        if (direct)
+        {
+            rgb.pixels = dest;
+            rgb.rowBytes = (uint32_t)stride;
+        }
+        else
+        {
+            rgb.rowBytes = (uint32_t)(crop.width * ps);
+            scratch.resize((size_t)rgb.rowBytes * crop.height);
+            rgb.pixels = scratch.data();
+        }
+        HeldMemory held(Stats, scratch.size());
+
+        PhaseTimer timer(Stats.Convert);
+        if (res == AVIF_RESULT_OK)
+            res = avifImageYUVToRGB(view, &rgb);
+        avifImageDestroy(view);
+        avifImageDestroy(planes);
+
+        if (res != AVIF_RESULT_OK)
+        {
+            Log(LogLevel::Error, avifResultToString(res));
+            return false;
+        }
+
+        // the scratch copy is part of the conversion
+        if (!direct)
+            CopyRows(dest, stride, rgb.pixels + (rect.y - y0) * rgb.rowBytes + (rect.x - x0) * ps, rgb.rowBytes, rect.width * ps, rect.height);
+
+        // the converter makes everything opaque; alpha comes from its own plane, which may differ in depth
+        if (heif_image_has_channel(img, heif_channel_Alpha))
+        {
+            int alphaStride = 0;
+            const uint8_t *alpha = heif_image_get_plane_readonly(img, heif_channel_Alpha, &alphaStride);
+            int alphaDepth = heif_image_get_bits_per_pixel_range(img, heif_channel_Alpha);
+            CopyAlpha(alpha + (size_t)rect.y * alphaStride, alphaStride, alphaDepth, rect.x, dest, stride, rect.width, rect.height);
+        }
+
+        return true;
+    }
+
+    // writes the alpha channel of RGBA rows from a plane of the given depth
+    void CopyAlpha(const uint8_t *alpha, size_t alphaStride, int depth, uint32_t x, uint8_t *dest, size_t stride, uint32_t width, uint32_t height) const
+    {
+        uint32_t max = (1u << depth) - 1;
+        for (uint32_t y = 0; y < height; y++, alpha += alphaStride, dest += stride)
+        {
+            if (Format == NativePixelFormat::RGBA_UN16)
+            {
+                auto out = (uint16_t *)dest;
+                for (uint32_t i = 0; i < width; i++)
+                {
+                    uint32_t a = depth > 8 ? ((const uint16_t *)alpha)[x + i] : alpha[x + i];
+                    out[i * 4 + 3] = (uint16_t)((a * 65535 + max / 2) / max);
+                }
+            }
+            else
+            {
+                for (uint32_t i = 0; i < width; i++)
+                {
+                    uint32_t a = depth > 8 ? ((const uint16_t *)alpha)[x + i] : alpha[x + i];
+                    dest[i * 4 + 3] = (uint8_t)((a * 255 + max / 2) / max);
+                }
+            }
+        }
+    }
+
+    // copies rect of an interleaved RGBA image; more than 8 bits are scaled up to the full 16 bit range
+    void CopyRGBA(const heif_image *img, const Rect &rect, uint8_t *dest, size_t stride) const
+    {
+        PhaseTimer timer(Stats.Copy);
+        int srcStride = 0;
+        const uint8_t *src = heif_image_get_plane_readonly(img, heif_channel_interleaved, &srcStride);
+
+        size_t ps = GetPixelSize(Format);
+        CopyRows(dest, stride, src + (size_t)rect.y * srcStride + rect.x * ps, srcStride, rect.width * ps, rect.height);
+
+        int depth = heif_image_get_bits_per_pixel_range(img, heif_channel_interleaved);
+        if (Format != NativePixelFormat::RGBA_UN16 || depth <= 8 || depth >= 16)
+            return;
+
+        for (uint32_t y = 0; y < rect.height; y++)
+        {
+            auto row = (uint16_t *)(dest + y * stride);
+            for (uint32_t i = 0; i < rect.width * 4; i++)
+                row[i] = (uint16_t)((row[i] << (16 - depth)) | (row[i] >> (2 * depth - 16)));
+        }
+    }
+
+    // Exif is found by its item type, XMP by its MIME content type
+    bool FindMetadata(MetadataKind kind, heif_item_id &id) const
+    {
+        int nMeta = heif_image_handle_get_number_of_metadata_blocks(image, nullptr);
+        if (nMeta <= 0)
+            return false;
+
+        std::vector<heif_item_id> ids(nMeta);
+        nMeta = heif_image_handle_get_list_of_metadata_block_IDs(image, nullptr, ids.data(), nMeta);
+
+        for (int i = 0; i < nMeta; i++)
+        {
+            bool match = kind == MetadataKind::Exif ?
+                !strcmp(heif_image_handle_get_metadata_type(image, ids[i]), "Exif") :
+                !strcmp(heif_image_handle_get_metadata_content_type(image, ids[i]), "application/rdf+xml");
+            if (match)
+            {
+                id = ids[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // pixels come from the thumbnail if there's one, everything else from the primary image
+    heif_image_handle *PixelHandle() const
+    {
+        return thumbnail ? thumbnail : image;
+    }
+
+    // picks the smallest thumbnail of img that still covers the target size, updating w and h to its size
+    heif_image_handle *FindThumbnail(heif_image_handle *img, int &w, int &h) const
+    {
+        uint32_t reqX, reqY;
+        GetTargetSize(Options, w, h, reqX, reqY);
+        if (reqX == (uint32_t)w && reqY == (uint32_t)h)
+            return nullptr;
+
+        int nThumbs = heif_image_handle_get_number_of_thumbnails(img);
+        if (nThumbs <= 0)
+            return nullptr;
+
+        heif_item_id *thumbIds = new heif_item_id[nThumbs];
+        nThumbs = heif_image_handle_get_list_of_thumbnail_IDs(img, thumbIds, nThumbs);
+
+        heif_image_handle *best = nullptr;
+        for (int i = 0; i < nThumbs; i++)
+        {
+            heif_image_handle *thumb = nullptr;
+            if (heif_image_handle_get_thumbnail(img, thumbIds[i], &thumb).code != heif_error_Ok)
+                continue;
+
+            int tw = heif_image_handle_get_ispe_width(thumb);
+            int th = heif_image_handle_get_ispe_height(thumb);
+            if ((uint32_t)tw >= reqX && (uint32_t)th >= reqY && tw < w)
+            {
+                if (best)
+                    heif_image_handle_release(best);
+                best = thumb;
+                w = tw;
+                h = th;
+            }
+            else
+                heif_image_handle_release(thumb);
+        }
+
+        delete[] thumbIds;
+        return best;
+    }
+
     bool IsError(const heif_error &error) const
     {
         if (error.code == heif_error_Ok)
@@ -225,12 +930,26 @@ private:
     heif_context *context = nullptr;
     Reader *reader = nullptr;
     heif_image_handle *image = nullptr;
+    heif_image_handle *thumbnail = nullptr;
+    heif_decoding_options *decodeOptions = nullptr;
+
+    std::vector<heif_item_id> frames;
+    uint32_t frame = 0;
+    std::future<heif_image *> prefetch;
+    uint32_t prefetchFrame = UINT32_MAX;
+
+    heif_colorspace decodeColorspace = heif_colorspace_RGB;
+    heif_chroma decodeChroma = heif_chroma_interleaved_RGBA;
+
+    heif_image_tiling tiling{};
+    bool isGrid = false;
+    heif_image *fullImage = nullptr;
+    std::vector<heif_image *> tileRow;
+    uint32_t tileRowY = UINT32_MAX;
+    std::unique_ptr<ThreadPool> tilePool;
     int width, height;
     bool hasAlpha;   
     int bpp;
-    uint8_t *exif = nullptr;
-    uint8_t *xmp = nullptr;
-    uint8_t *icc = nullptr;
 };
 
 IDecoder *CreateHeicDecoder() { return new HeicDecoder(); }
@@ -0,0 +1,89 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "windows.h"
+
+#include "decoder.h"
+
+MappedFile::~MappedFile()
+{
+    if (data)
+        UnmapViewOfFile(data);
+    if (mapping)
+        CloseHandle(mapping);
+    if (file)
+        CloseHandle(file);
+}
+
+bool MappedFile::Open(const wchar_t *path, LogDelegate log)
+{
+    // sequential scan makes the cache manager read ahead aggressively for the page faults of the view
+    HANDLE h = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (h == INVALID_HANDLE_VALUE)
+    {
+        log(LogLevel::Debug, "MappedFile: can't open file");
+        return false;
+    }
+    file = h;
+
+    // a network error while paging in a view raises EXCEPTION_IN_PAGE_ERROR in whatever code touches it,
+    // so remote files are left to the stream path, which gets an error from the read instead
+    FILE_REMOTE_PROTOCOL_INFO remote;
+    if (GetFileInformationByHandleEx(h, FileRemoteProtocolInfo, &remote, sizeof(remote)))
+    {
+        log(LogLevel::Debug, "MappedFile: not mapping a remote file");
+        return false;
+    }
+
+    LARGE_INTEGER fsize;
+    if (!GetFileSizeEx(h, &fsize) || fsize.QuadPart <= 0 || (uint64_t)fsize.QuadPart > SIZE_MAX)
+        return false;
+
+    mapping = CreateFileMappingW(h, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (!mapping)
+    {
+        log(LogLevel::Debug, "MappedFile: can't create file mapping");
+        return false;
+    }
+
+    data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (!data)
+    {
+        log(LogLevel::Debug, "MappedFile: can't map view of file");
+        return false;
+    }
+    size = (size_t)fsize.QuadPart;
+
+    // we're going to touch all of it anyway, so start paging in right away
+    WIN32_MEMORY_RANGE_ENTRY range = { (void *)data, size };
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+
+    return true;
+}
+
+uint64_t QueryFileSize(const wchar_t *path)
+{
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    if (!path || !GetFileAttributesExW(path, GetFileExInfoStandard, &attributes))
+        return 0;
+    return ((uint64_t)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+}
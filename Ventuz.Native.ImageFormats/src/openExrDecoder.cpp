@@ -19,10 +19,21 @@
  * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <string.h>
+#include <mutex>
+#include <vector>
+
 #include "decoder.h"
 
+#include "OpenEXR/ImfInputFile.h"
+#include "OpenEXR/ImfTiledInputFile.h"
+#include "OpenEXR/ImfPreviewImage.h"
 #include "OpenEXR/ImfRgbaFile.h"
+#include "OpenEXR/ImfChannelList.h"
+#include "OpenEXR/ImfFrameBuffer.h"
 #include "OpenEXR/ImfChromaticitiesAttribute.h"
+#include "OpenEXR/IexBaseExc.h"
+#include "OpenEXR/ImfThreading.h"
 
 #define BUFFER_ALL 0
 
@@ -35,40 +46,91 @@ public:
     OpenExrDecoder(): IStream("") { }
 
     ~OpenExrDecoder()
+    {
+        Reset();
+    }
+
+    void Reset() override
     {
         delete file;
+        delete rgbaFile;
+        delete tiledFile;
+        file = nullptr;
+        rgbaFile = nullptr;
+        tiledFile = nullptr;
+        usePreview = false;
+        levelX = levelY = 0;
+        numChannels = 0;
+        pos = 0;
     }
 
-    RgbaInputFile *file = nullptr;
+    // R, RGB and RGBA files are read straight into the destination in their stored precision.
+    // Everything else (luminance/chroma, unusual layouts) goes through RgbaInputFile as RGBA_F16
+    InputFile *file = nullptr;
+    RgbaInputFile *rgbaFile = nullptr;
     Box2i dw;
 
+    // reduced representation for a target size: the preview image, or a mip/rip level of a tiled file.
+    // Tiled files of the direct path are always read through tiledFile, level 0 without a reduction
+    bool usePreview = false;
+    TiledInputFile *tiledFile = nullptr;
+    int levelX = 0, levelY = 0;
+    Box2i outWindow;
+
+    std::vector<uint8_t> scratch;
+
+    PixelType type = HALF;
+    const char *channelNames[4] = {};
+    int numChannels = 0;
+
     // Inherited via IDecoder
     bool Init() override
     {
+        Format = NativePixelFormat::RGBA_F16;
+
         try
         {
-            file = new RgbaInputFile((IStream &)*this);
+            file = new InputFile((IStream &)*this, FileThreads());
+            if (!SelectChannels())
+            {
+                delete file;
+                file = nullptr;
+
+                seekg(0);
+                rgbaFile = new RgbaInputFile((IStream &)*this, FileThreads());
+            }
+
+            dw = GetHeader().dataWindow();
+            outWindow = dw;
+            SelectReduction();
+
+            // tiled files are read by tiles, so regions only decode the tiles they touch
+            if (!usePreview && file && GetHeader().hasTileDescription())
+            {
+                seekg(0);
+                tiledFile = new TiledInputFile((IStream &)*this, FileThreads());
+                SelectLevel();
+            }
         }
         catch (...)
         {
             return false;
         }
 
-        dw = file->dataWindow();
+        Width = outWindow.max.x - outWindow.min.x + 1;
+        Height = outWindow.max.y - outWindow.min.y + 1;
         return true;
     }
 
     ErrorCode GetImageInfo(NativeImageInfo &info) override
     {
-        auto channels = file->channels();
-
-        info.sizeX = dw.max.x - dw.min.x + 1;
-        info.sizeY = dw.max.y - dw.min.y + 1;
-        info.format = channels == RgbaChannels::WRITE_R ? NativePixelFormat::R_F16 : NativePixelFormat::RGBA_F16;
+        info.sizeX = Width;
+        info.sizeY = Height;
+        info.format = Format;
         info.alpha = AlphaMode::Unknown;
-        info.transferCharacteristics = 8; // linear
+        info.transferCharacteristics = usePreview ? 13 : 8; // previews are stored perceptually encoded, otherwise linear
 
-        auto chAttr = file->header().findTypedAttribute<ChromaticitiesAttribute>("chromaticities");
+        auto chAttr = GetHeader().findTypedAttribute<ChromaticitiesAttribute>("chromaticities");
         if (chAttr)
         {
             auto &chroma = chAttr->value();
@@ -85,55 +147,343 @@ public:
         return ErrorCode::Ok;
     }
 
-    ErrorCode GetImageData(void *memory) override
+    ErrorCode GetImageData(const Rect &rect, uint8_t *memory, size_t stride) override
     {
-        int width = dw.max.x - dw.min.x + 1;
-        int height = dw.max.y - dw.min.y + 1;
+        size_t ps = GetPixelSize(Format);
+
+        if (usePreview)
+        {
+            auto &preview = GetHeader().previewImage();
+            size_t previewStride = preview.width() * sizeof(PreviewRgba);
+            PhaseTimer timer(Stats.Copy);
+            CopyRows(memory, stride, (const uint8_t *)preview.pixels() + rect.y * previewStride + rect.x * ps, previewStride, rect.width * ps, rect.height);
+            Completed(rect.y, rect.height);
+            return ErrorCode::Ok;
+        }
 
-        if (file->channels() == RgbaChannels::WRITE_R)
+        // rows of rect written so far; while an incremental source is missing data, the blocks that can
+        // be read are delivered from the top down and reading stops at the first one that can't
+        uint32_t done = 0;
+        try
         {
-            int np = width * height;
-            auto temp = new Rgba[np];
-            file->setFrameBuffer(temp - dw.min.x - dw.min.y * width, 1, width);
-            file->readPixels(dw.min.y, dw.max.y);
+            if (tiledFile)
+            {
+                ErrorCode err = ReadTiles(rect, memory, stride, done);
+                if (err == ErrorCode::Ok)
+                    Completed(rect.y, rect.height);
+                return err;
+            }
+
+            if (rect.width == Width && (!rgbaFile || stride % sizeof(Rgba) == 0))
+            {
+                // in blocks of line buffers, so a cancelled or preempted decode stops in between
+                uint32_t block = BandRows();
+                for (uint32_t y = 0; y < rect.height; y += block)
+                {
+                    if (!Continue())
+                        return ErrorCode::Cancelled;
 
-            const Rgba *src = temp;
-            uint16_t *dest = (uint16_t *)memory;
-            for (int i = 0; i < np; i++)
-                *dest++ = (src++)->r.bits();
+                    uint32_t rows = rect.height - y < block ? rect.height - y : block;
+                    ReadScanlines(rect.y + y, rows, memory + y * stride, stride);
+                    done = y + rows;
+                }
+            }
+            else
+            {
+                // partial rows go through a few full width lines at a time
+                const uint32_t chunk = 64;
+                size_t rowBytes = Width * ps;
+                size_t capacity = scratch.capacity();
+                scratch.resize(rowBytes * chunk);
+                Stats.Hold((int64_t)scratch.capacity() - (int64_t)capacity);
 
-            delete[] temp;
+                for (uint32_t y = 0; y < rect.height; y += chunk)
+                {
+                    if (!Continue())
+                        return ErrorCode::Cancelled;
+
+                    uint32_t rows = rect.height - y < chunk ? rect.height - y : chunk;
+                    ReadScanlines(rect.y + y, rows, scratch.data(), rowBytes);
+
+                    PhaseTimer timer(Stats.Copy);
+                    CopyRows(memory + y * stride, stride, scratch.data() + rect.x * ps, rowBytes, rect.width * ps, rows);
+                    done = y + rows;
+                }
+            }
         }
-        else
+        catch (const std::exception &e)
         {
-            file->setFrameBuffer(((Rgba *)memory) - dw.min.x - dw.min.y * width, 1, width);
-            file->readPixels(dw.min.y, dw.max.y);
+            if (DataMissing())
+            {
+                Completed(rect.y, done);
+                ClearRows(memory + done * stride, stride, rect.width * ps, rect.height - done);
+                return ErrorCode::Incomplete;
+            }
+
+            Log(LogLevel::Error, e.what());
+            return ErrorCode::BadFormat;
         }
 
+        Completed(rect.y, rect.height);
         return ErrorCode::Ok;
     }
 
+    uint32_t BandRows() const override
+    {
+        // whole rows of tiles, or enough line buffers (up to 32 lines each) to keep the thread pool busy
+        if (tiledFile)
+            return tiledFile->tileYSize();
+        return 32 * (Threads > 2 ? Threads : 2);
+    }
+
 private:
 
     // IStream implementation
 
+    uint64_t pos = 0; // for memory sources
+
+    bool isMemoryMapped() const override
+    {
+        return Data != nullptr;
+    }
+
+    char *readMemoryMapped(int n) override
+    {
+        if (n < 0 || pos + n > DataSize || pos + n > Available)
+            throw Iex::InputExc("Unexpected end of file.");
+
+        auto ptr = (char *)Data + pos;
+        pos += n;
+        return ptr;
+    }
+
     bool read(char c[], int n) override
     {
-        auto rd = Read(c, n);
-        return rd == n;
+        if (Data)
+        {
+            memcpy(c, readMemoryMapped(n), n);
+            return pos < DataSize;
+        }
+
+        if (n < 0 || Source.Read(c, n) != (size_t)n)
+            throw Iex::InputExc("Unexpected end of file.");
+        return Source.Tell() < Source.Size();
     }
 
     uint64_t tellg() override
     {
-        return Seek(0, SeekOrigin::Current);
+        return Data ? pos : Source.Tell();
     }
 
-    void seekg(uint64_t pos) override
+    void seekg(uint64_t p) override
     {
-        Seek(pos, SeekOrigin::Begin);
+        if (Data)
+            pos = p;
+        else
+            Source.SeekTo(p);
     }
 
     void clear() override {}
+
+    const Header &GetHeader() const
+    {
+        return file ? file->header() : rgbaFile->header();
+    }
+
+    // the slices address pixels by data window coordinates, so base is shifted to put (x, y) at dest
+    FrameBuffer MakeFrameBuffer(int x, int y, uint8_t *dest, ptrdiff_t yStride) const
+    {
+        ptrdiff_t compSize = type == HALF ? 2 : 4;
+        ptrdiff_t xStride = compSize * numChannels;
+        char *base = (char *)dest - x * xStride - y * yStride;
+
+        FrameBuffer fb;
+        for (int i = 0; i < numChannels; i++)
+            fb.insert(channelNames[i], Slice(type, base + i * compSize, xStride, yStride));
+        return fb;
+    }
+
+    // reads full width rows of the output window; only the line buffers covering them get decoded.
+    // OpenEXR converts to the frame buffer's type while decoding, so that's all decode time
+    void ReadScanlines(uint32_t y, uint32_t rows, uint8_t *dest, size_t stride)
+    {
+        PhaseTimer timer(Stats.Decode);
+        int y0 = outWindow.min.y + (int)y;
+        int y1 = y0 + (int)rows - 1;
+
+        if (rgbaFile)
+        {
+            ptrdiff_t yStride = stride / sizeof(Rgba);
+            rgbaFile->setFrameBuffer((Rgba *)dest - outWindow.min.x - y0 * yStride, 1, yStride);
+            rgbaFile->readPixels(y0, y1);
+        }
+        else
+        {
+            file->setFrameBuffer(MakeFrameBuffer(outWindow.min.x, y0, dest, stride));
+            file->readPixels(y0, y1);
+        }
+    }
+
+    // reads the tiles of the selected level that intersect rect, one row of tiles at a time; done counts the rows written
+    ErrorCode ReadTiles(const Rect &rect, uint8_t *dest, size_t stride, uint32_t &done)
+    {
+        size_t ps = GetPixelSize(Format);
+        uint32_t tw = tiledFile->tileXSize();
+        uint32_t th = tiledFile->tileYSize();
+        int dx0 = rect.x / tw, dx1 = (rect.x + rect.width - 1) / tw;
+        int dy0 = rect.y / th, dy1 = (rect.y + rect.height - 1) / th;
+
+        uint32_t sx = dx0 * tw;
+        uint32_t sw = (dx1 + 1) * tw < Width ? (dx1 + 1) * tw - sx : Width - sx;
+        size_t scratchStride = sw * ps;
+        size_t capacity = scratch.capacity();
+        scratch.resize(scratchStride * th);
+        Stats.Hold((int64_t)scratch.capacity() - (int64_t)capacity);
+
+        for (int dy = dy0; dy <= dy1; dy++)
+        {
+            if (!Continue())
+                return ErrorCode::Cancelled;
+
+            uint32_t sy = dy * th;
+            {
+                PhaseTimer timer(Stats.Decode);
+                tiledFile->setFrameBuffer(MakeFrameBuffer(outWindow.min.x + sx, outWindow.min.y + sy, scratch.data(), scratchStride));
+                tiledFile->readTiles(dx0, dx1, dy, dy, levelX, levelY);
+            }
+
+            // rows of this tile row that are inside rect
+            uint32_t y0 = sy > rect.y ? sy : rect.y;
+            uint32_t y1 = sy + th < rect.y + rect.height ? sy + th : rect.y + rect.height;
+            PhaseTimer timer(Stats.Copy);
+            CopyRows(dest + (y0 - rect.y) * stride, stride, scratch.data() + (y0 - sy) * scratchStride + (rect.x - sx) * ps, scratchStride,
+                rect.width * ps, y1 - y0);
+            done = y1 - rect.y;
+        }
+
+        return ErrorCode::Ok;
+    }
+
+    // the line buffers get decompressed in parallel on the global pool
+    int FileThreads() const
+    {
+        return Threads > 1 ? Threads : 0;
+    }
+
+    // uses the preview image if it still covers the target size
+    void SelectReduction()
+    {
+        uint32_t reqX, reqY;
+        uint32_t sizeX = dw.max.x - dw.min.x + 1;
+        uint32_t sizeY = dw.max.y - dw.min.y + 1;
+        GetTargetSize(Options, sizeX, sizeY, reqX, reqY);
+        if (reqX == sizeX && reqY == sizeY)
+            return;
+
+        const Header &header = GetHeader();
+        if (header.hasPreviewImage())
+        {
+            auto &preview = header.previewImage();
+            if (preview.width() >= reqX && preview.height() >= reqY)
+            {
+                usePreview = true;
+                Format = NativePixelFormat::RGBA_UN8;
+                outWindow = Box2i(V2i(0, 0), V2i(preview.width() - 1, preview.height() - 1));
+            }
+        }
+    }
+
+    // picks the smallest mip/rip level of tiledFile that still covers the target size
+    void SelectLevel()
+    {
+        uint32_t reqX, reqY;
+        uint32_t sizeX = dw.max.x - dw.min.x + 1;
+        uint32_t sizeY = dw.max.y - dw.min.y + 1;
+        GetTargetSize(Options, sizeX, sizeY, reqX, reqY);
+        LevelMode mode = tiledFile->header().tileDescription().mode;
+        if ((reqX == sizeX && reqY == sizeY) || mode == ONE_LEVEL)
+            return;
+
+        // levels shrink monotonically, so the last one that fits is the smallest
+        int lx = 0, ly = 0;
+        if (mode == MIPMAP_LEVELS)
+        {
+            for (int l = 1; l < tiledFile->numLevels(); l++)
+                if ((uint32_t)tiledFile->levelWidth(l) >= reqX && (uint32_t)tiledFile->levelHeight(l) >= reqY)
+                    lx = ly = l;
+        }
+        else
+        {
+            for (int l = 1; l < tiledFile->numXLevels(); l++)
+                if ((uint32_t)tiledFile->levelWidth(l) >= reqX)
+                    lx = l;
+            for (int l = 1; l < tiledFile->numYLevels(); l++)
+                if ((uint32_t)tiledFile->levelHeight(l) >= reqY)
+                    ly = l;
+        }
+
+        levelX = lx;
+        levelY = ly;
+        outWindow = tiledFile->dataWindowForLevel(lx, ly);
+    }
+
+    // picks the channels for the direct path, false if the file needs RgbaInputFile
+    bool SelectChannels()
+    {
+        const ChannelList &channels = file->header().channels();
+
+        const char *rgba[] = { "R", "G", "B", "A" };
+        if (channels.findChannel("R") && channels.findChannel("G") && channels.findChannel("B"))
+            numChannels = channels.findChannel("A") ? 4 : 3;
+        else
+        {
+            // a single channel of any name (depth, masks, ...) except for luminance, which should stay gray
+            auto it = channels.begin();
+            if (it == channels.end() || !strcmp(it.name(), "Y"))
+                return false;
+
+            auto next = it;
+            if (++next != channels.end())
+                return false;
+
+            rgba[0] = it.name();
+            numChannels = 1;
+        }
+
+        bool isHalf = true;
+        for (int i = 0; i < numChannels; i++)
+        {
+            const Channel *ch = channels.findChannel(rgba[i]);
+            if (ch->xSampling != 1 || ch->ySampling != 1)
+                return false;
+
+            // UINT channels get converted to float by the library
+            isHalf = isHalf && ch->type == HALF;
+            channelNames[i] = rgba[i];
+        }
+
+        type = isHalf ? HALF : FLOAT;
+        switch (numChannels)
+        {
+        case 1: Format = isHalf ? NativePixelFormat::R_F16 : NativePixelFormat::R_F32; break;
+        case 3: Format = isHalf ? NativePixelFormat::RGB_F16 : NativePixelFormat::RGB_F32; break;
+        default: Format = isHalf ? NativePixelFormat::RGBA_F16 : NativePixelFormat::RGBA_F32; break;
+        }
+        return true;
+    }
 };
 
-IDecoder *CreateOpenExrDecoder() { return new OpenExrDecoder(); }
+void SetOpenExrThreadPool(int threads)
+{
+    // a single thread is better served by decoding on the calling thread
+    setGlobalThreadCount(threads > 1 ? threads : 0);
+}
+
+IDecoder *CreateOpenExrDecoder()
+{
+    // OpenEXR's global pool starts out empty; size it to the thread limit unless SetThreadLimit() already did
+    static std::once_flag poolInit;
+    std::call_once(poolInit, [] { if (!globalThreadCount()) SetOpenExrThreadPool(GetThreadLimit()); });
+
+    return new OpenExrDecoder();
+}
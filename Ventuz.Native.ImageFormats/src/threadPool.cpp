@@ -0,0 +1,129 @@
+/*
+ * Ventuz.ImageSharp.Native
+ * Copyright (c) 2024 Ventuz Technology <https://ventuz.com>
+ *
+ * This file is part of Ventuz.ImageSharp.Native
+ *
+ * Ventuz.ImageSharp.Native is free software: you can redistribute
+ * it and/or modify it under the terms of the GNU Lesser General
+ * Public License as published by the Free Software Foundation,
+ * either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * Ventuz.ImageSharp.Native is distributed in the hope that it will
+ * be useful, but WITHOUT ANY WARRANTY; without even the implied
+ * warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with Ventuz.ImageSharp.Native.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "threadPool.h"
+
+ThreadPool::ThreadPool(int threads)
+{
+    if (threads < 1)
+        threads = 1;
+
+    for (int i = 0; i < threads; i++)
+        queues.emplace_back(new Queue());
+
+    for (int i = 1; i < threads; i++)
+        workers.emplace_back(&ThreadPool::Worker, this, (size_t)i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stop = true;
+    }
+    wake.notify_all();
+
+    for (auto &t : workers)
+        t.join();
+}
+
+void ThreadPool::Submit(size_t thread, Task task)
+{
+    Queue &q = *queues[thread % queues.size()];
+    {
+        std::lock_guard<std::mutex> guard(q.lock);
+        q.tasks.push_back(std::move(task));
+    }
+
+    unfinished++;
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        queued++;
+    }
+    wake.notify_one();
+}
+
+bool ThreadPool::RunOne(size_t thread)
+{
+    Task task;
+    size_t count = queues.size();
+
+    // own queue from the back, then the others from the front
+    for (size_t i = 0; i < count && !task; i++)
+    {
+        Queue &q = *queues[(thread + i) % count];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.tasks.empty())
+            continue;
+
+        if (i == 0)
+        {
+            task = std::move(q.tasks.back());
+            q.tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+        }
+    }
+
+    if (!task)
+        return false;
+
+    queued--;
+    task(thread);
+
+    if (--unfinished == 0)
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        done.notify_all();
+    }
+    return true;
+}
+
+void ThreadPool::Worker(size_t thread)
+{
+    for (;;)
+    {
+        if (RunOne(thread))
+            continue;
+
+        std::unique_lock<std::mutex> guard(sleepLock);
+        wake.wait(guard, [this] { return stop || queued > 0; });
+        if (stop)
+            return;
+    }
+}
+
+void ThreadPool::Wait()
+{
+    while (unfinished > 0)
+    {
+        if (RunOne(0))
+            continue;
+
+        // the rest is running on the workers
+        std::unique_lock<std::mutex> guard(sleepLock);
+        done.wait(guard, [this] { return unfinished == 0 || queued > 0; });
+    }
+}